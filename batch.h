@@ -0,0 +1,136 @@
+#pragma once
+//Coalescing of small messages into batches
+//Author: Ugo Varetto
+//Sending each small record as a separate message costs a syscall and the
+//framing overhead per record; the Batcher packs records into a single
+//frame which is sent when it reaches a size threshold or when the oldest
+//record has been waiting longer than a maximum delay.
+//Batch frame format, integers in host byte order:
+//|"ZBT1"|size 0 (uint32)|record 0|size 1|record 1|...
+//A batch is sent as the last frame of a message, preceded by an optional
+//topic frame, so that subscription filtering keeps working: one Batcher
+//per topic.
+//Receivers call ForEachRecord on every received payload: frames without
+//the batch magic are passed through as a single record, so that batched
+//and non batched publishers can be mixed.
+//There is no timer thread: the delay is checked when records are added;
+//producers that block waiting for data should call Flush before
+//blocking or poll with a timeout computed through Timeout.
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include <zmq.h>
+
+const char BATCH_MAGIC[] = {'Z', 'B', 'T', '1'};
+
+//------------------------------------------------------------------------------
+class Batcher {
+public:
+    typedef std::chrono::steady_clock Clock;
+    Batcher(void* socket, const void* topic = nullptr, size_t topicSize = 0,
+            size_t maxBytes = 0x10000,
+            std::chrono::microseconds maxDelay
+                = std::chrono::microseconds(1000))
+        : socket_(socket),
+          topic_(static_cast< const char* >(topic),
+                 static_cast< const char* >(topic) + topicSize),
+          maxBytes_(maxBytes), maxDelay_(maxDelay) {
+        buffer_.reserve(maxBytes_ + sizeof(BATCH_MAGIC));
+    }
+    Batcher(const Batcher&) = delete;
+    Batcher& operator=(const Batcher&) = delete;
+    //append record and send batch if size or delay threshold reached;
+    //returns false if sending failed
+    bool Add(const void* data, size_t size, Clock::time_point now
+                                                = Clock::now()) {
+        if(buffer_.empty()) {
+            buffer_.insert(buffer_.end(), BATCH_MAGIC,
+                           BATCH_MAGIC + sizeof(BATCH_MAGIC));
+            first_ = now;
+        }
+        const uint32_t sz = uint32_t(size);
+        const char* p = reinterpret_cast< const char* >(&sz);
+        buffer_.insert(buffer_.end(), p, p + sizeof(sz));
+        p = static_cast< const char* >(data);
+        buffer_.insert(buffer_.end(), p, p + size);
+        ++records_;
+        if(buffer_.size() >= maxBytes_ || now - first_ >= maxDelay_)
+            return Flush();
+        return true;
+    }
+    //send pending records, if any
+    bool Flush() {
+        if(!records_) return true;
+        bool ok = true;
+        if(!topic_.empty())
+            ok = zmq_send(socket_, topic_.data(), topic_.size(),
+                          ZMQ_SNDMORE) >= 0;
+        ok = ok && zmq_send(socket_, buffer_.data(), buffer_.size(), 0) >= 0;
+        buffer_.clear();
+        records_ = 0;
+        ++batches_;
+        return ok;
+    }
+    //milliseconds until pending records must be sent, -1 if nothing
+    //pending; to be used as zmq_poll timeout
+    long Timeout(Clock::time_point now = Clock::now()) const {
+        if(!records_) return -1;
+        const auto left = first_ + maxDelay_ - now;
+        if(left <= Clock::duration::zero()) return 0;
+        //round up: returning early would only cause a spurious wakeup
+        const auto ns =
+            std::chrono::duration_cast< std::chrono::nanoseconds >(left)
+            .count();
+        return long((ns + 999999) / 1000000);
+    }
+    //send pending records if the delay expired
+    bool Poll(Clock::time_point now = Clock::now()) {
+        return records_ && now - first_ >= maxDelay_ ? Flush() : true;
+    }
+    size_t Pending() const { return records_; }
+    uint64_t Batches() const { return batches_; }
+private:
+    void* socket_;
+    std::vector< char > topic_;
+    size_t maxBytes_;
+    Clock::duration maxDelay_;
+    std::vector< char > buffer_;
+    size_t records_ = 0;
+    uint64_t batches_ = 0;
+    Clock::time_point first_;
+};
+
+//------------------------------------------------------------------------------
+inline bool IsBatch(const void* data, size_t size) {
+    return size >= sizeof(BATCH_MAGIC)
+           && memcmp(data, BATCH_MAGIC, sizeof(BATCH_MAGIC)) == 0;
+}
+
+//------------------------------------------------------------------------------
+//invoke f(const char* data, size_t size) on each record of a batch, or once
+//on the entire buffer if not a batch; records are views into the buffer,
+//no copies; returns false if the batch is truncated
+template < typename F >
+bool ForEachRecord(const void* data, size_t size, F&& f) {
+    const char* p = static_cast< const char* >(data);
+    if(!IsBatch(p, size)) {
+        f(p, size);
+        return true;
+    }
+    const char* const end = p + size;
+    p += sizeof(BATCH_MAGIC);
+    while(p != end) {
+        uint32_t sz;
+        if(size_t(end - p) < sizeof(sz)) return false;
+        memcpy(&sz, p, sizeof(sz));
+        p += sizeof(sz);
+        if(size_t(end - p) < sz) return false;
+        f(p, size_t(sz));
+        p += sz;
+    }
+    return true;
+}
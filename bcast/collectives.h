@@ -0,0 +1,264 @@
+#pragma once
+//Collective operations among the processes on a node over PUSH/PULL
+//Author: Ugo Varetto
+//Each process binds one PULL socket, the rank is the index of the first
+//free URI, as with BindURI: URIs must be endpoints whose bind fails when
+//already bound, e.g. TCP ports, not ipc paths, which libzmq unlinks and
+//binds again; PUSH sockets are connected on demand only to
+//the peers a process actually sends to, O(log N) or O(1) per process
+//instead of the N x N mesh.
+//Algorithms, selected by message size and number of processes:
+// - Broadcast: binomial tree, log N steps; for large messages scatter from
+//   the root followed by ring allgather, so that the root sends the data
+//   once instead of log N times
+// - Allgather: ring, N - 1 steps, each process sends and receives one
+//   block per step
+// - Allreduce: recursive doubling, log N steps, processes beyond the
+//   largest power of two fold their data into a partner first; for large
+//   arrays ring reduce-scatter followed by ring allgather, which moves
+//   2 * (N - 1) / N times the data instead of log N times
+//All processes must call the same collectives in the same order: messages
+//are tagged with the operation and step numbers and messages received
+//ahead of time are buffered until requested.
+//Message format: |Header|payload|
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <functional>
+#include <stdexcept>
+#include <algorithm>
+
+#include <zmq.h>
+
+#include "../multipart.h"
+#include "../utility.h"
+
+//------------------------------------------------------------------------------
+class Communicator {
+public:
+  typedef std::function< std::string (int rank) > URIFun;
+  enum : size_t {LARGE_MESSAGE = 0x10000};
+  //bind to the first free URI in [uri(0), uri(size)): the index is the rank;
+  //uri(r) is used both to bind and to connect
+  Communicator(void* ctx, int size, URIFun uri)
+    : ctx_(ctx), size_(size), uri_(uri) {
+    pull_ = ZCheck(zmq_socket(ctx_, ZMQ_PULL));
+    for(rank_ = 0; rank_ != size_; ++rank_) {
+      if(zmq_bind(pull_, uri_(rank_).c_str()) == 0) break;
+    }
+    if(rank_ == size_) {
+      zmq_close(pull_);
+      throw std::runtime_error("Cannot bind");
+    }
+  }
+  Communicator(const Communicator&) = delete;
+  Communicator& operator=(const Communicator&) = delete;
+  ~Communicator() {
+    for(auto& p: push_) zmq_close(p.second);
+    zmq_close(pull_);
+  }
+  int Rank() const { return rank_; }
+  int Size() const { return size_; }
+  //on return 'data' holds the content of 'data' at the root
+  void Broadcast(int root, std::vector< char >& data) {
+    ++op_;
+    uint64_t sz = data.size();
+    TreeBroadcast(root, &sz, sizeof(sz), 0);
+    data.resize(size_t(sz));
+    if(sz < LARGE_MESSAGE || size_ < 3) {
+      TreeBroadcast(root, data.data(), data.size(), 1);
+    } else {
+      ScatterAllgather(root, data);
+    }
+  }
+  //on return all[r] holds the 'mine' block of rank r
+  void Allgather(const std::vector< char >& mine,
+                 std::vector< std::vector< char > >& all) {
+    ++op_;
+    all.resize(size_);
+    all[rank_] = mine;
+    const int next = (rank_ + 1) % size_;
+    const int prev = (rank_ + size_ - 1) % size_;
+    for(int s = 0; s != size_ - 1; ++s) {
+      const std::vector< char >& out = all[(rank_ - s + size_) % size_];
+      Send(next, s, out.data(), out.size());
+      const Frame f = Recv(prev, s);
+      all[(rank_ - s - 1 + size_) % size_].assign(f.begin(), f.end());
+    }
+  }
+  //element-wise reduction of 'data' across all processes, result available
+  //in all processes; 'op' must be associative and commutative
+  template < typename T, typename OpT >
+  void Allreduce(std::vector< T >& data, OpT op) {
+    ++op_;
+    if(size_ == 1) return;
+    if(data.size() * sizeof(T) < LARGE_MESSAGE || data.size() < size_t(size_))
+      RecursiveDoubling(data, op);
+    else RingAllreduce(data, op);
+  }
+  template < typename T >
+  void Allreduce(std::vector< T >& data) {
+    Allreduce(data, std::plus< T >());
+  }
+private:
+  struct Header {
+    uint32_t op;
+    uint32_t step;
+    int32_t source;
+  };
+  typedef std::tuple< uint32_t, uint32_t, int > Key;
+  void* Push(int dest) {
+    auto i = push_.find(dest);
+    if(i != push_.end()) return i->second;
+    void* s = ZCheck(zmq_socket(ctx_, ZMQ_PUSH));
+    ZCheck(zmq_connect(s, uri_(dest).c_str()));
+    push_[dest] = s;
+    return s;
+  }
+  void Send(int dest, uint32_t step, const void* data, size_t size) {
+    const Header h = {op_, step, rank_};
+    void* s = Push(dest);
+    ZCheck(zmq_send(s, &h, sizeof(h), ZMQ_SNDMORE));
+    ZCheck(zmq_send(s, data, size, 0));
+  }
+  //receive payload of message from 'source' for current operation and
+  //'step', buffering messages for other steps and operations
+  Frame Recv(int source, uint32_t step) {
+    const Key key(op_, step, source);
+    auto i = pending_.find(key);
+    if(i != pending_.end()) {
+      Frame f = std::move(i->second);
+      pending_.erase(i);
+      return f;
+    }
+    while(true) {
+      if(!recv_frames(pull_, msg_) || msg_.size() != 2
+         || msg_[0].size() != sizeof(Header))
+        throw std::runtime_error("Invalid message");
+      Header h;
+      memcpy(&h, msg_[0].data(), sizeof(h));
+      const Key k(h.op, h.step, h.source);
+      if(k == key) return std::move(msg_[1]);
+      pending_.insert(std::make_pair(k, std::move(msg_[1])));
+    }
+  }
+  void RecvInto(int source, uint32_t step, void* data, size_t size) {
+    const Frame f = Recv(source, step);
+    if(f.size() != size) throw std::runtime_error("Unexpected message size");
+    if(size) memcpy(data, f.data(), size);
+  }
+  //binomial tree rooted at 'root', relative rank r receives from r - mask,
+  //mask = lowest bit set in r, then sends to r + mask for all lower masks
+  void TreeBroadcast(int root, void* data, size_t size, uint32_t step) {
+    const int r = (rank_ - root + size_) % size_;
+    int mask = 1;
+    while(mask < size_) {
+      if(r & mask) {
+        RecvInto((rank_ - mask + size_) % size_, step, data, size);
+        break;
+      }
+      mask <<= 1;
+    }
+    for(mask >>= 1; mask > 0; mask >>= 1) {
+      if(r + mask < size_) Send((rank_ + mask) % size_, step, data, size);
+    }
+  }
+  //[begin, end) of chunk c out of 'size_' chunks
+  std::pair< size_t, size_t > Chunk(size_t n, int c) const {
+    return std::make_pair(n * c / size_, n * (c + 1) / size_);
+  }
+  //root sends chunk i to relative rank i, then ring allgather of chunks
+  void ScatterAllgather(int root, std::vector< char >& data) {
+    const int r = (rank_ - root + size_) % size_;
+    const size_t n = data.size();
+    if(r == 0) {
+      for(int i = 1; i != size_; ++i) {
+        const auto c = Chunk(n, i);
+        Send((root + i) % size_, 1, data.data() + c.first,
+             c.second - c.first);
+      }
+    } else {
+      const auto c = Chunk(n, r);
+      RecvInto(root, 1, data.data() + c.first, c.second - c.first);
+    }
+    const int next = (rank_ + 1) % size_;
+    const int prev = (rank_ + size_ - 1) % size_;
+    for(int s = 0; s != size_ - 1; ++s) {
+      const auto out = Chunk(n, (r - s + size_) % size_);
+      Send(next, 2 + s, data.data() + out.first, out.second - out.first);
+      const auto in = Chunk(n, (r - s - 1 + size_) % size_);
+      RecvInto(prev, 2 + s, data.data() + in.first, in.second - in.first);
+    }
+  }
+  template < typename T, typename OpT >
+  void Reduce(T* acc, const T* in, size_t n, OpT& op) {
+    for(size_t i = 0; i != n; ++i) acc[i] = op(acc[i], in[i]);
+  }
+  template < typename T, typename OpT >
+  void RecursiveDoubling(std::vector< T >& data, OpT& op) {
+    const size_t bytes = data.size() * sizeof(T);
+    std::vector< T > in(data.size());
+    int p2 = 1;
+    while(2 * p2 <= size_) p2 *= 2;
+    const int FOLD = 0;
+    const int UNFOLD = 1;
+    //fold processes beyond p2 into the first ones
+    if(rank_ >= p2) {
+      Send(rank_ - p2, FOLD, data.data(), bytes);
+      RecvInto(rank_ - p2, UNFOLD, data.data(), bytes);
+      return;
+    }
+    if(rank_ + p2 < size_) {
+      RecvInto(rank_ + p2, FOLD, in.data(), bytes);
+      Reduce(data.data(), in.data(), data.size(), op);
+    }
+    uint32_t step = 2;
+    for(int mask = 1; mask < p2; mask <<= 1, ++step) {
+      const int partner = rank_ ^ mask;
+      Send(partner, step, data.data(), bytes);
+      RecvInto(partner, step, in.data(), bytes);
+      Reduce(data.data(), in.data(), data.size(), op);
+    }
+    if(rank_ + p2 < size_) Send(rank_ + p2, UNFOLD, data.data(), bytes);
+  }
+  template < typename T, typename OpT >
+  void RingAllreduce(std::vector< T >& data, OpT& op) {
+    const size_t n = data.size();
+    const int next = (rank_ + 1) % size_;
+    const int prev = (rank_ + size_ - 1) % size_;
+    std::vector< T > in(n / size_ + 1);
+    uint32_t step = 0;
+    //reduce-scatter: after N - 1 steps rank r holds the reduced chunk r + 1
+    for(int s = 0; s != size_ - 1; ++s, ++step) {
+      const auto out = Chunk(n, (rank_ - s + size_) % size_);
+      Send(next, step, data.data() + out.first,
+           (out.second - out.first) * sizeof(T));
+      const auto c = Chunk(n, (rank_ - s - 1 + size_) % size_);
+      RecvInto(prev, step, in.data(), (c.second - c.first) * sizeof(T));
+      Reduce(data.data() + c.first, in.data(), c.second - c.first, op);
+    }
+    //allgather of the reduced chunks
+    for(int s = 0; s != size_ - 1; ++s, ++step) {
+      const auto out = Chunk(n, (rank_ + 1 - s + size_) % size_);
+      Send(next, step, data.data() + out.first,
+           (out.second - out.first) * sizeof(T));
+      const auto c = Chunk(n, (rank_ - s + size_) % size_);
+      RecvInto(prev, step, data.data() + c.first,
+               (c.second - c.first) * sizeof(T));
+    }
+  }
+private:
+  void* ctx_;
+  int size_;
+  int rank_ = 0;
+  URIFun uri_;
+  void* pull_ = nullptr;
+  std::map< int, void* > push_;
+  uint32_t op_ = 0;
+  std::map< Key, Frame > pending_;
+  Frames msg_;
+};
@@ -2,7 +2,10 @@
 // Created by Ugo Varetto on 8/30/16.
 //
 
-//IN PROGRESS SINGLE-NODE BROADCAST
+//SINGLE-NODE BROADCAST
+//shm (default): shared memory rings, one writer and N - 1 readers each
+//tcp: PUSH/PULL mesh over localhost ports
+//coll: collective operations over PUSH/PULL (see collectives.h)
 
 #include <cstdlib>
 #include <iostream>
@@ -12,15 +15,22 @@
 #include <string>
 #include <stdexcept>
 #include <set>
+#include <memory>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
 
 #include <unistd.h>
 
 #include <zmq.h>
 
 #include "../utility.h"
+#include "shmring.h"
+#include "collectives.h"
 
 using namespace std;
 
+//------------------------------------------------------------------------------
 int BindURI(void* ss,
             const string& base,
             int startID,
@@ -33,9 +43,10 @@ int BindURI(void* ss,
   return -1;
 }
 
-int main(int, char**) {
-
-  const int N = 4;
+//------------------------------------------------------------------------------
+//N x N mesh of PUSH/PULL sockets: each broadcast is N - 1 copies through
+//the kernel
+void TCPBroadcast(int N) {
   const char* PUSH_URI_BASE = "tcp://*:";
   const int ID_BASE = 8888;
   auto worker = [=](int id) {
@@ -68,5 +79,104 @@ int main(int, char**) {
     tasks.push_back(async(launch::async, worker, i));
   }
   for(auto& t: tasks) t.get();
+}
+
+//------------------------------------------------------------------------------
+//one shared memory ring per process (see shmring.h): each broadcast is a
+//single write, read in place by all the other processes; the ring id is
+//the first free ring name, as with BindURI
+void ShmBroadcast(int N) {
+  const string RING_BASE = "/zmq-scratch-bcast-";
+  const uint32_t SLOTS = 1024;
+  const uint32_t SLOT_SIZE = 0x1000;
+  const chrono::milliseconds OPEN_TIMEOUT(10000);
+  const chrono::milliseconds RECV_TIMEOUT(10000);
+  auto worker = [=](int id) {
+    unique_ptr< ShmRing > ring;
+    const int bound = CreateRing(RING_BASE, 0, N, SLOTS, SLOT_SIZE, ring);
+    if(bound < 0) throw std::runtime_error("Cannot create ring");
+    //open all the other rings before writing: the owner of a ring does not
+    //remove it before receiving from all the other processes, which
+    //therefore already mapped it
+    vector< unique_ptr< ShmRing > > peers;
+    for(int i = 0; i != N; ++i) {
+      if(i == bound) continue;
+      peers.push_back(unique_ptr< ShmRing >(
+        new ShmRing(RING_BASE + to_string(i), OPEN_TIMEOUT)));
+      printf("Mapped %s \n", peers.back()->name().c_str());
+    }
+    ring->Write(&id, sizeof(id));
+    vector< char > buffer;
+    for (int i = 0; i != N - 1; ++i) {
+      ShmRing::Cursor c;
+      if(peers[i]->Read(c, buffer, RECV_TIMEOUT) != sizeof(int))
+        throw std::runtime_error("Receive timeout");
+      //the ring holds a single message: anything lost is an error
+      if(c.lost)
+        throw std::runtime_error(to_string(c.lost) + " messages lost from "
+                                 + peers[i]->name());
+      int r = -1;
+      memcpy(&r, buffer.data(), sizeof(r));
+      printf("%d %d\n", r, i);
+    }
+  };
+  vector< future< void > > tasks;
+  for(int i = 0; i != N; ++i) {
+    tasks.push_back(async(launch::async, worker, i));
+  }
+  for(auto& t: tasks) t.get();
+}
+
+//------------------------------------------------------------------------------
+//ids exchanged through allgather instead of N x N sends, plus broadcast of
+//a parameter buffer from rank 0 and a global sum
+void CollectiveBroadcast(int N) {
+  const size_t PARAMETERS = 0x100000;
+  //TCP ports: binding a port already in use fails, which is what rank
+  //discovery relies on; ipc endpoints are silently taken over instead
+  const int PORT_BASE = 9888;
+  auto worker = [=](int id) {
+    void *ctx = ZCheck(zmq_ctx_new());
+    {
+      Communicator comm(ctx, N, [PORT_BASE](int rank) {
+        return "tcp://127.0.0.1:" + to_string(PORT_BASE + rank);
+      });
+      vector< char > mine(sizeof(id));
+      memcpy(mine.data(), &id, sizeof(id));
+      vector< vector< char > > all;
+      comm.Allgather(mine, all);
+      for (int i = 0; i != N; ++i) {
+        if(i == comm.Rank()) continue;
+        int r = -1;
+        memcpy(&r, all[i].data(), sizeof(r));
+        printf("%d %d\n", r, i);
+      }
+      vector< char > parameters;
+      if(comm.Rank() == 0) parameters.resize(PARAMETERS, 1);
+      comm.Broadcast(0, parameters);
+      vector< long > sum(1, long(parameters.size()));
+      comm.Allreduce(sum);
+      printf("rank %d: total parameters received %ld\n", comm.Rank(), sum[0]);
+    }
+    ZCheck(zmq_ctx_destroy(ctx));
+  };
+  vector< future< void > > tasks;
+  for(int i = 0; i != N; ++i) {
+    tasks.push_back(async(launch::async, worker, i));
+  }
+  for(auto& t: tasks) t.get();
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  const int N = 4;
+  const string mode = argc > 1 ? argv[1] : "shm";
+  if(mode == "tcp") TCPBroadcast(N);
+  else if(mode == "shm") ShmBroadcast(N);
+  else if(mode == "coll") CollectiveBroadcast(N);
+  else {
+    cerr << "usage: " << argv[0] << " [shm(default)|tcp|coll]" << endl;
+    return EXIT_FAILURE;
+  }
   return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
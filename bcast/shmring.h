@@ -0,0 +1,320 @@
+#pragma once
+//Single producer multiple consumer broadcast ring in shared memory
+//Author: Ugo Varetto
+//Each process owns one ring it writes to, all the other processes on the
+//same node read from it: a broadcast is a single copy into shared memory
+//instead of one send per peer.
+//Layout: |header|slot 0|slot 1|...|, each slot is protected by a sequence
+//lock: the writer sets the slot sequence to an odd value before writing
+//and to the even value 2 * (message number + 1) after; readers copy the
+//data and check that the sequence did not change while copying.
+//The writer never waits for readers: a reader falling behind by more than
+//the number of slots skips to the oldest message still available and the
+//number of lost messages is reported.
+//Readers spin briefly and then sleep on a futex in the header, which the
+//writer increments and wakes only when there are sleeping readers
+//(Linux; other platforms fall back to short sleeps).
+//Rings are named POSIX shared memory objects; the ring of the owner is
+//created with O_EXCL, so that the first free name can be used for
+//discovery, as with BindURI over TCP ports; the owner unlinks it on
+//destruction.
+//The owner pid is stored in the header: rings left behind by a process
+//that did not exit cleanly are reclaimed by CreateRing and ignored by
+//readers until replaced.
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <system_error>
+#include <cstdint>
+#include <cstring>
+#include <climits>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "lock-free atomics required in shared memory");
+
+//------------------------------------------------------------------------------
+class ShmRing {
+public:
+  typedef std::chrono::steady_clock Clock;
+  //read position of a consumer
+  struct Cursor {
+    uint64_t next = 0;
+    uint64_t lost = 0;
+  };
+  //create ring, throws std::system_error with EEXIST if already present
+  ShmRing(const std::string& name, uint32_t slots, uint32_t slotSize)
+    : name_(Name(name)), owner_(true) {
+    const int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if(fd < 0) throw std::system_error(errno, std::system_category(),
+                                       "shm_open " + name_);
+    const size_t stride = Stride(slotSize);
+    size_ = sizeof(Header) + size_t(slots) * stride;
+    if(ftruncate(fd, off_t(size_)) != 0) {
+      const int e = errno;
+      close(fd);
+      shm_unlink(name_.c_str());
+      throw std::system_error(e, std::system_category(), "ftruncate");
+    }
+    Map(fd);
+    header_->slots = slots;
+    header_->slotSize = slotSize;
+    header_->stride = uint32_t(stride);
+    header_->head.store(0, std::memory_order_relaxed);
+    header_->futex.store(0, std::memory_order_relaxed);
+    header_->waiters.store(0, std::memory_order_relaxed);
+    header_->owner = int32_t(getpid());
+    for(uint32_t i = 0; i != slots; ++i)
+      GetSlot(i)->seq.store(0, std::memory_order_relaxed);
+    //readers do not access the ring before the magic number is set
+    header_->magic.store(MAGIC, std::memory_order_release);
+  }
+  //open ring created by another process, waiting up to 'timeout' for it
+  //to be created and initialized; rings whose owner is no longer running
+  //are skipped until replaced by a new owner
+  ShmRing(const std::string& name, std::chrono::milliseconds timeout)
+    : name_(Name(name)), owner_(false) {
+    const Clock::time_point deadline = Clock::now() + timeout;
+    while(true) {
+      const int fd = shm_open(name_.c_str(), O_RDWR, 0600);
+      struct stat st;
+      //size is zero until the owner calls ftruncate
+      if(fd >= 0 && fstat(fd, &st) == 0
+         && size_t(st.st_size) > sizeof(Header)) {
+        size_ = size_t(st.st_size);
+        Map(fd);
+        while(header_->magic.load(std::memory_order_acquire) != MAGIC
+              && Clock::now() <= deadline) {
+          std::this_thread::yield();
+        }
+        if(header_->magic.load(std::memory_order_acquire) == MAGIC
+           && Alive(header_->owner)) return;
+        munmap(header_, size_);
+        header_ = nullptr;
+      } else if(fd >= 0) close(fd);
+      if(Clock::now() > deadline) {
+        throw std::system_error(ETIMEDOUT, std::system_category(),
+                                "shm_open " + name_);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  ShmRing(const ShmRing&) = delete;
+  ShmRing& operator=(const ShmRing&) = delete;
+  ~ShmRing() {
+    munmap(header_, size_);
+    if(owner_) shm_unlink(name_.c_str());
+  }
+  //owner only: copy message into next slot and wake up sleeping readers
+  void Write(const void* data, size_t size) {
+    if(size > header_->slotSize)
+      throw std::length_error("message larger than ring slot");
+    const uint64_t n = header_->head.load(std::memory_order_relaxed);
+    Slot* s = GetSlot(n % header_->slots);
+    s->seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s->size = uint32_t(size);
+    memcpy(s->data(), data, size);
+    s->seq.store(2 * n + 2, std::memory_order_release);
+    header_->head.store(n + 1, std::memory_order_release);
+    header_->futex.fetch_add(1, std::memory_order_release);
+    if(header_->waiters.load(std::memory_order_acquire)) Wake();
+  }
+  //cursor positioned at the next message to be written
+  Cursor Tail() const {
+    Cursor c;
+    c.next = header_->head.load(std::memory_order_acquire);
+    return c;
+  }
+  //copy next message into 'out'; returns message size or -1 on timeout
+  int Read(Cursor& c, std::vector< char >& out,
+           std::chrono::milliseconds timeout) {
+    const Clock::time_point deadline = Clock::now() + timeout;
+    const int SPIN = 1000;
+    for(int i = 0;; ++i) {
+      const int size = TryRead(c, out);
+      if(size >= 0) return size;
+      const Clock::time_point now = Clock::now();
+      if(now >= deadline) return -1;
+      if(i < SPIN) continue;
+      //sleep until the next write or timeout; futex value read before
+      //checking the head, so that a write in between is not missed
+      const uint32_t f = header_->futex.load(std::memory_order_acquire);
+      if(header_->head.load(std::memory_order_acquire) > c.next) continue;
+      header_->waiters.fetch_add(1, std::memory_order_acq_rel);
+      Wait(f, deadline - now);
+      header_->waiters.fetch_sub(1, std::memory_order_acq_rel);
+    }
+  }
+  uint32_t SlotSize() const { return header_->slotSize; }
+  const std::string& name() const { return name_; }
+  //unlink ring if initialized by a process no longer running; returns
+  //true if the ring was removed. The check and the unlink are performed
+  //holding a lock on the ring and only if the name still refers to the
+  //locked ring, so that concurrent callers never remove a ring created
+  //after the stale one was unlinked
+  static bool Reclaim(const std::string& name) {
+    const std::string n = Name(name);
+    const int fd = shm_open(n.c_str(), O_RDWR, 0600);
+    if(fd < 0) return false;
+    bool removed = false;
+    struct stat st;
+    if(flock(fd, LOCK_EX) == 0 && fstat(fd, &st) == 0
+       && size_t(st.st_size) >= sizeof(Header)) {
+      const int cur = shm_open(n.c_str(), O_RDONLY, 0600);
+      struct stat cst;
+      const bool same = cur >= 0 && fstat(cur, &cst) == 0
+                        && cst.st_ino == st.st_ino && cst.st_dev == st.st_dev;
+      if(cur >= 0) close(cur);
+      void* p = same ? mmap(nullptr, sizeof(Header), PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0)
+                     : MAP_FAILED;
+      if(p != MAP_FAILED) {
+        const Header* h = static_cast< const Header* >(p);
+        if(h->magic.load(std::memory_order_acquire) == MAGIC
+           && !Alive(h->owner)) {
+          removed = shm_unlink(n.c_str()) == 0;
+        }
+        munmap(p, sizeof(Header));
+      }
+    }
+    close(fd); //releases the lock
+    return removed;
+  }
+private:
+  enum : uint32_t {MAGIC = 0x5348524E}; //SHRN
+  enum {CACHE_LINE = 64};
+  struct alignas(CACHE_LINE) Header {
+    std::atomic< uint32_t > magic;
+    uint32_t slots;
+    uint32_t slotSize;
+    uint32_t stride;
+    int32_t owner; //pid
+    alignas(CACHE_LINE) std::atomic< uint64_t > head; //next message number
+    alignas(CACHE_LINE) std::atomic< uint32_t > futex;
+    std::atomic< uint32_t > waiters;
+  };
+  struct Slot {
+    std::atomic< uint64_t > seq;
+    uint32_t size;
+    char* data() { return reinterpret_cast< char* >(this + 1); }
+  };
+  static std::string Name(const std::string& n) {
+    return n.empty() || n[0] != '/' ? "/" + n : n;
+  }
+  static bool Alive(int32_t pid) {
+    return kill(pid_t(pid), 0) == 0 || errno == EPERM;
+  }
+  static size_t Stride(uint32_t slotSize) {
+    const size_t s = sizeof(Slot) + slotSize;
+    return (s + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+  }
+  void Map(int fd) {
+    void* p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const int e = errno;
+    close(fd);
+    if(p == MAP_FAILED) {
+      if(owner_) shm_unlink(name_.c_str());
+      throw std::system_error(e, std::system_category(), "mmap");
+    }
+    header_ = static_cast< Header* >(p);
+  }
+  Slot* GetSlot(uint64_t i) const {
+    return reinterpret_cast< Slot* >(reinterpret_cast< char* >(header_)
+                                     + sizeof(Header) + i * header_->stride);
+  }
+  //-1 if no message available
+  int TryRead(Cursor& c, std::vector< char >& out) {
+    while(true) {
+      const uint64_t head = header_->head.load(std::memory_order_acquire);
+      if(head <= c.next) return -1;
+      //overrun: skip to oldest message still in the ring
+      if(head - c.next > header_->slots) {
+        c.lost += head - header_->slots - c.next;
+        c.next = head - header_->slots;
+      }
+      Slot* s = GetSlot(c.next % header_->slots);
+      const uint64_t expected = 2 * c.next + 2;
+      const uint64_t s1 = s->seq.load(std::memory_order_acquire);
+      //being overwritten: retry if the head moved, i.e. the message was
+      //lost and the cursor must skip ahead, otherwise return, so that the
+      //caller honours its deadline if the writer died in the middle of
+      //a write
+      if(s1 != expected) {
+        if(header_->head.load(std::memory_order_acquire) != head) continue;
+        return -1;
+      }
+      const uint32_t size = std::min(s->size, header_->slotSize);
+      out.resize(size);
+      memcpy(out.data(), s->data(), size);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(s->seq.load(std::memory_order_relaxed) != s1) continue;
+      ++c.next;
+      return int(size);
+    }
+  }
+  void Wait(uint32_t value, Clock::duration timeout) {
+#ifdef __linux__
+    const long long ns =
+      std::chrono::duration_cast< std::chrono::nanoseconds >(timeout).count();
+    timespec ts;
+    ts.tv_sec = time_t(ns / 1000000000);
+    ts.tv_nsec = long(ns % 1000000000);
+    syscall(SYS_futex, reinterpret_cast< uint32_t* >(&header_->futex),
+            FUTEX_WAIT, value, &ts, nullptr, 0);
+#else
+    (void) value;
+    std::this_thread::sleep_for(std::min(timeout, Clock::duration(
+                                         std::chrono::microseconds(50))));
+#endif
+  }
+  void Wake() {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast< uint32_t* >(&header_->futex),
+            FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+  }
+private:
+  std::string name_;
+  bool owner_;
+  size_t size_ = 0;
+  Header* header_ = nullptr;
+};
+
+//------------------------------------------------------------------------------
+//create ring with the first free name in base + [startID, startID +
+//maxProcesses), returns id or -1 if all taken; same discovery scheme as
+//BindURI; names held by rings of dead processes are reclaimed
+inline int CreateRing(const std::string& base, int startID, int maxProcesses,
+                      uint32_t slots, uint32_t slotSize,
+                      std::unique_ptr< ShmRing >& ring) {
+  for(int s = startID; s != startID + maxProcesses; ++s) {
+    const std::string name = base + std::to_string(s);
+    for(int attempt = 0; attempt != 2; ++attempt) {
+      try {
+        ring.reset(new ShmRing(name, slots, slotSize));
+        return s;
+      } catch(const std::system_error& e) {
+        if(e.code().value() != EEXIST) throw;
+      }
+      if(!ShmRing::Reclaim(name)) break;
+    }
+  }
+  return -1;
+}
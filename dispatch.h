@@ -0,0 +1,168 @@
+#pragma once
+//Worker selection policies for load balancing brokers
+//Author: Ugo Varetto
+//Each worker advertises a capacity (number of requests it accepts in
+//parallel) in its READY message and receives one credit per unit of
+//capacity; a credit is consumed when a request is dispatched to the worker
+//and returned when the reply is received. Among the workers with credit
+//left the worker is selected by one of the following policies:
+// - LRU: least recently used credit first; with capacity 1 this is the
+//   classic LRU queue of the ZGuide load balancing broker; O(1)
+// - LEAST_OUTSTANDING: lowest number of outstanding requests relative to
+//   capacity; O(log n)
+// - EWMA_LATENCY: lowest expected completion time, i.e. outstanding
+//   requests + 1 times the exponentially weighted moving average of the
+//   worker latency; workers without latency samples are selected first;
+//   O(log n)
+//Latency is the time between dispatch and reply, measured assuming the
+//worker replies in the order requests were dispatched.
+#include <deque>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <chrono>
+#include <string>
+#include <algorithm>
+
+//------------------------------------------------------------------------------
+class Dispatcher {
+public:
+    typedef std::chrono::steady_clock Clock;
+    enum Policy {LRU, LEAST_OUTSTANDING, EWMA_LATENCY};
+    explicit Dispatcher(Policy policy = LRU, double alpha = 0.2)
+        : policy_(policy), alpha_(alpha) {}
+    //"lru", "least", "ewma"
+    static Policy ParsePolicy(const std::string& name) {
+        if(name == "least") return LEAST_OUTSTANDING;
+        if(name == "ewma") return EWMA_LATENCY;
+        return LRU;
+    }
+    //add worker or update its capacity
+    void Ready(int id, int capacity = 1) {
+        Worker& w = workers_[id];
+        Unindex(id, w);
+        w.capacity = capacity < 1 ? 1 : capacity;
+        Index(id, w);
+    }
+    //remove worker, e.g. on expiration; outstanding requests are forgotten
+    void Remove(int id) {
+        auto i = workers_.find(id);
+        if(i == workers_.end()) return;
+        Unindex(id, i->second);
+        if(policy_ == LRU) PurgeTokens(id, i->second, 0);
+        workers_.erase(i);
+    }
+    //true if at least one worker has credit left
+    bool Available() const {
+        return policy_ == LRU ? credits_ > 0 : !ranked_.empty();
+    }
+    //total number of credits left
+    int Credits() const { return credits_; }
+    //select worker and consume one credit, -1 if no worker available
+    int Select(Clock::time_point now = Clock::now()) {
+        int id = -1;
+        if(policy_ == LRU) {
+            if(!lru_.empty()) {
+                id = lru_.front();
+                lru_.pop_front();
+                --workers_[id].tokens;
+            }
+        } else if(!ranked_.empty()) {
+            id = ranked_.begin()->second;
+        }
+        if(id < 0) return -1;
+        Worker& w = workers_[id];
+        Unindex(id, w);
+        ++w.outstanding;
+        w.dispatched.push_back(now);
+        Index(id, w);
+        return id;
+    }
+    //reply received from worker: return credit and update latency
+    void Completed(int id, Clock::time_point now = Clock::now()) {
+        auto i = workers_.find(id);
+        if(i == workers_.end()) return;
+        Worker& w = i->second;
+        Unindex(id, w);
+        if(w.outstanding) --w.outstanding;
+        if(!w.dispatched.empty()) {
+            const double latency =
+                std::chrono::duration< double >(now - w.dispatched.front())
+                .count();
+            w.dispatched.pop_front();
+            w.latency = w.samples ? alpha_ * latency
+                                    + (1 - alpha_) * w.latency
+                                  : latency;
+            ++w.samples;
+        }
+        Index(id, w);
+    }
+    bool Contains(int id) const { return workers_.count(id) != 0; }
+    int Outstanding(int id) const {
+        auto i = workers_.find(id);
+        return i == workers_.end() ? 0 : i->second.outstanding;
+    }
+    //average latency in seconds, 0 if no sample available
+    double Latency(int id) const {
+        auto i = workers_.find(id);
+        return i == workers_.end() ? 0 : i->second.latency;
+    }
+private:
+    struct Worker {
+        int capacity = 1;
+        int outstanding = 0;
+        int tokens = 0;       //LRU: entries in queue
+        double latency = 0;   //EWMA, seconds
+        unsigned samples = 0;
+        double rank = 0;      //key in ranked_ if indexed
+        int credited = 0;     //credits added to total if indexed
+        bool indexed = false;
+        std::deque< Clock::time_point > dispatched;
+    };
+    double Rank(const Worker& w) const {
+        if(policy_ == LEAST_OUTSTANDING)
+            return double(w.outstanding) / w.capacity;
+        return w.samples ? (w.outstanding + 1) * w.latency : 0;
+    }
+    //add worker to selection structures if it has credit left; credits_ is
+    //updated here and in Unindex only
+    void Index(int id, Worker& w) {
+        const int free = w.capacity - w.outstanding;
+        //LRU: the queue holds exactly one entry per free credit, entries in
+        //excess after a capacity reduction are removed; O(n) but only
+        //happens on capacity changes and removals
+        if(policy_ == LRU && w.tokens > std::max(free, 0))
+            PurgeTokens(id, w, std::max(free, 0));
+        if(free <= 0) return;
+        credits_ += free;
+        w.credited = free;
+        w.indexed = true;
+        if(policy_ == LRU) {
+            for(; w.tokens < free; ++w.tokens) lru_.push_back(id);
+        } else {
+            w.rank = Rank(w);
+            ranked_.insert(std::make_pair(w.rank, id));
+        }
+    }
+    void Unindex(int id, Worker& w) {
+        if(!w.indexed) return;
+        credits_ -= w.credited;
+        if(policy_ != LRU) ranked_.erase(std::make_pair(w.rank, id));
+        w.indexed = false;
+    }
+    void PurgeTokens(int id, Worker& w, int keep) {
+        for(auto i = lru_.begin(); i != lru_.end() && w.tokens > keep;) {
+            if(*i == id) {
+                i = lru_.erase(i);
+                --w.tokens;
+            } else ++i;
+        }
+    }
+private:
+    Policy policy_;
+    double alpha_;
+    int credits_ = 0;
+    std::unordered_map< int, Worker > workers_;
+    std::deque< int > lru_;
+    std::set< std::pair< double, int > > ranked_;
+};
@@ -2,43 +2,89 @@
 #include <iostream>
 #include <cstdlib>
 #include <vector>
+#include <memory>
+#include <algorithm>
 
 #include <zmq.h>
 #include <sodium.h>
 #include "sodium-util.h"
 #include "../utility.h"
+#include "../multipart.h"
 
 
 using namespace std;
 
+//  The server replies HANDSHAKE_RESET when it discards the handshake or the
+//  session, e.g. after the idle timeout: the handshake is repeated, up to
+//  MAX_HANDSHAKES times in a row
+const int MAX_HANDSHAKES = 3;
+
+unique_ptr< Session > Connect(void* requester) {
+    const bool INITIATE_OPTION = true;
+    for(int i = 1;; ++i) {
+        try {
+            const SecretNonce sn = HandShake(requester, INITIATE_OPTION);
+            //per-message nonces and keys derived from the shared secret
+            return unique_ptr< Session >(
+                new Session(sn, Session::INITIATOR));
+        } catch(const HandShakeReset&) {
+            if(i == MAX_HANDSHAKES) throw;
+        }
+    }
+}
+
 int main(int argc, char **argv) {
     if (argc < 3) {
-        cerr << "usage: " << argv[0] << " <server ip address> <port>" << endl;
+        cerr << "usage: " << argv[0] << " <server ip address> <port>"
+                " [messages per request, default 1]" << endl;
         return EXIT_FAILURE;
     }
     const string remoteAddress = "tcp://" + string(argv[1]) + ":" + string(argv[2]);
+    //more than one message per request: messages are encrypted as a batch
+    //and sent as a multipart message, the server replies with a batch
+    const int count = argc > 3 ? atoi(argv[3]) : 1;
+    if(count < 1) {
+        cerr << "Invalid number of messages per request" << endl;
+        return EXIT_FAILURE;
+    }
     cout << "Connecting to hello world server " << remoteAddress << "…" << endl;
+    if(sodium_init() < 0) {
+        cerr << "Cannot initialize libsodium" << endl;
+        return EXIT_FAILURE;
+    }
     void *context = ZCheck(zmq_ctx_new());
     void *requester = ZCheck(zmq_socket(context, ZMQ_REQ));
     ZCheck(zmq_connect(requester, remoteAddress.c_str()));
 
-    const bool INITIATE_OPTION = true;
-    const SecretNonce sn = HandShake(requester, INITIATE_OPTION);
-    const SharedSecret& sharedSecret = sn.sharedSecret;
-    const Nonce nonce = sn.nonce;
+    unique_ptr< Session > session = Connect(requester);
+    cout << "Cipher: " << int(session->cipher()) << endl;
     //encrypt-send / decrypt-receive loop
     int request = 1;
-    vector< unsigned char > tmpbuffer(cipherlen(0x100));
-    vector< unsigned char > decrypted;
+    const char* msg = "Hello";
+    const vector< ConstBuffer > messages(count, ConstBuffer{msg, strlen(msg)});
+    vector< ConstBuffer > in;
+    Batch cipher;
+    Batch plain;
+    Frames reply;
     while(true) {
-        const char* msg = "Hello";
-        const vector< unsigned char >& buffer = Encrypt(msg, strlen(msg),
-                                                        sharedSecret, nonce, tmpbuffer);
-        ZCheck(zmq_send(requester, buffer.data(), buffer.size(), 0));
-        const size_t sz = ZCheck(size_t(zmq_recv(requester, tmpbuffer.data(), tmpbuffer.size(), 0)));
-        Decrypt(tmpbuffer.data(), tmpbuffer.size(), sharedSecret, nonce, decrypted);
-        cout << "Received \"" << reinterpret_cast< const char* >(decrypted.data())
-             << "\" " << request << endl;
+        session->EncryptBatch(messages, cipher);
+        for(size_t i = 0; i != cipher.Count(); ++i) {
+            ZCheck(zmq_send(requester, cipher.Data(i), cipher.Size(i),
+                            i + 1 != cipher.Count() ? ZMQ_SNDMORE : 0));
+        }
+        if(!recv_frames(requester, reply)) break;
+        if(reply.size() == 1 && IsReset(reply[0].data(), reply[0].size())) {
+            cerr << "Session reset by server" << endl;
+            session = Connect(requester);
+            continue;
+        }
+        in.clear();
+        for(const Frame& f: reply) in.push_back({f.data(), f.size()});
+        session->DecryptBatch(in, plain);
+        cout << "Received \""
+             << string(reinterpret_cast< const char* >(plain.Data(0)),
+                       plain.Size(0))
+             << "\" x " << plain.Count() << " " << request << endl;
         ++request;
     }
     ZCheck(zmq_close(requester));
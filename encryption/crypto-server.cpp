@@ -1,41 +1,106 @@
 #include <cassert>
 #include <iostream>
-#include <chrono>
-#include <thread>
+#include <string>
+#include <stdexcept>
 #include <vector>
+#include <algorithm>
 
 #include <zmq.h>
 #include <sodium.h>
 #include "sodium-util.h"
+#include "handshake-engine.h"
 
 
 using namespace std;
 
+//  Peers are REQ sockets waiting for a reply: a peer whose handshake or
+//  session is discarded is told to repeat the handshake
+void Reset(void* router, const Frames& msg) {
+    if(msg.size() < 2 || !msg[1].empty()) return; //not a REQ envelope
+    ZCheck(zmq_send(router, msg[0].data(), msg[0].size(), ZMQ_SNDMORE));
+    ZCheck(zmq_send(router, nullptr, 0, ZMQ_SNDMORE));
+    ZCheck(zmq_send(router, HANDSHAKE_RESET, HANDSHAKE_RESET_SIZE, 0));
+}
+
 int main(int, char**) {
-    //  Socket to talk to clients
+    if(sodium_init() < 0) {
+        cerr << "Cannot initialize libsodium" << endl;
+        return EXIT_FAILURE;
+    }
+    //  Socket to talk to clients: handshakes with many clients are run
+    //  concurrently on the same ROUTER socket
     void* context = ZCheck(zmq_ctx_new());
-    void* responder = ZCheck(zmq_socket(context, ZMQ_REP));
-    int rc = ZCheck(zmq_bind(responder, "tcp://*:5555"));
-
-    const bool INITIATE_OPTION = false;
-    const SecretNonce sn = HandShake(responder, INITIATE_OPTION);
-    const SharedSecret& sharedSecret = sn.sharedSecret;
-    const Nonce nonce = sn.nonce;
+    void* responder = ZCheck(zmq_socket(context, ZMQ_ROUTER));
+    ZCheck(zmq_bind(responder, "tcp://*:5555"));
 
+    HandShakeEngine handShakes;
+    //persistent pool used to encrypt and decrypt large batches in parallel
+    Executor pool;
     //receive-decrypt / encrypt-send loop
-    vector< unsigned char > tmpbuffer(cipherlen(0x100));
-    vector< unsigned char > decrypted;
+    Frames msg;
+    vector< ConstBuffer > in;
+    Batch plain;
+    Batch cipher;
+    const char* reply = "World";
+    const size_t replySize = strlen(reply);
+    zmq_pollitem_t items[] = {{responder, 0, ZMQ_POLLIN, 0}};
     while(true) {
-        const size_t receivedData =
-            size_t(ZCheck(zmq_recv(responder, tmpbuffer.data(), tmpbuffer.size(), 0)));
-        Decrypt(tmpbuffer.data(), receivedData, sharedSecret, nonce, decrypted);
-        cout << "Received \"" << reinterpret_cast< const char* >(decrypted.data())
-             <<  '\"' << endl;
-	    this_thread::sleep_for(chrono::seconds(1));          //  Do some 'work'
-        const char* msg = "World";
-        const vector< unsigned char >& buffer = Encrypt(msg, strlen(msg),
-                                                        sharedSecret, nonce, tmpbuffer);
-        ZCheck(zmq_send(responder, buffer.data(), buffer.size(), 0));
+        ZCheck(zmq_poll(items, 1, handShakes.NextTimeout()));
+        handShakes.Expire();
+        if(!(items[0].revents & ZMQ_POLLIN)) continue;
+        if(!recv_frames(responder, msg)) break;
+        const HandShakeEngine::Result r = handShakes.Process(responder, msg);
+        if(r == HandShakeEngine::REJECTED) {
+            cerr << "Invalid handshake message" << endl;
+            Reset(responder, msg);
+            continue;
+        }
+        if(r != HandShakeEngine::DATA) continue;
+        //|id|empty|encrypted data|: decrypted and encrypted in place
+        //|id|empty|encrypted data 1|...|encrypted data N|: batch, one reply
+        //per message
+        const string id = msg[0].str();
+        Session* session = handShakes.Find(id);
+        const size_t count = msg.size() - 2;
+        try {
+            if(count == 1) {
+                unsigned char* data =
+                    reinterpret_cast< unsigned char* >(msg[2].data());
+                const size_t msize =
+                    session->DecryptInPlace(data, msg[2].size());
+                cout << "Received \""
+                     << string(reinterpret_cast< const char* >(
+                                   data + Session::COUNTER_BYTES), msize)
+                     << "\" from " << handShakes.Sessions() << " client(s)"
+                     << endl;
+            } else {
+                in.clear();
+                for(size_t i = 2; i != msg.size(); ++i)
+                    in.push_back({msg[i].data(), msg[i].size()});
+                session->DecryptBatch(in, plain, &pool);
+                cout << "Received " << count << " messages from "
+                     << handShakes.Sessions() << " client(s)" << endl;
+            }
+        } catch(const domain_error& e) {
+            //drop session: client has to repeat the handshake
+            cerr << e.what() << endl;
+            handShakes.Remove(id);
+            Reset(responder, msg);
+            continue;
+        }
+        if(count == 1) {
+            Frame f(Session::InPlaceSize(replySize));
+            unsigned char* data = reinterpret_cast< unsigned char* >(f.data());
+            memcpy(data + Session::COUNTER_BYTES, reply, replySize);
+            session->EncryptInPlace(data, replySize);
+            msg[2] = move(f);
+        } else {
+            in.assign(count, ConstBuffer{reply, replySize});
+            session->EncryptBatch(in, cipher, &pool);
+            for(size_t i = 0; i != count; ++i)
+                msg[i + 2] = Frame(cipher.Data(i), cipher.Size(i));
+        }
+        send_frames(responder, msg);
     }
     ZCheck(zmq_close(responder));
     ZCheck(zmq_ctx_destroy(context));
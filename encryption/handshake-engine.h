@@ -0,0 +1,235 @@
+#pragma once
+//Non-blocking, responder side handshake for many concurrent peers on a
+//single ROUTER socket
+//Author: Ugo Varetto
+//Implements the same protocol as HandShake(s, false) in sodium-util.h as a
+//per-identity state machine: each incoming message advances the handshake of
+//the sending peer by one step and the reply is sent immediately, so that no
+//peer ever blocks the others. Once the shared secret is received a Session
+//is added to the session table, keyed by peer identity, and all subsequent
+//messages from the same identity are reported as data.
+//Peers are expected to use REQ sockets: messages are |id|empty|payload...|.
+//Handshake steps (client request -> server reply):
+// 1) |nonce|supported ciphers| -> |selected cipher|
+// 2) |client public key|        -> |server public key|
+// 3) |encrypted shared secret|  -> ||
+//No reply is sent for rejected messages: the caller is expected to reply
+//HANDSHAKE_RESET, so that the blocked REQ peer can restart the handshake.
+//Handshakes not completed within the timeout and sessions with no
+//messages for longer than the idle timeout are discarded by Expire(),
+//session keys are zeroed by the Session destructor.
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <queue>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+
+#include "sodium-util.h"
+#include "../multipart.h"
+
+//------------------------------------------------------------------------------
+class HandShakeEngine {
+public:
+    typedef std::chrono::steady_clock Clock;
+    enum Result {
+        HANDSHAKE, //message consumed by the handshake
+        DATA,      //message from a peer with an established session
+        REJECTED   //malformed handshake message, peer state discarded
+    };
+    explicit HandShakeEngine(std::chrono::milliseconds timeout
+                                 = std::chrono::milliseconds(10000),
+                             size_t maxPending = 0x10000,
+                             std::chrono::milliseconds idleTimeout
+                                 = std::chrono::milliseconds(600000))
+        : timeout_(timeout), maxPending_(maxPending),
+          idleTimeout_(idleTimeout) {}
+    HandShakeEngine(const HandShakeEngine&) = delete;
+    HandShakeEngine& operator=(const HandShakeEngine&) = delete;
+    ~HandShakeEngine() {
+        for(auto& p: pending_) Zero(p.second.keys);
+    }
+    //'msg' is a message received from 'router': |id|empty|payload...|;
+    //if DATA is returned 'msg' is left untouched
+    Result Process(void* router, const Frames& msg) {
+        if(msg.size() < 3 || !msg[1].empty()) return REJECTED;
+        const std::string id = msg[0].str();
+        auto s = sessions_.find(id);
+        if(s != sessions_.end()) {
+            s->second.lastActive = Clock::now();
+            return DATA;
+        }
+        auto i = pending_.find(id);
+        if(i == pending_.end()) return Start(router, id, msg);
+        PendingHandShake& p = i->second;
+        bool ok = false;
+        switch(p.stage) {
+        case AWAIT_PUBLIC_KEY: ok = ExchangeKeys(router, id, p, msg);
+            break;
+        case AWAIT_SECRET: ok = Establish(router, id, p, msg);
+            break;
+        }
+        if(!ok) {
+            Discard(i);
+            return REJECTED;
+        }
+        return HANDSHAKE;
+    }
+    //nullptr if no session exists for identity
+    Session* Find(const std::string& id) {
+        auto i = sessions_.find(id);
+        return i == sessions_.end() ? nullptr : i->second.session.get();
+    }
+    void Remove(const std::string& id) {
+        sessions_.erase(id);
+    }
+    //discard handshakes not completed within timeout and idle sessions,
+    //returns number of discarded handshakes and sessions
+    size_t Expire(Clock::time_point now = Clock::now()) {
+        size_t expired = 0;
+        //entries for handshakes completed or restarted and for removed
+        //sessions are skipped; sessions are scheduled once per idle
+        //timeout, not on every message: an active session is rescheduled
+        //at its last activity + idle timeout when its entry expires
+        while(!deadlines_.empty() && deadlines_.top().first <= now) {
+            const Deadline d = deadlines_.top();
+            deadlines_.pop();
+            auto i = pending_.find(d.second);
+            if(i != pending_.end() && i->second.deadline == d.first) {
+                Discard(i);
+                ++expired;
+                continue;
+            }
+            auto s = sessions_.find(d.second);
+            if(s == sessions_.end() || s->second.deadline != d.first)
+                continue;
+            const Clock::time_point idle = s->second.lastActive
+                                           + idleTimeout_;
+            if(idle <= now) {
+                sessions_.erase(s);
+                ++expired;
+            } else {
+                s->second.deadline = idle;
+                deadlines_.push(Deadline(idle, d.second));
+            }
+        }
+        return expired;
+    }
+    //time to next expiry in milliseconds, -1 if no handshake or session
+    //pending, to be used as zmq_poll timeout
+    long NextTimeout(Clock::time_point now = Clock::now()) const {
+        if(deadlines_.empty()) return -1;
+        const auto d = std::chrono::duration_cast< std::chrono::milliseconds >(
+                           deadlines_.top().first - now).count();
+        return std::max(long(d), 0L);
+    }
+    size_t Pending() const { return pending_.size(); }
+    size_t Sessions() const { return sessions_.size(); }
+private:
+    enum Stage {AWAIT_PUBLIC_KEY, AWAIT_SECRET};
+    struct PendingHandShake {
+        Stage stage;
+        Nonce nonce;
+        Cipher cipher;
+        KeyPair keys;
+        Clock::time_point deadline;
+    };
+    typedef std::unordered_map< std::string, PendingHandShake > PendingMap;
+    struct SessionEntry {
+        std::unique_ptr< Session > session;
+        Clock::time_point lastActive;
+        Clock::time_point deadline; //of the entry in the deadline queue
+    };
+    //min-heap: handshake and idle timeouts differ, entries are not
+    //inserted in deadline order
+    typedef std::pair< Clock::time_point, std::string > Deadline;
+    typedef std::priority_queue< Deadline, std::vector< Deadline >,
+                                 std::greater< Deadline > > DeadlineQueue;
+    //step 1: receive nonce and cipher list, reply with selected cipher
+    Result Start(void* router, const std::string& id, const Frames& msg) {
+        if(msg[2].size() != crypto_box_NONCEBYTES) return REJECTED;
+        if(pending_.size() >= maxPending_) {
+            Expire();
+            if(pending_.size() >= maxPending_) return REJECTED;
+        }
+        PendingHandShake p;
+        p.stage = AWAIT_PUBLIC_KEY;
+        std::copy(msg[2].begin(), msg[2].end(), p.nonce.begin());
+        p.cipher = msg.size() > 3
+                   ? ChooseCipher(reinterpret_cast< const unsigned char* >(
+                                      msg[3].data()), msg[3].size())
+                   : Cipher::XSALSA20_POLY1305;
+        p.keys = GenKeys();
+        p.deadline = Clock::now() + timeout_;
+        Reply(router, id, &p.cipher, sizeof(p.cipher));
+        deadlines_.push(Deadline(p.deadline, id));
+        pending_[id] = p;
+        return HANDSHAKE;
+    }
+    //step 2: receive client public key, reply with server public key;
+    //the client key is only needed to decrypt the shared secret and is
+    //turned into the box precomputation key right away
+    static_assert(crypto_box_SECRETKEYBYTES == crypto_box_BEFORENMBYTES,
+                  "Box key must fit secret key storage");
+    bool ExchangeKeys(void* router, const std::string& id, PendingHandShake& p,
+                      const Frames& msg) {
+        if(msg.size() != 3 || msg[2].size() != crypto_box_PUBLICKEYBYTES)
+            return false;
+        PublicKey clientPublicKey;
+        std::copy(msg[2].begin(), msg[2].end(), clientPublicKey.begin());
+        SharedSecret k;
+        if(crypto_box_beforenm(k.data(), clientPublicKey.data(),
+                               p.keys.secret.data()) != 0) {
+            return false;
+        }
+        Reply(router, id, p.keys.pub.data(), p.keys.pub.size());
+        //server secret key no longer needed: replace it with the box
+        //precomputation key, same size
+        std::copy(k.begin(), k.end(), p.keys.secret.begin());
+        sodium_memzero(k.data(), k.size());
+        p.stage = AWAIT_SECRET;
+        return true;
+    }
+    //step 3: decrypt shared secret, add session, send ack
+    bool Establish(void* router, const std::string& id, PendingHandShake& p,
+                   const Frames& msg) {
+        SecretNonce sn;
+        if(msg.size() != 3 || msg[2].size() != cipherlen(sn.sharedSecret.size())
+           || crypto_box_open_easy_afternm(
+                  sn.sharedSecret.data(),
+                  reinterpret_cast< const unsigned char* >(msg[2].data()),
+                  msg[2].size(), p.nonce.data(), p.keys.secret.data()) != 0) {
+            return false;
+        }
+        sn.nonce = p.nonce;
+        sn.cipher = p.cipher;
+        SessionEntry& e = sessions_[id];
+        e.session.reset(new Session(sn, Session::RESPONDER));
+        e.lastActive = Clock::now();
+        e.deadline = e.lastActive + idleTimeout_;
+        deadlines_.push(Deadline(e.deadline, id));
+        sodium_memzero(sn.sharedSecret.data(), sn.sharedSecret.size());
+        Discard(pending_.find(id));
+        Reply(router, id, nullptr, 0);
+        return true;
+    }
+    void Discard(PendingMap::iterator i) {
+        Zero(i->second.keys);
+        pending_.erase(i);
+    }
+    static void Reply(void* router, const std::string& id, const void* data,
+                      size_t size) {
+        ZCheck(zmq_send(router, id.data(), id.size(), ZMQ_SNDMORE));
+        ZCheck(zmq_send(router, nullptr, 0, ZMQ_SNDMORE));
+        ZCheck(zmq_send(router, data, size, 0));
+    }
+private:
+    std::chrono::milliseconds timeout_;
+    size_t maxPending_;
+    std::chrono::milliseconds idleTimeout_;
+    PendingMap pending_;
+    DeadlineQueue deadlines_;
+    std::unordered_map< std::string, SessionEntry > sessions_;
+};
@@ -4,11 +4,19 @@
 
 #pragma once
 #include <array>
+#include <cstdint>
 #include <string>
 #include <cstring>
 #include <stdexcept>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <algorithm>
 #include <sodium.h>
 #include "../utility.h"
+#include "../router-dealer/executor.h"
 
 using PublicKey = std::array< unsigned char, crypto_box_PUBLICKEYBYTES >;
 using SecretKey = std::array< unsigned char, crypto_box_SECRETKEYBYTES >;
@@ -63,25 +71,97 @@ inline void Zero(KeyPair& kp) {
 }
 
 
+//Ciphers negotiated during the handshake; the initiator sends the list of
+//supported ciphers in order of preference and the responder picks the first
+//one it supports
+enum class Cipher : unsigned char {
+    XSALSA20_POLY1305 = 0,  //crypto_box, always available
+    XCHACHA20_POLY1305 = 1, //IETF AEAD
+    AES256_GCM = 2          //only if CPU supports AES-NI and CLMUL
+};
+
+inline bool Supported(Cipher c) {
+    switch(c) {
+    case Cipher::XSALSA20_POLY1305:
+    case Cipher::XCHACHA20_POLY1305: return true;
+    case Cipher::AES256_GCM: return crypto_aead_aes256gcm_is_available() != 0;
+    }
+    return false;
+}
+
+//hardware accelerated AES first, if available
+inline std::vector< unsigned char > SupportedCiphers() {
+    std::vector< unsigned char > c;
+    if(Supported(Cipher::AES256_GCM))
+        c.push_back(static_cast< unsigned char >(Cipher::AES256_GCM));
+    c.push_back(static_cast< unsigned char >(Cipher::XCHACHA20_POLY1305));
+    c.push_back(static_cast< unsigned char >(Cipher::XSALSA20_POLY1305));
+    return c;
+}
+
+inline Cipher ChooseCipher(const unsigned char* offered, size_t size) {
+    for(size_t i = 0; i != size; ++i) {
+        if(offered[i] <= static_cast< unsigned char >(Cipher::AES256_GCM)
+           && Supported(Cipher(offered[i]))) return Cipher(offered[i]);
+    }
+    return Cipher::XSALSA20_POLY1305;
+}
+
+inline bool MoreParts(void* s) {
+    int more = 0;
+    size_t len = sizeof(more);
+    ZCheck(zmq_getsockopt(s, ZMQ_RCVMORE, &more, &len));
+    return more != 0;
+}
+
 struct SecretNonce {
   SharedSecret sharedSecret;
   Nonce nonce;
+  Cipher cipher;
+};
+
+//reply sent by a responder that discarded the handshake or the session of
+//a peer, which has to repeat the handshake; its size differs from that of
+//every handshake reply and of every Session message
+const char HANDSHAKE_RESET[] = "RESET";
+const size_t HANDSHAKE_RESET_SIZE = sizeof(HANDSHAKE_RESET) - 1;
+
+inline bool IsReset(const void* data, size_t size) {
+    return size == HANDSHAKE_RESET_SIZE
+           && memcmp(data, HANDSHAKE_RESET, HANDSHAKE_RESET_SIZE) == 0;
+}
+
+//thrown by HandShake when the responder resets the handshake
+struct HandShakeReset : std::runtime_error {
+    HandShakeReset() : std::runtime_error("Handshake reset by peer") {}
 };
 
 //namespace {
 SecretNonce HandShake(void *s, bool initiate) {
     if(initiate) {
-        //0 generate and send nonce
+        //0 generate and send nonce and supported ciphers, receive
+        //selected cipher
         Nonce nonce = GenNonce();
-        ZCheck(zmq_send(s, nonce.data(), nonce.size(), 0));
-        ZCheck(zmq_recv(s, nullptr, 0, 0));
+        const std::vector< unsigned char > ciphers = SupportedCiphers();
+        ZCheck(zmq_send(s, nonce.data(), nonce.size(), ZMQ_SNDMORE));
+        ZCheck(zmq_send(s, ciphers.data(), ciphers.size(), 0));
+        unsigned char selected = 0;
+        const int selectedSize =
+            ZCheck(zmq_recv(s, &selected, sizeof(selected), 0));
+        if(selectedSize == int(HANDSHAKE_RESET_SIZE)) throw HandShakeReset();
+        const Cipher cipher = selectedSize == 1
+            ? ChooseCipher(&selected, 1) : Cipher::XSALSA20_POLY1305;
         //1 generate keys
         KeyPair clientKeys = GenKeys();
         //2 send public key to other endpoint
         ZCheck(zmq_send(s, clientKeys.pub.data(), clientKeys.pub.size(), 0));
         //3 receive public key from other endpoint
         PublicKey serverPublicKey;
-        ZCheck(zmq_recv(s, serverPublicKey.data(), serverPublicKey.size(), 0));
+        if(ZCheck(zmq_recv(s, serverPublicKey.data(), serverPublicKey.size(),
+                           0)) != int(serverPublicKey.size())) {
+            Zero(clientKeys);
+            throw HandShakeReset();
+        }
         //4 generate and send shared key through encrypted connection
         SharedSecret sharedSecret = GenShared(clientKeys);
         std::vector< unsigned char > ebuf(cipherlen(sharedSecret.size()));
@@ -93,14 +173,24 @@ SecretNonce HandShake(void *s, bool initiate) {
         }
 
         ZCheck(zmq_send(s, ebuf.data(), ebuf.size(), 0));
-        ZCheck(zmq_recv(s, nullptr, 0, 0));
         Zero(clientKeys);
-        return {sharedSecret, nonce};
+        if(ZCheck(zmq_recv(s, nullptr, 0, 0)) != 0) {
+            sodium_memzero(sharedSecret.data(), sharedSecret.size());
+            throw HandShakeReset();
+        }
+        return {sharedSecret, nonce, cipher};
     } else {
-        //0 receive noonce
+        //0 receive noonce and supported ciphers, reply with selected cipher
         Nonce nonce;
         ZCheck(zmq_recv(s, nonce.data(), nonce.size(), 0));
-        ZCheck(zmq_send(s, nullptr, 0, 0));
+        std::array< unsigned char, 0x10 > offered;
+        size_t numOffered = 0;
+        if(MoreParts(s)) {
+            numOffered = std::min(offered.size(), size_t(
+                ZCheck(zmq_recv(s, offered.data(), offered.size(), 0))));
+        }
+        const Cipher cipher = ChooseCipher(offered.data(), numOffered);
+        ZCheck(zmq_send(s, &cipher, sizeof(cipher), 0));
         //1 generate keys
         KeyPair serverKeys = GenKeys();
         //2 receive public key from client
@@ -123,7 +213,7 @@ SecretNonce HandShake(void *s, bool initiate) {
         //5 send ACK
         ZCheck(zmq_send(s, nullptr, 0, 0));
         Zero(serverKeys);
-        return {sharedSecret, nonce};
+        return {sharedSecret, nonce, cipher};
     }
 }
 
@@ -159,3 +249,410 @@ const std::vector< unsigned char >& Decrypt(const void *in,
 }
 //}
 
+//------------------------------------------------------------------------------
+//Batches, see Session::EncryptBatch and Session::DecryptBatch
+//All messages of a batch are stored back to back into a single buffer,
+//offsets[i] is the position of message i and offsets.back() the total size.
+//Batches smaller than MIN_PARALLEL_BATCH bytes are processed by the calling
+//thread; larger batches are split in slices of at least MIN_BATCH_SLICE
+//bytes, executed by the threads of a persistent Executor (see
+//router-dealer/executor.h) and by the calling thread, which waits for all
+//the slices to complete.
+struct ConstBuffer {
+    const void* data;
+    size_t size;
+};
+
+struct Batch {
+    std::vector< unsigned char > data;
+    std::vector< size_t > offsets;
+    size_t Count() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    const unsigned char* Data(size_t i) const { return &data[offsets[i]]; }
+    size_t Size(size_t i) const { return offsets[i + 1] - offsets[i]; }
+};
+
+const size_t MIN_PARALLEL_BATCH = 0x100000;
+const size_t MIN_BATCH_SLICE = 0x40000;
+
+//------------------------------------------------------------------------------
+//invoke f(begin, end) on slices of [0, count), in parallel if 'pool' is not
+//null; the calling thread processes the first slice and the slices the pool
+//cannot accept; exceptions thrown by f are rethrown after all the slices
+//completed
+template < typename F >
+void ParallelSlices(size_t count, size_t totalBytes, Executor* pool, F f) {
+    const size_t maxSlices =
+        std::max(size_t(1), totalBytes / MIN_BATCH_SLICE);
+    const size_t slices = !pool || totalBytes < MIN_PARALLEL_BATCH ? 1
+        : std::min(std::min(size_t(pool->Threads() + 1), maxSlices), count);
+    if(slices <= 1) {
+        f(size_t(0), count);
+        return;
+    }
+    const size_t perSlice = (count + slices - 1) / slices;
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t pending = 0;
+    std::exception_ptr error;   //from the pool
+    std::exception_ptr x;       //from the calling thread
+    for(size_t b = perSlice; b < count; b += perSlice) {
+        const size_t e = std::min(count, b + perSlice);
+        {
+            std::lock_guard< std::mutex > lock(mutex);
+            ++pending;
+        }
+        const bool submitted = pool->Submit([&, b, e](int) {
+            std::exception_ptr x;
+            try {
+                f(b, e);
+            } catch(...) {
+                x = std::current_exception();
+            }
+            std::lock_guard< std::mutex > lock(mutex);
+            if(x && !error) error = x;
+            if(--pending == 0) done.notify_one();
+        });
+        if(submitted) continue;
+        {
+            std::lock_guard< std::mutex > lock(mutex);
+            --pending;
+        }
+        try {
+            f(b, e);
+        } catch(...) {
+            if(!x) x = std::current_exception();
+        }
+    }
+    try {
+        f(size_t(0), std::min(count, perSlice));
+    } catch(...) {
+        if(!x) x = std::current_exception();
+    }
+    std::unique_lock< std::mutex > lock(mutex);
+    done.wait(lock, [&pending]() { return pending == 0; });
+    if(x) std::rethrow_exception(x);
+    if(error) std::rethrow_exception(error);
+}
+
+//------------------------------------------------------------------------------
+//Encrypted channel with per-message nonces
+//Each direction uses its own key, derived from the handshake shared secret,
+//the direction and the current epoch with keyed BLAKE2b; the nonce is a
+//64 bit message counter, so no nonce is ever reused with the same key.
+//After 'rekeyInterval' messages the epoch changes and a new key is derived
+//on both ends without any additional message exchange.
+//Message layout: |counter, 8 bytes little endian|ciphertext + MAC|
+//Received counters must be strictly increasing: replayed or reordered
+//messages are rejected.
+//In-place mode: the message is encrypted inside a buffer with COUNTER_BYTES
+//of headroom and MAC_BYTES of tailroom, see InPlaceSize, and decrypted in
+//the received buffer; no second buffer is needed.
+//Batch mode: a batch of messages takes a range of consecutive counters and
+//each message is laid out as a single message, so that batches and single
+//messages can be mixed on both ends; the keys of the epochs spanned by the
+//batch are derived up front and the messages encrypted or decrypted in
+//parallel, see ParallelSlices. A batch is decrypted only if all of its
+//messages are authentic, otherwise the session state is not changed.
+class Session {
+public:
+    enum Role {INITIATOR = 0, RESPONDER = 1};
+    static const uint64_t DEFAULT_REKEY_INTERVAL = uint64_t(1) << 32;
+    static const size_t COUNTER_BYTES = sizeof(uint64_t);
+    static const size_t MAC_BYTES = crypto_box_MACBYTES;
+    static_assert(MAC_BYTES == crypto_aead_xchacha20poly1305_ietf_ABYTES
+                  && MAC_BYTES == crypto_aead_aes256gcm_ABYTES,
+                  "MAC size must be the same for all ciphers");
+    Session(const SecretNonce& sn, Role role,
+            uint64_t rekeyInterval = DEFAULT_REKEY_INTERVAL)
+        : master_(sn.sharedSecret), cipher_(sn.cipher),
+          sendDirection_(role), recvDirection_(1 - role),
+          rekeyInterval_(rekeyInterval) {
+        if(rekeyInterval_ == 0)
+            throw std::invalid_argument("Rekey interval must be > 0");
+        if(!Supported(cipher_))
+            throw std::domain_error("Unsupported cipher");
+        sendKey_ = DeriveKey(sendDirection_, 0);
+        recvKey_ = DeriveKey(recvDirection_, 0);
+    }
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+    ~Session() {
+        sodium_memzero(master_.data(), master_.size());
+        sodium_memzero(sendKey_.data(), sendKey_.size());
+        sodium_memzero(recvKey_.data(), recvKey_.size());
+    }
+    Cipher cipher() const { return cipher_; }
+    static constexpr size_t Overhead() { return COUNTER_BYTES + MAC_BYTES; }
+    //size of the buffer required to encrypt a message in place: the message
+    //is stored at offset COUNTER_BYTES
+    static constexpr size_t InPlaceSize(size_t messageSize) {
+        return Overhead() + messageSize;
+    }
+    const std::vector< unsigned char >& Encrypt(const void* data, size_t size,
+                                                std::vector< unsigned char >& out) {
+        const uint64_t counter = ReserveCounters(1);
+        out.resize(Overhead() + size);
+        Seal(cipher_, SendKey(counter), counter,
+             reinterpret_cast< const unsigned char* >(data), size, out.data());
+        return out;
+    }
+    //'buffer' holds the message at offset COUNTER_BYTES and has
+    //InPlaceSize(size) bytes; returns the size of the encrypted message,
+    //which starts at 'buffer'
+    size_t EncryptInPlace(unsigned char* buffer, size_t size) {
+        const uint64_t counter = ReserveCounters(1);
+        Seal(cipher_, SendKey(counter), counter, buffer + COUNTER_BYTES, size,
+             buffer);
+        return InPlaceSize(size);
+    }
+    //returns size of decrypted data
+    size_t Decrypt(const void* in, size_t size,
+                   std::vector< unsigned char >& out) {
+        if(size < Overhead()) throw std::domain_error("Invalid message size");
+        out.resize(size - Overhead());
+        return Receive(reinterpret_cast< const unsigned char* >(in), size,
+                       out.data());
+    }
+    //on return the message is at buffer + COUNTER_BYTES; returns its size
+    size_t DecryptInPlace(unsigned char* buffer, size_t size) {
+        if(size < Overhead()) throw std::domain_error("Invalid message size");
+        return Receive(buffer, size, buffer + COUNTER_BYTES);
+    }
+    //encrypt 'messages' into 'out', in parallel on 'pool' if not null;
+    //out.Data(i) is the encrypted message i
+    void EncryptBatch(const std::vector< ConstBuffer >& messages, Batch& out,
+                      Executor* pool = nullptr) {
+        out.offsets.resize(messages.size() + 1);
+        out.offsets[0] = 0;
+        for(size_t i = 0; i != messages.size(); ++i) {
+            out.offsets[i + 1] = out.offsets[i]
+                                 + InPlaceSize(messages[i].size);
+        }
+        //capacity is retained across calls
+        out.data.resize(out.offsets.back());
+        if(messages.empty()) return;
+        const uint64_t first = ReserveCounters(messages.size());
+        const uint64_t last = first + messages.size() - 1;
+        std::vector< Key > keys = EpochKeys(first, last, sendDirection_,
+                                            sendEpoch_, sendKey_);
+        try {
+            const uint64_t firstEpoch = first / rekeyInterval_;
+            ParallelSlices(messages.size(), out.data.size(), pool,
+                           [&](size_t b, size_t e) {
+                for(size_t i = b; i != e; ++i) {
+                    const uint64_t c = first + i;
+                    Seal(cipher_, keys[c / rekeyInterval_ - firstEpoch], c,
+                         reinterpret_cast< const unsigned char* >(
+                             messages[i].data),
+                         messages[i].size, out.data.data() + out.offsets[i]);
+                }
+            });
+        } catch(...) {
+            Zero(keys);
+            throw;
+        }
+        sendKey_ = keys.back();
+        sendEpoch_ = last / rekeyInterval_;
+        Zero(keys);
+    }
+    //decrypt 'ciphers' into 'out', in parallel on 'pool' if not null;
+    //throws std::domain_error and leaves the session unchanged if any
+    //message is invalid
+    void DecryptBatch(const std::vector< ConstBuffer >& ciphers, Batch& out,
+                      Executor* pool = nullptr) {
+        out.offsets.resize(ciphers.size() + 1);
+        out.offsets[0] = 0;
+        uint64_t prev = lastRecvCounter_;
+        bool started = recvStarted_;
+        for(size_t i = 0; i != ciphers.size(); ++i) {
+            if(ciphers[i].size < Overhead())
+                throw std::domain_error("Invalid message size");
+            const uint64_t c = LoadCounter(
+                static_cast< const unsigned char* >(ciphers[i].data));
+            if(started && c <= prev)
+                throw std::domain_error("Replayed message");
+            prev = c;
+            started = true;
+            out.offsets[i + 1] = out.offsets[i] + ciphers[i].size
+                                 - Overhead();
+        }
+        out.data.resize(out.offsets.back());
+        if(ciphers.empty()) return;
+        const uint64_t first =
+            LoadCounter(static_cast< const unsigned char* >(ciphers[0].data));
+        std::vector< Key > keys = EpochKeys(first, prev, recvDirection_,
+                                            recvEpoch_, recvKey_);
+        try {
+            const uint64_t firstEpoch = first / rekeyInterval_;
+            ParallelSlices(ciphers.size(), out.data.size(), pool,
+                           [&](size_t b, size_t e) {
+                for(size_t i = b; i != e; ++i) {
+                    const unsigned char* p =
+                        static_cast< const unsigned char* >(ciphers[i].data);
+                    const uint64_t c = LoadCounter(p);
+                    if(Open(cipher_, keys[c / rekeyInterval_ - firstEpoch], c,
+                            p + COUNTER_BYTES, ciphers[i].size - COUNTER_BYTES,
+                            out.data.data() + out.offsets[i]) != 0)
+                        throw std::domain_error("Decryption failed");
+                }
+            });
+        } catch(...) {
+            Zero(keys);
+            throw;
+        }
+        recvKey_ = keys.back();
+        recvEpoch_ = prev / rekeyInterval_;
+        lastRecvCounter_ = prev;
+        recvStarted_ = true;
+        Zero(keys);
+    }
+private:
+    typedef std::array< unsigned char, 32 > Key;
+    //first of 'n' consecutive send counters
+    uint64_t ReserveCounters(uint64_t n) {
+        if(n > UINT64_MAX - sendCounter_)
+            throw std::runtime_error("Message counter exhausted");
+        const uint64_t first = sendCounter_;
+        sendCounter_ += n;
+        return first;
+    }
+    const Key& SendKey(uint64_t counter) {
+        const uint64_t epoch = counter / rekeyInterval_;
+        if(epoch != sendEpoch_) {
+            sendKey_ = DeriveKey(sendDirection_, epoch);
+            sendEpoch_ = epoch;
+        }
+        return sendKey_;
+    }
+    //keys of the epochs of counters [first, last]; 'current' is the key of
+    //epoch 'currentEpoch'
+    std::vector< Key > EpochKeys(uint64_t first, uint64_t last, int direction,
+                                 uint64_t currentEpoch,
+                                 const Key& current) const {
+        std::vector< Key > keys;
+        for(uint64_t e = first / rekeyInterval_; e <= last / rekeyInterval_;
+            ++e) {
+            keys.push_back(e == currentEpoch ? current
+                                             : DeriveKey(direction, e));
+        }
+        return keys;
+    }
+    static void Zero(std::vector< Key >& keys) {
+        for(Key& k: keys) sodium_memzero(k.data(), k.size());
+    }
+    //decrypt 'in' into 'out', which can be in + COUNTER_BYTES
+    size_t Receive(const unsigned char* in, size_t size, unsigned char* out) {
+        const uint64_t counter = LoadCounter(in);
+        if(recvStarted_ && counter <= lastRecvCounter_)
+            throw std::domain_error("Replayed message");
+        const uint64_t epoch = counter / rekeyInterval_;
+        //the key of a new epoch replaces the current one only after the
+        //message is authenticated: forged counters cannot change the key
+        Key epochKey;
+        const Key* key = &recvKey_;
+        if(epoch != recvEpoch_) {
+            epochKey = DeriveKey(recvDirection_, epoch);
+            key = &epochKey;
+        }
+        const int rc = Open(cipher_, *key, counter, in + COUNTER_BYTES,
+                            size - COUNTER_BYTES, out);
+        if(rc == 0 && key == &epochKey) {
+            recvKey_ = epochKey;
+            recvEpoch_ = epoch;
+        }
+        if(key == &epochKey) sodium_memzero(epochKey.data(), epochKey.size());
+        if(rc != 0) throw std::domain_error("Decryption failed");
+        lastRecvCounter_ = counter;
+        recvStarted_ = true;
+        return size - Overhead();
+    }
+    //write |counter|ciphertext + MAC| to 'out'; 'm' can be
+    //out + COUNTER_BYTES
+    static void Seal(Cipher cipher, const Key& key, uint64_t counter,
+                     const unsigned char* m, size_t size, unsigned char* out) {
+        const Nonce n = CounterNonce(counter);
+        unsigned char* c = out + COUNTER_BYTES;
+        unsigned long long clen = 0;
+        int rc = -1;
+        switch(cipher) {
+        case Cipher::XSALSA20_POLY1305:
+            rc = crypto_box_easy_afternm(c, m, size, n.data(), key.data());
+            break;
+        case Cipher::XCHACHA20_POLY1305:
+            rc = crypto_aead_xchacha20poly1305_ietf_encrypt(
+                     c, &clen, m, size, nullptr, 0, nullptr, n.data(),
+                     key.data());
+            break;
+        case Cipher::AES256_GCM:
+            rc = crypto_aead_aes256gcm_encrypt(
+                     c, &clen, m, size, nullptr, 0, nullptr, n.data(),
+                     key.data());
+            break;
+        }
+        if(rc != 0) throw std::runtime_error("Encryption failed");
+        //after encryption: in place, the counter overlaps the headroom only
+        StoreCounter(counter, out);
+    }
+    //decrypt ciphertext + MAC 'c' into 'm', which can be equal to 'c';
+    //returns 0 on success
+    static int Open(Cipher cipher, const Key& key, uint64_t counter,
+                    const unsigned char* c, size_t clen, unsigned char* m) {
+        const Nonce n = CounterNonce(counter);
+        unsigned long long mlen = 0;
+        switch(cipher) {
+        case Cipher::XSALSA20_POLY1305:
+            return crypto_box_open_easy_afternm(m, c, clen, n.data(),
+                                                key.data());
+        case Cipher::XCHACHA20_POLY1305:
+            return crypto_aead_xchacha20poly1305_ietf_decrypt(
+                       m, &mlen, nullptr, c, clen, nullptr, 0, n.data(),
+                       key.data());
+        case Cipher::AES256_GCM:
+            return crypto_aead_aes256gcm_decrypt(
+                       m, &mlen, nullptr, c, clen, nullptr, 0, n.data(),
+                       key.data());
+        }
+        return -1;
+    }
+    Key DeriveKey(int direction, uint64_t epoch) const {
+        unsigned char input[COUNTER_BYTES + 1];
+        StoreCounter(epoch, input);
+        input[COUNTER_BYTES] = static_cast< unsigned char >(direction);
+        Key k;
+        if(crypto_generichash(k.data(), k.size(), input, sizeof(input),
+                              master_.data(), master_.size()) != 0) {
+            throw std::runtime_error("Key derivation failed");
+        }
+        return k;
+    }
+    //counter in the first 8 bytes, rest zero; AES-GCM uses the first 12
+    //bytes only
+    static Nonce CounterNonce(uint64_t counter) {
+        Nonce n;
+        n.fill(0);
+        StoreCounter(counter, n.data());
+        return n;
+    }
+    static void StoreCounter(uint64_t c, unsigned char* p) {
+        for(size_t i = 0; i != COUNTER_BYTES; ++i, c >>= 8)
+            p[i] = static_cast< unsigned char >(c);
+    }
+    static uint64_t LoadCounter(const unsigned char* p) {
+        uint64_t c = 0;
+        for(size_t i = COUNTER_BYTES; i != 0; --i) c = (c << 8) | p[i - 1];
+        return c;
+    }
+private:
+    SharedSecret master_;
+    Cipher cipher_;
+    int sendDirection_;
+    int recvDirection_;
+    uint64_t rekeyInterval_;
+    Key sendKey_;
+    Key recvKey_;
+    uint64_t sendEpoch_ = 0;
+    uint64_t recvEpoch_ = 0;
+    uint64_t sendCounter_ = 0;
+    uint64_t lastRecvCounter_ = 0;
+    bool recvStarted_ = false;
+};
@@ -0,0 +1,163 @@
+#pragma once
+//On-disk index of the chunks already received, used to resume interrupted
+//transfers
+//Author: Ugo Varetto
+//Layout: |magic|file size|chunk size|source FileId|
+//        |bitmap, one bit per chunk|crc32c, one per chunk|
+//A bit is set after the corresponding chunk has been verified and written
+//to the output file, together with its checksum; each update rewrites
+//only the checksum and the byte that contains the bit. Data and index are
+//not fsync'ed: the index survives a crash of the receiving process, not of
+//the whole node.
+//An existing index is reused only if it refers to the same version of the
+//source file, with the same chunk size, and the output file has the
+//expected size; the chunks it records are then read back from the output
+//file and the ones whose checksum does not match are received again.
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <stdexcept>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "transfer.h"
+#include "crc32c.h"
+
+class ChunkIndex {
+public:
+    ChunkIndex() = default;
+    ChunkIndex(const ChunkIndex&) = delete;
+    ChunkIndex& operator=(const ChunkIndex&) = delete;
+    ~ChunkIndex() {
+        if(fd_ >= 0) close(fd_);
+    }
+    //load index if it exists and matches the source file, the chunk size
+    //and the content of the output file 'dataFd', which must be readable;
+    //create a new empty one otherwise; returns true if an existing index
+    //was loaded
+    bool Open(const std::string& path, int dataFd, const FileId& source,
+              uint64_t fileSize, uint64_t chunkSize) {
+        std::lock_guard< std::mutex > lock(mutex_);
+        path_ = path;
+        header_ = {MAGIC, fileSize, chunkSize, source};
+        chunks_ = ChunkCount(fileSize, chunkSize);
+        bits_.assign((chunks_ + 7) / 8, 0);
+        crcs_.assign(chunks_, 0);
+        fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if(fd_ < 0) throw std::runtime_error("Cannot open index " + path);
+        Header h;
+        struct stat st;
+        const bool resume =
+            pread(fd_, &h, sizeof(h), 0) == ssize_t(sizeof(h))
+            && h.magic == header_.magic && h.fileSize == header_.fileSize
+            && h.chunkSize == header_.chunkSize && h.source == source
+            && fstat(dataFd, &st) == 0 && uint64_t(st.st_size) == fileSize
+            && pread(fd_, bits_.data(), bits_.size(), BitsOffset())
+               == ssize_t(bits_.size())
+            && pread(fd_, crcs_.data(), CrcsSize(), CrcsOffset())
+               == ssize_t(CrcsSize());
+        if(resume) {
+            Verify(dataFd);
+        } else {
+            bits_.assign(bits_.size(), 0);
+            crcs_.assign(crcs_.size(), 0);
+            if(ftruncate(fd_, 0) != 0
+               || pwrite(fd_, &header_, sizeof(header_), 0)
+                  != ssize_t(sizeof(header_))
+               || pwrite(fd_, bits_.data(), bits_.size(), BitsOffset())
+                  != ssize_t(bits_.size())
+               || pwrite(fd_, crcs_.data(), CrcsSize(), CrcsOffset())
+                  != ssize_t(CrcsSize())) {
+                throw std::runtime_error("Cannot write index " + path);
+            }
+        }
+        remaining_ = 0;
+        for(uint64_t c = 0; c != chunks_; ++c) if(!Test(c)) ++remaining_;
+        return resume;
+    }
+    bool Done(uint64_t chunk) const {
+        std::lock_guard< std::mutex > lock(mutex_);
+        return Test(chunk);
+    }
+    //record chunk written to the output file with checksum 'crc'
+    void Set(uint64_t chunk, uint32_t crc) {
+        std::lock_guard< std::mutex > lock(mutex_);
+        if(Test(chunk)) return;
+        //checksum first: a bit is never set without its checksum
+        crcs_[chunk] = crc;
+        if(pwrite(fd_, &crcs_[chunk], sizeof(crc),
+                  CrcsOffset() + off_t(chunk * sizeof(crc)))
+           != ssize_t(sizeof(crc)))
+            throw std::runtime_error("Cannot write index " + path_);
+        bits_[chunk / 8] |= (1 << (chunk % 8));
+        --remaining_;
+        WriteBits(chunk);
+    }
+    //bitmap of chunks [first, first + count), bit 0 = chunk 'first'
+    std::vector< unsigned char > Slice(uint64_t first, uint64_t count) const {
+        std::lock_guard< std::mutex > lock(mutex_);
+        std::vector< unsigned char > s((count + 7) / 8, 0);
+        for(uint64_t i = 0; i != count; ++i) {
+            if(Test(first + i)) s[i / 8] |= (1 << (i % 8));
+        }
+        return s;
+    }
+    uint64_t Remaining() const {
+        std::lock_guard< std::mutex > lock(mutex_);
+        return remaining_;
+    }
+    //delete index file, called when transfer is complete
+    void Remove() {
+        std::lock_guard< std::mutex > lock(mutex_);
+        if(fd_ >= 0) close(fd_);
+        fd_ = -1;
+        unlink(path_.c_str());
+    }
+private:
+    bool Test(uint64_t chunk) const {
+        return bits_[chunk / 8] & (1 << (chunk % 8));
+    }
+    void WriteBits(uint64_t chunk) {
+        if(pwrite(fd_, &bits_[chunk / 8], 1, BitsOffset() + chunk / 8) != 1)
+            throw std::runtime_error("Cannot write index " + path_);
+    }
+    //clear the chunks whose content does not match the recorded checksum
+    void Verify(int dataFd) {
+        std::vector< char > buffer;
+        for(uint64_t c = 0; c != chunks_; ++c) {
+            if(!Test(c)) continue;
+            const uint64_t offset = c * header_.chunkSize;
+            const size_t size = size_t(std::min(header_.chunkSize,
+                                                header_.fileSize - offset));
+            buffer.resize(size);
+            if(pread(dataFd, buffer.data(), size, off_t(offset))
+                   == ssize_t(size)
+               && CRC32C(buffer.data(), size) == crcs_[c]) continue;
+            bits_[c / 8] &= ~(1 << (c % 8));
+            WriteBits(c);
+        }
+    }
+    off_t BitsOffset() const { return off_t(sizeof(Header)); }
+    off_t CrcsOffset() const { return BitsOffset() + off_t(bits_.size()); }
+    size_t CrcsSize() const { return crcs_.size() * sizeof(uint32_t); }
+private:
+    struct Header {
+        uint64_t magic;
+        uint64_t fileSize;
+        uint64_t chunkSize;
+        FileId source;
+    };
+    static const uint64_t MAGIC = 0x3230584449544646; //"FFTIDX02"
+    mutable std::mutex mutex_;
+    std::string path_;
+    int fd_ = -1;
+    Header header_;
+    uint64_t chunks_ = 0;
+    uint64_t remaining_ = 0;
+    std::vector< unsigned char > bits_;
+    std::vector< uint32_t > crcs_;
+};
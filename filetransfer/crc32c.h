@@ -0,0 +1,94 @@
+#pragma once
+//CRC32C (Castagnoli) checksum used to verify file chunks
+//Author: Ugo Varetto
+//On x86-64 the SSE4.2 crc32 instruction is used when available at run-time,
+//otherwise a table driven implementation processing 8 bytes per iteration
+//(slicing-by-8) is used.
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32C_HW
+#include <nmmintrin.h>
+#endif
+
+namespace crc32c_detail {
+
+const uint32_t POLY = 0x82F63B78; //reversed Castagnoli polynomial
+
+struct Tables {
+    uint32_t t[8][256];
+    Tables() {
+        for(uint32_t i = 0; i != 256; ++i) {
+            uint32_t c = i;
+            for(int k = 0; k != 8; ++k) c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+            t[0][i] = c;
+        }
+        for(uint32_t i = 0; i != 256; ++i) {
+            for(int s = 1; s != 8; ++s) {
+                t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+inline const Tables& GetTables() {
+    static const Tables tables;
+    return tables;
+}
+
+//little endian only, as the rest of the transfer protocol
+inline uint32_t Software(uint32_t crc, const unsigned char* p, size_t n) {
+    const Tables& tb = GetTables();
+    const uint32_t (&t)[8][256] = tb.t;
+    while(n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v ^= crc;
+        crc = t[7][v & 0xFF] ^ t[6][(v >> 8) & 0xFF]
+              ^ t[5][(v >> 16) & 0xFF] ^ t[4][(v >> 24) & 0xFF]
+              ^ t[3][(v >> 32) & 0xFF] ^ t[2][(v >> 40) & 0xFF]
+              ^ t[1][(v >> 48) & 0xFF] ^ t[0][v >> 56];
+        p += 8;
+        n -= 8;
+    }
+    while(n--) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+#ifdef CRC32C_HW
+__attribute__((target("sse4.2")))
+inline uint32_t Hardware(uint32_t crc, const unsigned char* p, size_t n) {
+    uint64_t c = crc;
+    while(n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        n -= 8;
+    }
+    uint32_t c32 = uint32_t(c);
+    while(n--) c32 = _mm_crc32_u8(c32, *p++);
+    return c32;
+}
+
+inline bool HasHardware() {
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+    return sse42;
+}
+#endif
+}
+
+//------------------------------------------------------------------------------
+//pass the value returned by a previous call as 'crc' to checksum data in
+//multiple steps
+inline uint32_t CRC32C(const void* data, size_t size, uint32_t crc = 0) {
+    const unsigned char* p = static_cast< const unsigned char* >(data);
+    crc = ~crc;
+#ifdef CRC32C_HW
+    if(crc32c_detail::HasHardware())
+        return ~crc32c_detail::Hardware(crc, p, size);
+#endif
+    return ~crc32c_detail::Software(crc, p, size);
+}
@@ -5,162 +5,200 @@
  *      Author: ugo
  */
 
-
-
-
-////  File Transfer model #3
-////
-////  In which the client requests each chunk individually, using
-////  command pipelining to give us a credit-based flow control.
-//
-//#include <czmq.h>
-//#define CHUNK_SIZE  250000
-//#define PIPELINE    10
-//
-//static void
-//client_thread (void *args, zctx_t *ctx, void *pipe)
-//{
-//    void *dealer = zsocket_new (ctx, ZMQ_DEALER);
-//    zsocket_connect (dealer, "tcp://127.0.0.1:6000");
-//
-//    //  Up to this many chunks in transit
-//    size_t credit = PIPELINE;
-//
-//    size_t total = 0;       //  Total bytes received
-//    size_t chunks = 0;      //  Total chunks received
-//    size_t offset = 0;      //  Offset of next chunk request
-//
-//    while (true) {
-//        while (credit) {
-//            //  Ask for next chunk
-//            zstr_sendm  (dealer, "fetch");
-//            zstr_sendfm (dealer, "%ld", offset);
-//            zstr_sendf  (dealer, "%ld", CHUNK_SIZE);
-//            offset += CHUNK_SIZE;
-//            credit--;
-//        }
-//        zframe_t *chunk = zframe_recv (dealer);
-//        if (!chunk)
-//            break;              //  Shutting down, quit
-//        chunks++;
-//        credit++;
-//        size_t size = zframe_size (chunk);
-//        zframe_destroy (&chunk);
-//        total += size;
-//        if (size < CHUNK_SIZE)
-//            break;              //  Last chunk received; exit
-//    }
-//    printf ("%zd chunks received, %zd bytes\n", chunks, total);
-//    zstr_send (pipe, "OK");
-//}
-//
-////  The rest of the code is exactly the same as in model 2, except
-////  that we set the HWM on the server's ROUTER socket to PIPELINE
-////  to act as a sanity check.
-//
-////  The server thread waits for a chunk request from a client,
-////  reads that chunk and sends it back to the client:
-//
-//static void
-//server_thread (void *args, zctx_t *ctx, void *pipe)
-//{
-//    FILE *file = fopen ("testdata", "r");
-//    assert (file);
-//
-//    void *router = zsocket_new (ctx, ZMQ_ROUTER);
-//    //  We have two parts per message so HWM is PIPELINE * 2
-//    zsocket_set_hwm (router, PIPELINE * 2);
-//    zsocket_bind (router, "tcp://*:6000");
-//    while (true) {
-//        //  First frame in each message is the sender identity
-//        zframe_t *identity = zframe_recv (router);
-//        if (!identity)
-//            break;              //  Shutting down, quit
-//
-//        //  Second frame is "fetch" command
-//        char *command = zstr_recv (router);
-//        assert (streq (command, "fetch"));
-//        free (command);
-//
-//        //  Third frame is chunk offset in file
-//        char *offset_str = zstr_recv (router);
-//        size_t offset = atoi (offset_str);
-//        free (offset_str);
-//
-//        //  Fourth frame is maximum chunk size
-//        char *chunksz_str = zstr_recv (router);
-//        size_t chunksz = atoi (chunksz_str);
-//        free (chunksz_str);
-//
-//        //  Read chunk of data from file
-//        fseek (file, offset, SEEK_SET);
-//        byte *data = malloc (chunksz);
-//        assert (data);
-//
-//        //  Send resulting chunk to client
-//        size_t size = fread (data, 1, chunksz, file);
-//        zframe_t *chunk = zframe_new (data, size);
-//        zframe_send (&identity, router, ZFRAME_MORE);
-//        zframe_send (&chunk, router, 0);
-//    }
-//    fclose (file);
-//}
-//
-////  The main task starts the client and server threads; it's easier
-////  to test this as a single process with threads, than as multiple
-////  processes:
-//
-//int main (void)
-//{
-//    //  Start child threads
-//    zctx_t *ctx = zctx_new ();
-//    zthread_fork (ctx, server_thread, NULL);
-//    void *client =
-//    zthread_fork (ctx, client_thread, NULL);
-//    //  Loop until client tells us it's done
-//    char *string = zstr_recv (client);
-//    free (string);
-//    //  Kill server thread
-//    zctx_destroy (&ctx);
-//    return 0;
-//}
+//File Transfer model #3 from ZGuide ch. 7: the client requests each chunk
+//individually and keeps up to 'pipeline' requests in flight, which gives a
+//credit-based flow control: one credit is consumed per request sent and
+//returned per chunk received.
+//Changes to original C code:
+// - C++11 and plain libzmq, no czmq
+// - offset and size are sent as binary 64 bit integers
+// - every reply carries the offset of the chunk, so that the client can
+//   write chunks at their position as they arrive, in any order
+// - the server reads chunks with pread directly into the message buffer
+// - client and server can run in separate processes
+//
+//Request:  |"fetch"|offset|chunk size|
+//Reply:    |offset|data|  - data is empty or shorter than the chunk size at
+//                           end of file; chunk sizes are capped at
+//                           MAX_CHUNK_SIZE by the server
+//
+//usage:
+// fastff server <file> <bind URI>
+// fastff client <server URI> <output file> [pipeline] [chunk size]
+// fastff local <file> <output file> [pipeline] [chunk size]
+//'local' runs client and server as threads in the same process over inproc
 
 #include <future>
 #include <thread>
 #include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 #include <iostream>
-#include <fstream>
+#include <chrono>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zmq.h>
+
+#include "../multipart.h"
+#include "../utility.h"
 
 using namespace std;
 
 namespace {
-const int CHUNK_SIZE = 100000;
+const size_t CHUNK_SIZE = 100000;
+//largest chunk served: the chunk buffer is allocated per request with the
+//size requested by the client
+const uint64_t MAX_CHUNK_SIZE = 0x1000000;
 const int PIPELINE_LENGTH = 4;
+const char FETCH[] = "fetch";
 
-void Server(string fname) {
-    ifstream is(fname.c_str(), ios::in | ios::binary);
-    assert(is);
-    void* ctx = zmq_ctx_new();
-    assert(ctx);
-    void* router = zmq_socket(ctx, ZMQ_ROUTER);
-    assert(router);
-    //int zmq_setsockopt (void *socket, int option_name, const void *option_value, size_t option_len);
-    assert(zmq_setsockopt(ZMQ_HWN,
-                          &PIPELINE_LENGTH,
-                          sizeof(PIPELINE_LENGTH)) == 0);
+//------------------------------------------------------------------------------
+uint64_t ToUInt64(const Frame& f) {
+    if(f.size() != sizeof(uint64_t))
+        throw invalid_argument("Malformed message");
+    uint64_t v = 0;
+    memcpy(&v, f.data(), sizeof(v));
+    return v;
 }
 
-void client_thread(void* ctx) {
+//------------------------------------------------------------------------------
+void Server(void* ctx, string fname, string uri) {
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if(fd < 0) throw runtime_error("Cannot open file " + fname);
+    struct stat st;
+    ZCheck(fstat(fd, &st));
+    const uint64_t fileSize = uint64_t(st.st_size);
+    void* router = ZCheck(zmq_socket(ctx, ZMQ_ROUTER));
+    //the original code sets the HWM to PIPELINE * 2 as a sanity check; not
+    //done here since the pipeline length is chosen by each client and ROUTER
+    //silently drops replies when the HWM is reached
+    const int linger = 0;
+    ZCheck(zmq_setsockopt(router, ZMQ_LINGER, &linger, sizeof(linger)));
+    ZCheck(zmq_bind(router, uri.c_str()));
+    Frames request;
+    //returns false when context is terminated
+    while(recv_frames(router, request)) {
+        //|client id|"fetch"|offset|chunk size|; malformed requests are
+        //discarded, a client must not be able to stop the server
+        if(request.size() != 4
+           || !request[1].starts_with(FETCH, strlen(FETCH))
+           || request[2].size() != sizeof(uint64_t)
+           || request[3].size() != sizeof(uint64_t)) {
+            cerr << "Invalid request" << endl;
+            continue;
+        }
+        const uint64_t offset = ToUInt64(request[2]);
+        const uint64_t chunkSize = min(ToUInt64(request[3]), MAX_CHUNK_SIZE);
+        const uint64_t size = offset < fileSize
+                              ? min(chunkSize, fileSize - offset) : 0;
+        //read file data directly into the message buffer
+        Frame chunk(size);
+        if(size && pread(fd, chunk.data(), size, off_t(offset))
+                   != ssize_t(size)) {
+            throw runtime_error("Error reading from file " + fname);
+        }
+        Frames reply;
+        reply.push_back(std::move(request[0]));
+        reply.push_back(Frame(&offset, sizeof(offset)));
+        reply.push_back(std::move(chunk));
+        if(!send_frames(router, reply)) break;
+    }
+    zmq_close(router);
+    close(fd);
+}
 
+//------------------------------------------------------------------------------
+//requests chunks keeping up to 'pipeline' requests in flight, writes chunks
+//at their offset in the output file as they are received
+void Client(void* ctx, string uri, string fname, int pipeline,
+            uint64_t chunkSize) {
+    const int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) throw runtime_error("Cannot open file " + fname);
+    void* dealer = ZCheck(zmq_socket(ctx, ZMQ_DEALER));
+    ZCheck(zmq_connect(dealer, uri.c_str()));
+    const auto start = chrono::steady_clock::now();
+    int credit = pipeline; //up to this many chunks in transit
+    uint64_t total = 0;    //total bytes received
+    uint64_t chunks = 0;   //total chunks received
+    uint64_t offset = 0;   //offset of next chunk request
+    bool eof = false;      //set when a short chunk is received: stop
+                           //sending requests and drain the pipeline
+    Frames reply;
+    while(true) {
+        while(credit && !eof) {
+            ZCheck(zmq_send(dealer, FETCH, strlen(FETCH), ZMQ_SNDMORE));
+            ZCheck(zmq_send(dealer, &offset, sizeof(offset), ZMQ_SNDMORE));
+            ZCheck(zmq_send(dealer, &chunkSize, sizeof(chunkSize), 0));
+            offset += chunkSize;
+            --credit;
+        }
+        if(credit == pipeline) break; //all requests served
+        if(!recv_frames(dealer, reply)) break; //shutting down
+        if(reply.size() != 2) throw logic_error("Malformed reply");
+        ++credit;
+        const Frame& data = reply[1];
+        if(data.size()) {
+            if(pwrite(fd, data.data(), data.size(), off_t(ToUInt64(reply[0])))
+               != ssize_t(data.size())) {
+                throw runtime_error("Error writing to file " + fname);
+            }
+            ++chunks;
+            total += data.size();
+        }
+        if(data.size() < chunkSize) eof = true;
+    }
+    const chrono::duration< double > elapsed =
+        chrono::steady_clock::now() - start;
+    cout << chunks << " chunks received, " << total << " bytes, "
+         << (total / double(0x100000)) / elapsed.count() << " MB/s"
+         << endl;
+    ZCheck(zmq_close(dealer));
+    close(fd);
+}
 }
 
+//------------------------------------------------------------------------------
 int main(int argc, char** argv) {
-    auto server = async(launch::async, server_thread, string(argv[1]));
-    auto client = async(launch::async, client_thread);
-    server.wait();
-    client.wait();
-    return 0;
+    if(argc < 4) {
+        cerr << "usage:\n"
+             << "  " << argv[0] << " server <file> <bind URI>\n"
+             << "  " << argv[0] << " client <server URI> <output file>"
+                                   " [pipeline] [chunk size]\n"
+             << "  " << argv[0] << " local <file> <output file>"
+                                   " [pipeline] [chunk size]" << endl;
+        return EXIT_FAILURE;
+    }
+    const string mode = argv[1];
+    const int pipeline = argc > 4 ? atoi(argv[4]) : PIPELINE_LENGTH;
+    const uint64_t chunkSize = argc > 5 ? strtoull(argv[5], nullptr, 10)
+                                        : CHUNK_SIZE;
+    if(pipeline < 1 || chunkSize < 1 || chunkSize > MAX_CHUNK_SIZE) {
+        cerr << "Invalid pipeline length or chunk size, max chunk size: "
+             << MAX_CHUNK_SIZE << endl;
+        return EXIT_FAILURE;
+    }
+    void* ctx = ZCheck(zmq_ctx_new());
+    if(mode == "server") {
+        Server(ctx, argv[2], argv[3]);
+    } else if(mode == "client") {
+        Client(ctx, argv[2], argv[3], pipeline, chunkSize);
+    } else if(mode == "local") {
+        const string uri = "inproc://fastff";
+        auto server = async(launch::async, Server, ctx, string(argv[2]), uri);
+        Client(ctx, uri, argv[3], pipeline, chunkSize);
+        //terminating the context makes the server exit its receive loop
+        zmq_ctx_shutdown(ctx);
+        server.get();
+    } else {
+        cerr << "Unknown mode '" << mode << "'" << endl;
+        return EXIT_FAILURE;
+    }
+    zmq_ctx_destroy(ctx);
+    return EXIT_SUCCESS;
 }
-
-
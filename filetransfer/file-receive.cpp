@@ -2,57 +2,142 @@
 #include <iostream>
 #include <string>
 #include <cstdlib>
-#include <fstream>
 #include <vector>
+#include <future>
+#include <mutex>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <zmq.h>
 
+#include "transfer.h"
+#include "crc32c.h"
+#include "chunk-index.h"
+
 using namespace std;
 
-int main(int argc, char** argv) {
-    if(argc < 4) {
-        cerr << "usage: " << argv[0] << " <server ip address> <port> "
-                "<filename>" << endl;
-        cerr << "if server address is \"*\" (with quotes) then "
-                "it starts as a server, client otherwise" << endl;
-        return EXIT_FAILURE;
-    }
-    const string address = "tcp://" + string(argv[1])
-                               + ":" + string(argv[2]);
-    const bool SERVER = string(argv[1]) == "*";
-    ofstream os(argv[3], ios::out | ios::binary);
-    if(!os) {
-        cerr << "Cannot open file " << argv[3] << endl;
-        return EXIT_FAILURE;
+//shared by all streams: the first stream receiving the file header opens
+//the index; if no matching index exists the output file is cleared
+struct Output {
+    int fd;
+    string indexPath;
+    ChunkIndex index;
+    once_flag opened;
+    void Open(const FileId& source, uint64_t fileSize, uint64_t chunkSize) {
+        call_once(opened, [this, &source, fileSize, chunkSize]() {
+            const bool resume =
+                index.Open(indexPath, fd, source, fileSize, chunkSize);
+            if(resume) {
+                clog << "Resuming transfer: " << index.Remaining()
+                     << " chunks left" << endl;
+            } else if(ftruncate(fd, 0) != 0) {
+                cerr << "Cannot resize file" << endl;
+                exit(EXIT_FAILURE);
+            }
+            if(ftruncate(fd, off_t(fileSize)) != 0) {
+                cerr << "Cannot resize file" << endl;
+                exit(EXIT_FAILURE);
+            }
+        });
     }
-    //clog << address << endl;
-    void* context = zmq_ctx_new();
+};
+
+//receive one range of the file and write it at its offset with pwrite: all
+//the streams write to the same file descriptor concurrently; chunks are
+//written and recorded in the index only if their checksum matches
+void ReceiveRange(void* context, const string& address, bool server,
+                  Output* out) {
     void* responder = zmq_socket(context, ZMQ_REP);
-    if(SERVER) zmq_bind(responder, address.c_str());
+    if(server) zmq_bind(responder, address.c_str());
     else zmq_connect(responder, address.c_str());
     size_t fileSize = 0;
     size_t chunkSize = 0;
+    Range range = {0, 0};
+    FileId source = {0, 0, 0};
     zmq_recv(responder, (char*) &fileSize, sizeof(fileSize), 0);
+    zmq_recv(responder, &source, sizeof(source), 0);
     //clog << fileSize << endl;
     zmq_send(responder, 0, 0, 0);
     zmq_recv(responder, (char*) &chunkSize, sizeof(chunkSize), 0);
     zmq_send(responder, 0, 0, 0);
+    zmq_recv(responder, (char*) &range, sizeof(range), 0);
+    out->Open(source, fileSize, chunkSize);
+    const uint64_t firstChunk = range.offset / chunkSize;
+    const uint64_t numChunks = ChunkCount(range.length, chunkSize);
+    const vector< unsigned char > received =
+        out->index.Slice(firstChunk, numChunks);
+    zmq_send(responder, received.data(), received.size(), 0);
     vector< char > buffer(chunkSize, char());
-    const int numChunks = int(fileSize / chunkSize); 
-    //clog << "Buffer size: " << buffer.size() << endl;
-    for(int i = 0; i != numChunks; ++i) {
-        zmq_recv(responder, &buffer[0], buffer.size(), 0);
-        zmq_send(responder, 0, 0, 0);
-        //clog << "chunk received" << endl;
-        os.write(&buffer[0], buffer.size());
-    }
-    if(fileSize % chunkSize != 0) {
-        zmq_recv(responder, &buffer[0], fileSize % chunkSize, 0);
-        zmq_send(responder, 0, 0, 0);
+    while(true) {
+        uint64_t chunk = 0;
+        uint32_t crc = 0;
+        //empty message: end of range
+        if(zmq_recv(responder, &chunk, sizeof(chunk), 0) <= 0) break;
+        zmq_recv(responder, &crc, sizeof(crc), 0);
+        const int size = zmq_recv(responder, &buffer[0], buffer.size(), 0);
         //clog << "chunk received" << endl;
-        os.write(&buffer[0], fileSize % chunkSize);
+        const bool valid = chunk >= firstChunk
+                           && chunk < firstChunk + numChunks
+                           && size >= 0 && size_t(size) <= buffer.size()
+                           && CRC32C(&buffer[0], size) == crc;
+        if(valid) {
+            if(pwrite(out->fd, &buffer[0], size, off_t(chunk * chunkSize))
+               != ssize_t(size)) {
+                cerr << "Error writing file" << endl;
+                exit(EXIT_FAILURE);
+            }
+            out->index.Set(chunk, crc);
+        }
+        const unsigned char status = valid ? CHUNK_OK : CHUNK_CORRUPTED;
+        zmq_send(responder, &status, sizeof(status), 0);
     }
+    zmq_send(responder, 0, 0, 0);
     zmq_close(responder);
+}
+
+int main(int argc, char** argv) {
+    if(argc < 4) {
+        cerr << "usage: " << argv[0] << " <server ip address> <port> "
+                "<filename> [streams]" << endl;
+        cerr << "if server address is \"*\" (with quotes) then "
+                "it starts as a server, client otherwise" << endl;
+        cerr << "number of streams must match the one used by the sender"
+             << endl;
+        cerr << "progress is recorded in <filename>.idx: if the transfer "
+                "is interrupted restarting it only fetches missing chunks"
+             << endl;
+        return EXIT_FAILURE;
+    }
+    const bool SERVER = string(argv[1]) == "*";
+    const int STREAMS = argc > 4 ? atoi(argv[4]) : 1;
+    assert(STREAMS > 0);
+    //not truncated: content is kept if an index for it exists; readable,
+    //to verify the chunks recorded in the index
+    Output out;
+    out.fd = open(argv[3], O_RDWR | O_CREAT, 0644);
+    if(out.fd < 0) {
+        cerr << "Cannot open file " << argv[3] << endl;
+        return EXIT_FAILURE;
+    }
+    out.indexPath = string(argv[3]) + ".idx";
+    //clog << address << endl;
+    void* context = zmq_ctx_new();
+    zmq_ctx_set(context, ZMQ_IO_THREADS, STREAMS);
+    vector< future< void > > streams;
+    for(int s = 0; s != STREAMS; ++s) {
+        streams.push_back(
+            async(launch::async, ReceiveRange, context,
+                  StreamAddress(argv[1], atoi(argv[2]), s), SERVER, &out));
+    }
+    for(auto& s: streams) s.get();
     zmq_ctx_destroy(context);
+    close(out.fd);
+    if(out.index.Remaining() == 0) {
+        out.index.Remove();
+    } else {
+        cerr << out.index.Remaining() << " chunks missing" << endl;
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;        
 }
@@ -2,72 +2,161 @@
 #include <iostream>
 #include <string>
 #include <cstdlib>
-#include <fstream>
 #include <vector>
-#include <limits>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <future>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <zmq.h>
 
+#include "transfer.h"
+#include "crc32c.h"
+
 using namespace std;
 
-size_t FileSize(ifstream& is) {
-  const streampos pos = is.tellg();
-  is.clear();
-  is.seekg(is.beg);
-  is.ignore(numeric_limits<streamsize>::max());
-  const size_t size = is.gcount();
-  is.clear(); //clear EOF (set by ignore)
-  is.seekg(pos);
-  return size;
+size_t FileSize(int fd) {
+  struct stat st;
+  if(fstat(fd, &st) != 0) return 0;
+  return size_t(st.st_size);
+}
+
+//called by ZeroMQ when it is done with a chunk pointing into the mapping
+void ReleaseChunk(void*, void* hint) {
+  --*static_cast< atomic< int >* >(hint);
+}
+
+//send one range of the file over its own socket; if 'mapped' is not null
+//chunks point directly into a read-only memory mapping of the file and the
+//payload is never copied in user space, otherwise chunks are read with
+//pread into a buffer; chunks already present at the receiver are skipped
+void SendRange(void* context, const string& address, bool server,
+               int fd, const char* mapped, atomic< int >* pending,
+               size_t fsize, FileId source, size_t chunkSize, Range range) {
+    void* requester = zmq_socket(context, ZMQ_REQ);
+    if(server) zmq_bind(requester, address.c_str());
+    else zmq_connect(requester, address.c_str());
+
+    zmq_send(requester, (char*) &fsize, sizeof(fsize), ZMQ_SNDMORE);
+    zmq_send(requester, &source, sizeof(source), 0);
+    zmq_recv(requester, 0, 0, 0);
+    zmq_send(requester, (char*) &chunkSize, sizeof(chunkSize), 0);
+    zmq_recv(requester, 0, 0, 0);
+    zmq_send(requester, (char*) &range, sizeof(range), 0);
+    const uint64_t firstChunk = range.offset / chunkSize;
+    vector< unsigned char > received(
+        (ChunkCount(range.length, chunkSize) + 7) / 8);
+    zmq_recv(requester, received.data(), received.size(), 0);
+    vector< char > buffer(mapped ? 0 : chunkSize);
+    const uint64_t end = range.offset + range.length;
+    uint64_t skipped = 0;
+    for(uint64_t offset = range.offset; offset < end; offset += chunkSize) {
+        const uint64_t i = offset / chunkSize - firstChunk;
+        if(received[i / 8] & (1 << (i % 8))) {
+            ++skipped;
+            continue;
+        }
+        const size_t size = min(uint64_t(chunkSize), end - offset);
+        const char* data = mapped ? mapped + offset : &buffer[0];
+        if(!mapped
+           && pread(fd, &buffer[0], size, off_t(offset)) != ssize_t(size)) {
+            cerr << "Error reading file" << endl;
+            exit(EXIT_FAILURE);
+        }
+        const uint64_t chunk = firstChunk + i;
+        const uint32_t crc = CRC32C(data, size);
+        unsigned char status = CHUNK_CORRUPTED;
+        for(int retry = 0;
+            status != CHUNK_OK && retry != MAX_CHUNK_RETRIES; ++retry) {
+            zmq_send(requester, &chunk, sizeof(chunk), ZMQ_SNDMORE);
+            zmq_send(requester, &crc, sizeof(crc), ZMQ_SNDMORE);
+            if(mapped) {
+                zmq_msg_t msg;
+                ++*pending;
+                zmq_msg_init_data(&msg, const_cast< char* >(data),
+                                  size, ReleaseChunk, pending);
+                zmq_msg_send(&msg, requester, 0);
+            } else {
+                zmq_send(requester, data, size, 0);
+            }
+            zmq_recv(requester, &status, sizeof(status), 0);
+        }
+        if(status != CHUNK_OK) {
+            cerr << "Chunk " << chunk << " corrupted" << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    //end of range
+    zmq_send(requester, 0, 0, 0);
+    zmq_recv(requester, 0, 0, 0);
+    if(skipped) clog << skipped << " chunks already received" << endl;
+    zmq_close(requester);
 }
 
 int main(int argc, char** argv) {
     if(argc < 5) {
         cerr << "usage: " << argv[0] << " <server ip address> <port> "
-                "<filename> <chunk size>" << endl;
+                "<filename> <chunk size> [mmap|copy] [streams]" << endl;
         cerr << "if server address is \"*\" (with quotes) then "
                 "it starts as a server, client otherwise" << endl;
+        cerr << "if \"mmap\" is specified the file is memory mapped and "
+                "chunks are sent without copying" << endl;
+        cerr << "if number of streams is greater than one the file is split "
+                "into ranges, each sent in parallel over its own socket "
+                "on ports <port>, <port> + 1..." << endl;
         return EXIT_FAILURE;
     }
-    const string address = "tcp://" + string(argv[1])
-                           + ":" + string(argv[2]);
     const bool SERVER = string(argv[1]) == "*";
-    ifstream is(argv[3], ios::in | ios::binary);
-    if(!is) {
+    const bool MMAP = argc > 5 && string(argv[5]) == "mmap";
+    const int STREAMS = argc > 6 ? atoi(argv[6]) : 1;
+    assert(STREAMS > 0);
+    const int fd = open(argv[3], O_RDONLY);
+    if(fd < 0) {
         cerr << "Cannot open file " << argv[3] << endl;
         return EXIT_FAILURE;
     }
-    const size_t fsize = FileSize(is);
+    const size_t fsize = FileSize(fd);
     assert(fsize > 0);
+    const FileId source = GetFileId(fd);
     char* pEnd = nullptr;
     const size_t chunkSize = min(fsize, size_t(strtoull(argv[4], &pEnd, 10)));
     assert(chunkSize > 0);
-    std::vector< char > buffer(chunkSize);
-    
-    void* context = zmq_ctx_new();
-    void* requester = zmq_socket(context, ZMQ_REQ);
-
-    if(SERVER) zmq_bind(requester, address.c_str());
-    else zmq_connect(requester, address.c_str());
 
-    const int numChunks = fsize / chunkSize;
-    zmq_send(requester, (char*) &fsize, sizeof(fsize), 0);
-    zmq_recv(requester, 0, 0, 0);
-    zmq_send(requester, (char*) &chunkSize, sizeof(numChunks), 0);
-    zmq_recv(requester, 0, 0, 0);
-    //clog << "Buffer size: " << buffer.size() << endl;
-    for(int i = 0; i != numChunks; ++i) {
-        is.read(&buffer[0], buffer.size());
-        zmq_send(requester, &buffer[0], buffer.size(), 0);
-        zmq_recv(requester, 0, 0, 0);
+    void* mapped = nullptr;
+    if(MMAP) {
+        mapped = mmap(nullptr, fsize, PROT_READ, MAP_SHARED, fd, 0);
+        if(mapped == MAP_FAILED) {
+            cerr << "Cannot map file" << endl;
+            return EXIT_FAILURE;
+        }
+        madvise(mapped, fsize, STREAMS == 1 ? MADV_SEQUENTIAL : MADV_NORMAL);
     }
-    if(fsize % chunkSize != 0) {
-        is.read(&buffer[0], (long int)(fsize % chunkSize));
-        zmq_send(requester, &buffer[0], fsize % chunkSize, 0);
-        zmq_recv(requester, 0, 0, 0);
+    atomic< int > pending(0);
+
+    void* context = zmq_ctx_new();
+    //one I/O thread per stream
+    zmq_ctx_set(context, ZMQ_IO_THREADS, STREAMS);
+    const vector< Range > ranges = SplitRanges(fsize, chunkSize, STREAMS);
+    vector< future< void > > streams;
+    for(int s = 0; s != STREAMS; ++s) {
+        streams.push_back(
+            async(launch::async, SendRange, context,
+                  StreamAddress(argv[1], atoi(argv[2]), s), SERVER,
+                  fd, static_cast< const char* >(mapped), &pending,
+                  fsize, source, chunkSize, ranges[s]));
     }
-    zmq_close(requester);
+    for(auto& s: streams) s.get();
     zmq_ctx_destroy(context);
+    if(mapped) {
+        //ZeroMQ might still hold the last chunks: wait for release
+        while(pending > 0) this_thread::yield();
+        munmap(mapped, fsize);
+    }
+    close(fd);
     return EXIT_SUCCESS;	
 }
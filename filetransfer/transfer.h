@@ -0,0 +1,88 @@
+#pragma once
+//Definitions shared by file-send and file-receive
+//Author: Ugo Varetto
+//Protocol, one REQ(sender)/REP(receiver) socket pair per stream, messages
+//acknowledged with an empty reply unless specified:
+// 1) file size and identity of the source file: |file size|FileId|; an
+//    index left by an interrupted transfer is reused only if both match
+// 2) chunk size
+// 3) byte range assigned to the stream: |offset|length|
+//    reply: bitmap of chunks of the range already received in a previous,
+//    interrupted transfer; bit i = i-th chunk of the range
+// 4) chunks of the range not yet received: |chunk index|crc32c|data|
+//    chunk index is global, i.e. offset / chunk size
+//    reply: CHUNK_OK or CHUNK_CORRUPTED, in which case the chunk is resent
+// 5) end of range: empty message
+//When striping over N streams, stream k uses port + k and the file is split
+//into N ranges aligned to chunk boundaries.
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <sys/stat.h>
+
+struct Range {
+    uint64_t offset;
+    uint64_t length;
+};
+
+//identifies a version of the source file: a file replaced or modified
+//after an interrupted transfer has a different inode or modification time
+struct FileId {
+    uint64_t device;
+    uint64_t inode;
+    int64_t mtime; //ns
+};
+
+inline bool operator==(const FileId& a, const FileId& b) {
+    return a.device == b.device && a.inode == b.inode && a.mtime == b.mtime;
+}
+
+//------------------------------------------------------------------------------
+inline FileId GetFileId(int fd) {
+    struct stat st;
+    if(fstat(fd, &st) != 0) return {0, 0, 0};
+#ifdef __APPLE__
+    const timespec& t = st.st_mtimespec;
+#else
+    const timespec& t = st.st_mtim;
+#endif
+    return {uint64_t(st.st_dev), uint64_t(st.st_ino),
+            int64_t(t.tv_sec) * 1000000000 + t.tv_nsec};
+}
+
+enum ChunkStatus : unsigned char {CHUNK_OK = 0, CHUNK_CORRUPTED = 1};
+
+//number of times a corrupted chunk is resent before giving up
+const int MAX_CHUNK_RETRIES = 3;
+
+//------------------------------------------------------------------------------
+inline uint64_t ChunkCount(uint64_t size, uint64_t chunkSize) {
+    return (size + chunkSize - 1) / chunkSize;
+}
+
+//------------------------------------------------------------------------------
+//split file into 'streams' ranges made of whole chunks; trailing ranges are
+//empty if there are fewer chunks than streams
+inline std::vector< Range > SplitRanges(uint64_t fileSize,
+                                        uint64_t chunkSize,
+                                        int streams) {
+    const uint64_t chunks = ChunkCount(fileSize, chunkSize);
+    const uint64_t chunksPerStream = (chunks + streams - 1) / streams;
+    std::vector< Range > ranges;
+    for(int s = 0; s != streams; ++s) {
+        const uint64_t begin =
+            std::min(fileSize, s * chunksPerStream * chunkSize);
+        const uint64_t end =
+            std::min(fileSize, (s + 1) * chunksPerStream * chunkSize);
+        ranges.push_back({begin, end - begin});
+    }
+    return ranges;
+}
+
+//------------------------------------------------------------------------------
+inline std::string StreamAddress(const std::string& host, int port,
+                                 int stream) {
+    return "tcp://" + host + ":" + std::to_string(port + stream);
+}
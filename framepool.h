@@ -0,0 +1,128 @@
+#pragma once
+//Thread-local block pool and STL allocator used for message frame storage
+//Author: Ugo Varetto
+//Blocks are grouped in power of two size classes; released blocks are kept
+//in a per-thread free list and handed out again on the next allocation of
+//the same class, so that in steady state receiving, wrapping and unwrapping
+//messages does not hit the heap.
+//Each block is allocated individually: a block released by a thread other
+//than the one that allocated it simply ends up in the releasing thread's
+//pool, which makes the allocator safe to use with containers moved across
+//threads.
+//Blocks released after the thread's pool was destroyed, e.g. by containers
+//owned by other thread_local or static objects destroyed later, go straight
+//back to the heap: Local() returns nullptr once the pool is gone.
+#include <cstddef>
+#include <new>
+#include <array>
+
+//------------------------------------------------------------------------------
+class FramePool {
+public:
+    enum {MIN_BLOCK_SHIFT = 6,   //64 bytes
+          MAX_BLOCK_SHIFT = 16,  //64 kB, larger blocks bypass the pool
+          NUM_CLASSES = MAX_BLOCK_SHIFT - MIN_BLOCK_SHIFT + 1,
+          MAX_CACHED_BLOCKS = 1024}; //per size class
+    FramePool() {
+        heads_.fill(nullptr);
+        cached_.fill(0);
+        State() = ALIVE;
+    }
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+    ~FramePool() {
+        State() = DESTROYED;
+        for(auto head: heads_) {
+            while(head) {
+                FreeBlock* next = head->next;
+                ::operator delete(head);
+                head = next;
+            }
+        }
+    }
+    void* Allocate(size_t size) {
+        const int c = SizeClass(size);
+        if(c < 0) return ::operator new(size);
+        if(FreeBlock* b = heads_[c]) {
+            heads_[c] = b->next;
+            --cached_[c];
+            return b;
+        }
+        return ::operator new(BlockSize(c));
+    }
+    void Release(void* p, size_t size) {
+        const int c = SizeClass(size);
+        if(c < 0 || cached_[c] == MAX_CACHED_BLOCKS) {
+            ::operator delete(p);
+            return;
+        }
+        FreeBlock* b = static_cast< FreeBlock* >(p);
+        b->next = heads_[c];
+        heads_[c] = b;
+        ++cached_[c];
+    }
+    //calling thread's pool, nullptr if already destroyed
+    static FramePool* Local() {
+        if(State() == DESTROYED) return nullptr;
+        static thread_local FramePool pool;
+        return &pool;
+    }
+    static void* AllocateLocal(size_t size) {
+        FramePool* pool = Local();
+        return pool ? pool->Allocate(size) : ::operator new(size);
+    }
+    static void ReleaseLocal(void* p, size_t size) {
+        FramePool* pool = Local();
+        if(pool) pool->Release(p, size);
+        else ::operator delete(p);
+    }
+private:
+    enum {UNINITIALIZED = 0, ALIVE, DESTROYED};
+    //trivially destructible: still valid while thread_local objects are
+    //being destroyed
+    static int& State() {
+        static thread_local int state = UNINITIALIZED;
+        return state;
+    }
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+    static size_t BlockSize(int sizeClass) {
+        return size_t(1) << (sizeClass + MIN_BLOCK_SHIFT);
+    }
+    //index of smallest class that fits 'size' or -1 if too large
+    static int SizeClass(size_t size) {
+        int c = 0;
+        while(c != NUM_CLASSES && BlockSize(c) < size) ++c;
+        return c == NUM_CLASSES ? -1 : c;
+    }
+private:
+    std::array< FreeBlock*, NUM_CLASSES > heads_;
+    std::array< int, NUM_CLASSES > cached_;
+};
+
+//------------------------------------------------------------------------------
+//stateless allocator drawing from the calling thread's FramePool
+template < typename T >
+struct PoolAllocator {
+    typedef T value_type;
+    PoolAllocator() = default;
+    template < typename U >
+    PoolAllocator(const PoolAllocator< U >&) {}
+    T* allocate(size_t n) {
+        return static_cast< T* >(FramePool::AllocateLocal(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) {
+        FramePool::ReleaseLocal(p, n * sizeof(T));
+    }
+};
+
+template < typename T, typename U >
+bool operator==(const PoolAllocator< T >&, const PoolAllocator< U >&) {
+    return true;
+}
+
+template < typename T, typename U >
+bool operator!=(const PoolAllocator< T >&, const PoolAllocator< U >&) {
+    return false;
+}
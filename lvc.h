@@ -0,0 +1,113 @@
+#pragma once
+//Last value cache for pub-sub brokers
+//Author: Ugo Varetto
+//Stores the last message received for each topic (first frame) so that
+//it can be replayed to new subscribers.
+//Open addressing hash table with linear probing: the probe array holds
+//only hash and index into a separate array of messages, 16 bytes per slot,
+//so that probing touches few cache lines; capacity is a power of two and
+//the table doubles when the load factor exceeds 1/2.
+//Messages are stored as clones of the received frames (see
+//Frame::clone): the data is shared with ZeroMQ, not copied.
+//Entries are never removed: the number of topics is expected to be
+//bounded, as in the case of one topic per publisher.
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include <zmq.h>
+
+#include "multipart.h"
+
+//------------------------------------------------------------------------------
+class LastValueCache {
+public:
+    explicit LastValueCache(size_t capacity = 0x400)
+        : slots_(Pow2(std::max(capacity, size_t(8)))) {}
+    //store message, replacing the previous one with the same topic
+    void Update(const Frames& msg) {
+        if(msg.empty()) return;
+        const Frame& topic = msg[0];
+        if(2 * (values_.size() + 1) > slots_.size()) Grow();
+        const uint64_t h = Hash(topic.data(), topic.size());
+        size_t i = Probe(topic.data(), topic.size(), h);
+        if(slots_[i].hash) {
+            values_[slots_[i].index] = clone_frames(msg);
+            return;
+        }
+        slots_[i].hash = h;
+        slots_[i].index = uint32_t(values_.size());
+        values_.push_back(clone_frames(msg));
+        maxTopicSize_ = std::max(maxTopicSize_, topic.size());
+    }
+    //last message for topic, nullptr if not found
+    const Frames* Find(const void* topic, size_t size) const {
+        const size_t i = Probe(topic, size, Hash(topic, size));
+        return slots_[i].hash ? &values_[slots_[i].index] : nullptr;
+    }
+    //invoke f(const Frames&) on the last message of each topic starting
+    //with 'prefix': O(1) if no cached topic is longer than the prefix,
+    //otherwise all entries are scanned
+    template < typename F >
+    void ForEachPrefix(const void* prefix, size_t size, F&& f) const {
+        if(size >= maxTopicSize_) {
+            const Frames* m = Find(prefix, size);
+            if(m) f(*m);
+            return;
+        }
+        for(const Frames& m: values_) {
+            if(m[0].starts_with(prefix, size)) f(m);
+        }
+    }
+    size_t Size() const { return values_.size(); }
+private:
+    struct Slot {
+        uint64_t hash = 0;  //0: empty
+        uint32_t index = 0; //into values_
+    };
+    static size_t Pow2(size_t n) {
+        size_t p = 1;
+        while(p < n) p <<= 1;
+        return p;
+    }
+    //FNV-1a; never 0, which marks empty slots
+    static uint64_t Hash(const void* data, size_t size) {
+        const unsigned char* p = static_cast< const unsigned char* >(data);
+        uint64_t h = 14695981039346656037ULL;
+        for(size_t i = 0; i != size; ++i) {
+            h ^= p[i];
+            h *= 1099511628211ULL;
+        }
+        return h ? h : 1;
+    }
+    //index of slot holding topic or of first empty slot in probe sequence
+    size_t Probe(const void* topic, size_t size, uint64_t h) const {
+        const size_t mask = slots_.size() - 1;
+        for(size_t i = size_t(h) & mask;; i = (i + 1) & mask) {
+            const Slot& s = slots_[i];
+            if(!s.hash) return i;
+            if(s.hash != h) continue;
+            const Frame& t = values_[s.index][0];
+            if(t.size() == size && memcmp(t.data(), topic, size) == 0)
+                return i;
+        }
+    }
+    void Grow() {
+        std::vector< Slot > slots(2 * slots_.size());
+        const size_t mask = slots.size() - 1;
+        for(const Slot& s: slots_) {
+            if(!s.hash) continue;
+            size_t i = size_t(s.hash) & mask;
+            while(slots[i].hash) i = (i + 1) & mask;
+            slots[i] = s;
+        }
+        slots_.swap(slots);
+    }
+private:
+    std::vector< Slot > slots_;
+    std::deque< Frames > values_; //no relocation: Frames is move only
+    size_t maxTopicSize_ = 0;
+};
@@ -1,43 +1,326 @@
 //Standard pub-sub middle layer: forwards subscriptions and messages
 //between a frontend and a backend.
 //Author: Ugo Varetto
+//Subscribers connect to one of the front-end groups, one XPUB socket per
+//group; subscriptions received from all groups are indexed in a prefix
+//trie (see topic-trie.h) and forwarded to publishers only when a topic is
+//subscribed for the first time or unsubscribed by the last group.
+//Each message is routed only to the groups with a subscription matching
+//its topic (first frame), without copying the message data; subscription
+//topics are prefixes, the empty topic matches everything.
+//With the 'lvc' option the last message for each topic is cached (see
+//lvc.h) and replayed to the group a subscription comes from, so that new
+//subscribers do not have to wait for the next update; XPUB_VERBOSE is
+//enabled to receive all subscriptions, not only the first one for each
+//topic. As in the ZGuide LVC example the replayed message is received also
+//by the subscribers in the group already subscribed to the topic.
+//To keep the cache complete the broker subscribes to all topics upstream
+//when the cache is enabled: filtering is then performed at the broker only.
+//Traffic counters and latency histograms are kept for both directions (see
+//proxy.h) and, with the 'stats=<URI>' option, published as text once per
+//second on a PUB socket bound to URI, together with the topics with the
+//highest traffic.
+//With the 'threads=N' option the broker runs N shards, one per thread,
+//each with its own back-end and front-end sockets: shard s binds all the
+//URIs with the TCP port incremented by s * SHARD_PORT_STRIDE (non TCP
+//URIs get a "-s" suffix, see shards.h), and clients started with the same
+//number of shards spread their connections over the shards. Layouts in
+//which two shards would bind the same TCP port are rejected.
+//Shards are federated over inproc: each shard has an XPUB socket other
+//shards connect to with an XSUB socket; messages from the shard's
+//publishers are forwarded to the federation XPUB, which the trie treats as
+//one more group, and messages received from other shards are routed to
+//the local groups only, so that messages never loop. A shard subscribes
+//to other shards only to the topics its own groups subscribe to, and
+//forwards to its publishers also the subscriptions of the other shards:
+//subscriptions are aggregated by the XPUB/XSUB pairs as between brokers.
+//The number of ZeroMQ I/O threads is set to the number of shards.
+//Topic statistics are reported only with a single shard: topic counters
+//are not thread safe.
 
 #include <cassert>
+#include <cstdlib>
 #include <iostream>
+#include <vector>
+#include <string>
+#include <map>
+#include <thread>
+#include <functional>
+#include <algorithm>
 //for framework builds on Mac OS:
 #ifdef __APPLE__
 #include <ZeroMQ/zmq.h>
-#else 
+#else
 #include <zmq.h>
 #endif
 
-int main(int argc, char** argv) {
-    if(argc < 3) {
-        std::cout << "usage: " 
-                  << argv[0] 
-                  << " <front-end URI> <back-end URI>"
-                  << std::endl;
-        std::cout << "Example: broker \"tcp://*:5555\" \"tcp://*:6666\"\n";          
-        return 0;          
+#include "../multipart.h"
+#include "../topic-trie.h"
+#include "../lvc.h"
+#include "../proxy.h"
+#include "shards.h"
+
+struct Config {
+    std::string backendURI;
+    std::vector< std::string > frontendURIs;
+    std::string statsURI;
+    bool useLVC = false;
+    int shards = 1;
+};
+
+//------------------------------------------------------------------------------
+//check that the URIs bound by all the shards are distinct and TCP ports
+//valid; TCP URIs are compared by port only, since binding the same port on
+//the wildcard and on a specific interface fails as well; returns an empty
+//string or the error
+std::string CheckLayout(const Config& cfg) {
+    std::map< std::string, std::string > bound; //port or URI -> URI
+    auto add = [&bound](const std::string& uri) -> std::string {
+        const int port = TCPPort(uri);
+        if(port > 0xFFFF) return "Invalid port in " + uri;
+        const std::string key = port < 0 ? uri : std::to_string(port);
+        auto i = bound.insert(std::make_pair(key, uri));
+        if(!i.second) return uri + " conflicts with " + i.first->second;
+        return std::string();
+    };
+    std::string error;
+    for(int s = 0; s != cfg.shards && error.empty(); ++s) {
+        error = add(ShardURI(cfg.backendURI, s));
+        for(size_t f = 0; f != cfg.frontendURIs.size() && error.empty(); ++f)
+            error = add(ShardURI(cfg.frontendURIs[f], s));
     }
-    void* ctx = zmq_ctx_new(); 
-    void* frontend = zmq_socket(ctx, ZMQ_XPUB);
+    if(error.empty() && !cfg.statsURI.empty()) error = add(cfg.statsURI);
+    return error;
+}
+
+//------------------------------------------------------------------------------
+void Bind(void* socket, const std::string& uri) {
+    if(zmq_bind(socket, uri.c_str()) == 0) return;
+    std::cerr << "Cannot bind " << uri << ": " << zmq_strerror(zmq_errno())
+              << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+//------------------------------------------------------------------------------
+std::string FederationURI(int shard) {
+    return "inproc://broker-shard-" + std::to_string(shard);
+}
+
+//------------------------------------------------------------------------------
+void Shard(void* ctx, const Config& cfg, int shard, ProxyStats& stats) {
     void* backend = zmq_socket(ctx, ZMQ_XSUB);
-    const char* brokerURI = argv[1];
-    const char* backendURI = argv[2];
-    int rc = zmq_bind(frontend, brokerURI);
-    assert(rc == 0);
-    rc = zmq_bind(backend, backendURI);
-    assert(rc == 0);
+    Bind(backend, ShardURI(cfg.backendURI, shard));
+    int rc = 0;
+    std::vector< void* > frontends;
+    for(const std::string& uri: cfg.frontendURIs) {
+        void* frontend = zmq_socket(ctx, ZMQ_XPUB);
+        const int VERBOSE = 1;
+        if(cfg.useLVC) {
+            rc = zmq_setsockopt(frontend, ZMQ_XPUB_VERBOSE, &VERBOSE,
+                                sizeof(VERBOSE));
+            assert(rc == 0);
+        }
+        Bind(frontend, ShardURI(uri, shard));
+        frontends.push_back(frontend);
+    }
+    //federation: messages to other shards through 'fedPub', from other
+    //shards through 'fedSub'; inproc connect before bind requires
+    //ZeroMQ >= 4.0
+    void* fedPub = nullptr;
+    void* fedSub = nullptr;
+    if(cfg.shards > 1) {
+        fedPub = zmq_socket(ctx, ZMQ_XPUB);
+        Bind(fedPub, FederationURI(shard));
+        fedSub = zmq_socket(ctx, ZMQ_XSUB);
+        for(int s = 0; s != cfg.shards; ++s) {
+            if(s == shard) continue;
+            rc = zmq_connect(fedSub, FederationURI(s).c_str());
+            assert(rc == 0);
+        }
+    }
+    void* statsSocket = nullptr;
+    if(shard == 0 && !cfg.statsURI.empty()) {
+        statsSocket = zmq_socket(ctx, ZMQ_PUB);
+        Bind(statsSocket, cfg.statsURI);
+    }
+    //group of the federation XPUB, after the front-end groups
+    const int FEDERATION = int(frontends.size());
+    const TopicTrie::Groups LOCAL_GROUPS =
+        ~(TopicTrie::Groups(1) << FEDERATION);
+    //items: backend, front-end groups, then federation XPUB and XSUB
+    std::vector< zmq_pollitem_t > items(1, {backend, 0, ZMQ_POLLIN, 0});
+    for(void* f: frontends) items.push_back({f, 0, ZMQ_POLLIN, 0});
+    if(fedPub) {
+        items.push_back({fedPub, 0, ZMQ_POLLIN, 0});
+        items.push_back({fedSub, 0, ZMQ_POLLIN, 0});
+    }
+    //all groups, including the federation, and local groups only: a topic
+    //is subscribed from publishers when first subscribed by any group and
+    //from other shards when first subscribed by a local group
+    TopicTrie subscriptions;
+    TopicTrie local;
+    LastValueCache cache;
+    PeerStats topics;
+    StatsPublisher publisher(statsSocket, stats,
+                             cfg.shards == 1 ? &topics : nullptr);
+    const size_t BURST = 0x100;
+    Frames msg;
+    Frame sub;
+    if(cfg.useLVC) {
+        const char ALL = 1;
+        rc = zmq_send(backend, &ALL, sizeof(ALL), 0);
+        assert(rc == 1);
+        if(fedSub) {
+            rc = zmq_send(fedSub, &ALL, sizeof(ALL), 0);
+            assert(rc == 1);
+        }
+    }
+    //route messages from 'from' to the matching groups in 'mask', draining
+    //up to BURST messages per wake-up
+    auto route = [&](void* from, TopicTrie::Groups mask) {
+        size_t n = 0;
+        while(n != BURST && recv_frames(from, msg, ZMQ_DONTWAIT)) {
+            ++n;
+            const auto start = ProxyStats::Clock::now();
+            const size_t frames = msg.size();
+            size_t bytes = 0;
+            for(const Frame& f: msg) bytes += f.size();
+            if(cfg.shards == 1) topics.Record(msg, bytes);
+            if(cfg.useLVC) cache.Update(msg);
+            TopicTrie::Groups groups =
+                subscriptions.Match(msg[0].data(), msg[0].size()) & mask;
+            while(groups) {
+                const int g = __builtin_ctzll(groups);
+                groups &= groups - 1;
+                void* s = g == FEDERATION ? fedPub : frontends[g];
+                if(!groups) {
+                    send_frames(s, msg);
+                } else {
+                    Frames c = clone_frames(msg);
+                    send_frames(s, c);
+                }
+            }
+            stats.Record(ProxyStats::BACKEND_TO_FRONTEND, frames, bytes,
+                         ProxyStats::Clock::now() - start);
+        }
+        if(n) stats.Wakeup(ProxyStats::BACKEND_TO_FRONTEND, n);
+    };
     while(1) {
-        zmq_proxy(frontend, backend, 0);
+        rc = zmq_poll(items.data(), int(items.size()), publisher.Timeout());
+        if(rc == -1) break;
+        //subscription messages: |1 or 0|topic|; XPUB forwards only the
+        //first subscription (all subscriptions if verbose) and the last
+        //unsubscription for each topic, i.e. changes of the group state
+        for(int g = 0; g != FEDERATION + (fedPub ? 1 : 0); ++g) {
+            if(!(items[g + 1].revents & ZMQ_POLLIN)) continue;
+            void* s = g == FEDERATION ? fedPub : frontends[g];
+            rc = sub.recv(s);
+            assert(rc >= 0);
+            const auto start = ProxyStats::Clock::now();
+            const size_t subSize = sub.size();
+            stats.Wakeup(ProxyStats::FRONTEND_TO_BACKEND, 1);
+            if(sub.empty() || (sub.data()[0] != 0 && sub.data()[0] != 1))
+                continue;
+            const bool subscribe = sub.data()[0] == 1;
+            const char* topic = sub.data() + 1;
+            const size_t size = sub.size() - 1;
+            const bool forward = subscribe
+                ? subscriptions.Subscribe(topic, size, g)
+                : subscriptions.Unsubscribe(topic, size, g);
+            //other shards cache all the messages themselves
+            if(cfg.useLVC && subscribe && g != FEDERATION) {
+                cache.ForEachPrefix(topic, size,
+                                    [&frontends, g](const Frames& m) {
+                    Frames c = clone_frames(m);
+                    send_frames(frontends[g], c);
+                });
+            }
+            const bool federate = fedSub && g != FEDERATION
+                && (subscribe ? local.Subscribe(topic, size, g)
+                              : local.Unsubscribe(topic, size, g));
+            if(!cfg.useLVC) {
+                if(federate) {
+                    Frame c = sub.clone();
+                    c.send(fedSub);
+                }
+                if(forward) sub.send(backend);
+            }
+            stats.Record(ProxyStats::FRONTEND_TO_BACKEND, 1, subSize,
+                         ProxyStats::Clock::now() - start);
+        }
+        //messages from publishers: route to matching groups, including
+        //other shards
+        if(items[0].revents & ZMQ_POLLIN)
+            route(backend, ~TopicTrie::Groups(0));
+        //messages from other shards: route to local groups only
+        if(fedSub && (items.back().revents & ZMQ_POLLIN))
+            route(fedSub, LOCAL_GROUPS);
+        publisher.Poll();
+    }
+    if(statsSocket) {
+        rc = zmq_close(statsSocket);
+        assert(rc == 0);
+    }
+    if(fedPub) {
+        rc = zmq_close(fedPub);
+        assert(rc == 0);
+        rc = zmq_close(fedSub);
+        assert(rc == 0);
+    }
+    for(void* f: frontends) {
+        rc = zmq_close(f);
+        assert(rc == 0);
     }
-    rc = zmq_close(frontend);
-    assert(rc == 0);
     rc = zmq_close(backend);
     assert(rc == 0);
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+    if(argc < 3) {
+        std::cout << "usage: "
+                  << argv[0]
+                  << " <front-end URI> <back-end URI> [lvc]"
+                     " [additional front-end URIs] [stats=<stats URI>]"
+                     " [threads=<number of shards>]"
+                  << std::endl;
+        std::cout << "Example: broker \"tcp://*:5555\" \"tcp://*:6666\" lvc"
+                     " \"tcp://*:5556\" \"stats=tcp://*:5557\" threads=4\n";
+        return 0;
+    }
+    Config cfg;
+    cfg.backendURI = argv[2];
+    cfg.useLVC = argc > 3 && std::string(argv[3]) == "lvc";
+    const std::string STATS = "stats=";
+    const std::string THREADS = "threads=";
+    for(int i = 1; i != argc; ++i) {
+        if(i == 2 || (i == 3 && cfg.useLVC)) continue;
+        const std::string arg = argv[i];
+        if(arg.compare(0, STATS.size(), STATS) == 0) {
+            cfg.statsURI = arg.substr(STATS.size());
+        } else if(arg.compare(0, THREADS.size(), THREADS) == 0) {
+            cfg.shards = std::max(1, atoi(arg.c_str() + THREADS.size()));
+        } else cfg.frontendURIs.push_back(arg);
+    }
+    //one group is reserved for the federation
+    assert(cfg.frontendURIs.size() < TopicTrie::MAX_GROUPS);
+    const std::string error = CheckLayout(cfg);
+    if(!error.empty()) {
+        std::cerr << error << std::endl;
+        return EXIT_FAILURE;
+    }
+    void* ctx = zmq_ctx_new();
+    int rc = zmq_ctx_set(ctx, ZMQ_IO_THREADS, cfg.shards);
+    assert(rc == 0);
+    //shared by all shards: each thread updates its own slot
+    ProxyStats stats;
+    std::vector< std::thread > shards;
+    for(int s = 1; s < cfg.shards; ++s)
+        shards.push_back(std::thread(Shard, ctx, std::cref(cfg), s,
+                                     std::ref(stats)));
+    Shard(ctx, cfg, 0, stats);
+    for(auto& t: shards) t.join();
     rc = zmq_ctx_destroy(ctx);
     assert(rc == 0);
     return 0;
 }
-
@@ -2,6 +2,8 @@
 //the message content; remote clients subscribe to log output through a
 //broker
 //Author: Ugo Varetto
+//With a sharded broker (see shards.h) the number of shards must be passed
+//on the command line: the process id selects the shard to connect to
 
 //Note: UNIX only; for windows use DWORD type instead of pid_t and
 //GetProcessId instead of getpid
@@ -17,6 +19,11 @@
 #else 
 #include <zmq.h>
 #endif
+#include <cstdlib>
+#include <string>
+#include <algorithm>
+
+#include "shards.h"
 
 typedef pid_t PID;
 
@@ -30,15 +37,16 @@ int main(int argc, char** argv) {
     if(argc < 2) {
         std::cout << "usage: " 
                   << argv[0] 
-                  << " <broker URI>"
+                  << " <broker URI> [broker shards, default 1]"
                   << std::endl;
         std::cout << "Example: logger \"tcp://logbroker:5555\"\n";          
         return 0;          
     }
     void* ctx = zmq_ctx_new(); 
     void* req = zmq_socket(ctx, ZMQ_PUB);
-    const char* brokerURI = argv[1];
-    int rc = zmq_connect(req, brokerURI);
+    const int SHARDS = argc > 2 ? std::max(1, atoi(argv[2])) : 1;
+    const std::string brokerURI = ClientShardURI(argv[1], SHARDS);
+    int rc = zmq_connect(req, brokerURI.c_str());
     assert(rc == 0);
     unsigned char buffer[0x100];
     size_t size = 0;
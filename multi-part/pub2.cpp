@@ -2,6 +2,11 @@
 //the message content; remote clients subscribe to log output through a
 //broker
 //Author: Ugo Varetto
+//With batching enabled records are packed into |pid|batch| messages (see
+//batch.h): the process id stays in the first frame so that subscription
+//filtering in the broker is not affected
+//With a sharded broker (see shards.h) the number of shards must be passed
+//on the command line: the process id selects the shard to connect to
 
 //Note: UNIX only; for windows use DWORD type instead of pid_t and
 //GetProcessId instead of getpid
@@ -11,6 +16,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <iostream>
+#include <cstdlib>
+#include <string>
+#include <algorithm>
 //for framework builds on Mac OS:
 #ifdef __APPLE__
 #include <ZeroMQ/zmq.h>
@@ -18,6 +26,8 @@
 #include <zmq.h>
 #endif
 #include <multipart.h>
+#include <batch.h>
+#include "shards.h"
 
 typedef pid_t PID;
 
@@ -32,29 +42,39 @@ int main(int argc, char** argv) {
     if(argc < 2) {
         std::cout << "usage: " 
                   << argv[0] 
-                  << " <broker URI>"
+                  << " <broker URI> [records per second, default 1]"
+                     " [batch size bytes, default 0: no batching]"
+                     " [max batch delay us, default 1000]"
+                     " [broker shards, default 1]"
                   << std::endl;
         std::cout << "Example: logger \"tcp://logbroker:5555\"\n";          
         return 0;          
     }
     void* ctx = zmq_ctx_new(); 
     void* req = zmq_socket(ctx, ZMQ_PUB);
-    const char* brokerURI = argv[1];
-    int rc = zmq_connect(req, brokerURI);
+    const int SHARDS = argc > 5 ? std::max(1, atoi(argv[5])) : 1;
+    const std::string brokerURI = ClientShardURI(argv[1], SHARDS);
+    int rc = zmq_connect(req, brokerURI.c_str());
     assert(rc == 0);
-    unsigned char buffer[0x100];
-    size_t size = 0;
+    const int RECORDS = argc > 2 ? atoi(argv[2]) : 1;
+    const size_t BATCH_SIZE = argc > 3 ? strtoul(argv[3], nullptr, 10) : 0;
+    const std::chrono::microseconds MAX_DELAY(argc > 4 ? atoi(argv[4])
+                                                       : 1000);
     std::cout << "PID: " << get_proc_id() << std::endl;
     int pid = int(get_proc_id());
+    Batcher batcher(req, &pid, sizeof(pid), BATCH_SIZE, MAX_DELAY);
+    FrameList msgs;
+    char h[] = "hello";
+    push_front(msgs, h, strlen(h));
+    push_front(msgs, &pid, sizeof(pid));
     while(1) {
-        std::vector< std::vector< char > > msgs;
-        std::vector< char > msg1((char*) &pid, ((char*) &pid) + sizeof(pid));
-        char h[] = "hello";
-        std::vector< char > msg2(h, h + strlen(h));
-        msgs.push_back(msg1);
-        msgs.push_back(msg2);
-    	send_messages(req, msgs);
-        sleep(2);
+        for(int i = 0; i != RECORDS; ++i) {
+            if(BATCH_SIZE) batcher.Add(h, strlen(h));
+            else send_messages(req, msgs);
+        }
+        //do not hold records while sleeping
+        batcher.Flush();
+        sleep(1);
     }
     rc = zmq_close(req);
     assert(rc == 0);
@@ -0,0 +1,43 @@
+#pragma once
+//Mapping of the broker URIs to shards, shared by the broker and its clients
+//Author: Ugo Varetto
+//A broker started with 'threads=N' runs N shards: shard s binds each URI
+//with the TCP port incremented by s * SHARD_PORT_STRIDE, non TCP URIs get
+//a "-s" suffix. Clients started with the same number of shards connect to
+//the shard selected by their process id: shards are federated, so
+//subscribers receive the messages published through any shard and each
+//client connects to one shard only, to avoid receiving duplicates.
+#include <string>
+#include <cstdlib>
+
+#include <unistd.h>
+
+const int SHARD_PORT_STRIDE = 100;
+
+//------------------------------------------------------------------------------
+//port of a tcp:// URI, -1 if not a TCP URI or the port is not a number
+inline int TCPPort(const std::string& uri) {
+    const size_t colon = uri.rfind(':');
+    if(uri.compare(0, 6, "tcp://") != 0 || colon <= 5
+       || colon + 1 == uri.size()
+       || uri.find_first_not_of("0123456789", colon + 1) != std::string::npos)
+        return -1;
+    return atoi(uri.c_str() + colon + 1);
+}
+
+//------------------------------------------------------------------------------
+//URI of 'shard': TCP port + shard * SHARD_PORT_STRIDE or URI-shard
+inline std::string ShardURI(const std::string& uri, int shard) {
+    if(!shard) return uri;
+    const int port = TCPPort(uri);
+    if(port >= 0)
+        return uri.substr(0, uri.rfind(':') + 1)
+               + std::to_string(port + shard * SHARD_PORT_STRIDE);
+    return uri + "-" + std::to_string(shard);
+}
+
+//------------------------------------------------------------------------------
+//URI of the shard a client of a broker with 'shards' shards connects to
+inline std::string ClientShardURI(const std::string& uri, int shards) {
+    return ShardURI(uri, shards > 1 ? int(getpid() % shards) : 0);
+}
@@ -1,6 +1,9 @@
 //Remote logger client: subscribe to specific process ids to receive
 //log messages.
 //Author: Ugo Varetto
+//With a sharded broker (see shards.h) the number of shards must be passed
+//on the command line: the process id selects the shard to connect to and
+//messages published through the other shards are forwarded by the broker
 
 //Note: UNIX only; for windows use DWORD type instead of pid_t
 
@@ -16,6 +19,10 @@
 #else 
 #include <zmq.h>
 #endif
+#include <string>
+#include <algorithm>
+
+#include "shards.h"
 
 typedef int PID;
 
@@ -24,18 +31,20 @@ int main(int argc, char** argv) {
     if(argc < 2) {
         std::cout << "usage: " 
                   << argv[0] 
-                  << " <server URI> [process id]"
+                  << " <server URI> [process id] [broker shards, default 1]"
                   << std::endl;
         std::cout << "Example: client \"tcp://logbroker:5555\" 27852\n";
         std::cout << "To receive notifications from ALL processes omit the"
-                     " process id parameter\n";          
+                     " process id parameter or pass 0 when the number of"
+                     " shards is specified\n";          
         return 0;          
     }
     void* ctx = zmq_ctx_new(); 
     void* publisher = zmq_socket(ctx, ZMQ_SUB);
-    const char* brokerURI = argv[1];
     const PID pid = argc > 2 ? atoi(argv[2]) : 0;
-    int rc = zmq_connect(publisher, brokerURI);
+    const int SHARDS = argc > 3 ? std::max(1, atoi(argv[3])) : 1;
+    const std::string brokerURI = ClientShardURI(argv[1], SHARDS);
+    int rc = zmq_connect(publisher, brokerURI.c_str());
     assert(rc == 0);
     rc = pid > 0 ? zmq_setsockopt(publisher, ZMQ_SUBSCRIBE, &pid, sizeof(pid))
                  : zmq_setsockopt(publisher, ZMQ_SUBSCRIBE, "", 0); 
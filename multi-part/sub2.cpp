@@ -1,6 +1,10 @@
 //Remote logger client: subscribe to specific process ids to receive
 //log messages.
 //Author: Ugo Varetto
+//With a sharded broker (see shards.h) the number of shards must be passed
+//on the command line: the process id selects the shard to connect to and
+//messages published through the other shards are forwarded by the broker
+//Batches of records (see batch.h) are unpacked transparently
 
 //Note: UNIX only; for windows use DWORD type instead of pid_t
 
@@ -17,8 +21,11 @@
 #else 
 #include <zmq.h>
 #endif
+#include <algorithm>
 
 #include <multipart.h>
+#include <batch.h>
+#include "shards.h"
 
 typedef int PID;
 
@@ -27,34 +34,35 @@ int main(int argc, char** argv) {
     if(argc < 2) {
         std::cout << "usage: " 
                   << argv[0] 
-                  << " <server URI> [process id]"
+                  << " <server URI> [process id] [broker shards, default 1]"
                   << std::endl;
         std::cout << "Example: client \"tcp://logbroker:5555\" 27852\n";
         std::cout << "To receive notifications from ALL processes omit the"
-                     " process id parameter\n";          
+                     " process id parameter or pass 0 when the number of"
+                     " shards is specified\n";          
         return 0;          
     }
     void* ctx = zmq_ctx_new();
     assert(ctx); 
     void* publisher = zmq_socket(ctx, ZMQ_SUB);
     assert(publisher);
-    const char* brokerURI = argv[1];
     const PID pid = argc > 2 ? atoi(argv[2]) : 0;
-    int rc = zmq_connect(publisher, brokerURI);
+    const int SHARDS = argc > 3 ? std::max(1, atoi(argv[3])) : 1;
+    const std::string brokerURI = ClientShardURI(argv[1], SHARDS);
+    int rc = zmq_connect(publisher, brokerURI.c_str());
     assert(rc == 0);
     rc = pid > 0 ? zmq_setsockopt(publisher, ZMQ_SUBSCRIBE, &pid, sizeof(pid))
                  : zmq_setsockopt(publisher, ZMQ_SUBSCRIBE, "", 0); 
     assert(rc == 0);
     unsigned char buffer[0x100];
     int p = -1;
+    FrameList msgs; //reused across iterations: no per-message allocation
     while(1) {
-       
-        std::vector< std::vector< char > > msgs = 
-                                            (recv_messages(publisher));
-        if(msgs.size())
-            std::cout << std::string(&(msgs.back()[0]), 
-                                     &(msgs.back()[0]) + msgs.back().size()) 
-                      << std::endl;
+        if(recv_messages(publisher, msgs))
+            ForEachRecord(msgs.back().data(), msgs.back().size(),
+                          [](const char* r, size_t size) {
+                std::cout << std::string(r, r + size) << std::endl;
+            });
         else std::cout << "<EMPTY>" << std::endl;              
     }
     rc = zmq_close(publisher);
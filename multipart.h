@@ -5,39 +5,200 @@
 #include <algorithm>
 #include <iostream>
 #include <string>
+#include <deque>
+#include <cstring>
+#include <cassert>
+
+#include "framepool.h"
 
 typedef std::vector< std::vector< char > > CharArrays;
+//reusable alternative to CharArrays: frame storage and list nodes come from
+//the thread-local FramePool and push_front/pop_front are O(1)
+typedef std::vector< char, PoolAllocator< char > > PooledChars;
+typedef std::deque< PooledChars, PoolAllocator< PooledChars > > FrameList;
+//------------------------------------------------------------------------------
+//Single message part owning a zmq_msg_t: data is received straight into the
+//buffer allocated by ZeroMQ and handed back to ZeroMQ on send, so forwarding
+//a frame never copies its payload; frames are movable but not copyable
+class Frame {
+public:
+    Frame() { zmq_msg_init(&msg_); }
+    explicit Frame(size_t size) {
+        const int rc = zmq_msg_init_size(&msg_, size);
+        assert(rc == 0);
+    }
+    Frame(const void* data, size_t size) {
+        const int rc = zmq_msg_init_size(&msg_, size);
+        assert(rc == 0);
+        if(size) memcpy(zmq_msg_data(&msg_), data, size);
+    }
+    Frame(Frame&& f) noexcept {
+        zmq_msg_init(&msg_);
+        zmq_msg_move(&msg_, &f.msg_);
+    }
+    Frame& operator=(Frame&& f) noexcept {
+        //zmq_msg_move releases the resources held by the target
+        if(this != &f) zmq_msg_move(&msg_, &f.msg_);
+        return *this;
+    }
+    Frame(const Frame&) = delete;
+    Frame& operator=(const Frame&) = delete;
+    ~Frame() { zmq_msg_close(&msg_); }
+    //view over message data
+    char* data() { return static_cast< char* >(zmq_msg_data(&msg_)); }
+    const char* data() const {
+        return static_cast< const char* >(
+            zmq_msg_data(const_cast< zmq_msg_t* >(&msg_)));
+    }
+    size_t size() const {
+        return zmq_msg_size(const_cast< zmq_msg_t* >(&msg_));
+    }
+    bool empty() const { return size() == 0; }
+    const char* begin() const { return data(); }
+    const char* end() const { return data() + size(); }
+    std::string str() const { return std::string(begin(), end()); }
+    //true if frame data starts with the passed sequence of bytes
+    bool starts_with(const void* p, size_t sz) const {
+        return size() >= sz && memcmp(data(), p, sz) == 0;
+    }
+    //receive message part; returns number of bytes received or -1
+    int recv(void* socket, int flags = 0) {
+        return zmq_msg_recv(&msg_, socket, flags);
+    }
+    //send message part: on success ownership of the data is transferred to
+    //ZeroMQ and the frame is left empty
+    int send(void* socket, int flags = 0) {
+        return zmq_msg_send(&msg_, socket, flags);
+    }
+    zmq_msg_t* msg() { return &msg_; }
+    //new frame sharing the same data: ZeroMQ reference counts the buffer,
+    //use to send the same frame to more than one socket without copying
+    Frame clone() const {
+        Frame f;
+        const int rc = zmq_msg_copy(&f.msg_, const_cast< zmq_msg_t* >(&msg_));
+        assert(rc == 0);
+        return f;
+    }
+private:
+    zmq_msg_t msg_;
+};
+
+//deque: routing envelopes are pushed and popped at the front in O(1)
+typedef std::deque< Frame, PoolAllocator< Frame > > Frames;
+
 //------------------------------------------------------------------------------
+//receive all the parts of a multipart message; previous content of 'frames'
+//is discarded; returns false if nothing was received; with ZMQ_DONTWAIT
+//returns false if no message is available: the parts of a multipart
+//message are delivered together
+inline bool recv_frames(void* socket, Frames& frames, int flags = 0) {
+    frames.clear();
+    while(true) {
+        frames.push_back(Frame());
+        if(frames.back().recv(socket, flags) < 0) {
+            frames.pop_back();
+            break;
+        }
+        if(!zmq_msg_more(frames.back().msg())) break;
+    }
+    return !frames.empty();
+}
+
+//------------------------------------------------------------------------------
+inline Frames recv_frames(void* socket) {
+    Frames frames;
+    recv_frames(socket, frames);
+    return frames;
+}
+
+//------------------------------------------------------------------------------
+//send all frames as a single multipart message; frames are consumed
+inline bool send_frames(void* socket, Frames& frames) {
+    if(frames.empty()) return false;
+    const Frames::iterator last = --frames.end();
+    for(Frames::iterator i = frames.begin(); i != last; ++i) {
+        if(i->send(socket, ZMQ_SNDMORE) < 0) return false;
+    }
+    const bool ok = last->send(socket, 0) >= 0;
+    frames.clear();
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+//shallow copy of all frames, see Frame::clone
+inline Frames clone_frames(const Frames& frames) {
+    Frames c;
+    for(const Frame& f: frames) c.push_back(f.clone());
+    return c;
+}
+
+//------------------------------------------------------------------------------
+inline void push_front(Frames& frames, Frame&& f) {
+    frames.push_front(std::move(f));
+}
+
+//------------------------------------------------------------------------------
+//remove the first n frames e.g. to strip a routing envelope
+inline void pop_front(Frames& frames, size_t n = 1) {
+    assert(n <= frames.size());
+    while(n--) frames.pop_front();
+}
+
+//------------------------------------------------------------------------------
+//receive all parts of a multipart message reusing the frames already stored
+//in 'frames': existing buffers keep their capacity and are overwritten;
+//returns false if nothing was received
+inline bool recv_messages(void* socket, FrameList& frames) {
+    size_t count = 0;
+    Frame frame;
+    while(true) {
+        if(frame.recv(socket) < 0) break;
+        if(count == frames.size()) frames.push_back(PooledChars());
+        frames[count].assign(frame.begin(), frame.end());
+        ++count;
+        if(!zmq_msg_more(frame.msg())) break;
+    }
+    frames.resize(count);
+    return count > 0;
+}
+
+//------------------------------------------------------------------------------
+inline void send_messages(void* socket, const FrameList& frames) {
+    assert(!frames.empty());
+    const FrameList::const_iterator last = --frames.end();
+    for(FrameList::const_iterator i = frames.begin(); i != last; ++i) {
+        const int rc = zmq_send(socket, i->data(), i->size(), ZMQ_SNDMORE);
+        assert(rc == int(i->size()));
+    }
+    const int rc = zmq_send(socket, last->data(), last->size(), 0);
+    assert(rc == int(last->size()));
+}
+
+//------------------------------------------------------------------------------
+inline void push_front(FrameList& frames, const void* data, size_t size) {
+    const char* p = static_cast< const char* >(data);
+    frames.push_front(PooledChars(p, p + size));
+}
+
+//------------------------------------------------------------------------------
+inline void pop_front(FrameList& frames, size_t n = 1) {
+    assert(n <= frames.size());
+    while(n--) frames.pop_front();
+}
+
+//------------------------------------------------------------------------------
+//frames are received through zmq_msg_t to avoid truncating parts larger than
+//any fixed-size buffer; data is then copied into the returned arrays
 inline CharArrays
 recv_messages(void* socket) {
-    int rc = -1;
-    bool finished = false;
-    int opt = 0;
-    size_t len = sizeof(opt);
     CharArrays ret;
-    std::vector< char > buffer(0x100);
-    rc = zmq_recv(socket, &buffer[0], buffer.size(), 0);
-    if(rc < 0) return ret;
-    ret.push_back(std::move
-                   (std::vector< char >
-                      (buffer.begin(),
-                       buffer.begin() + rc)));
+    Frame frame;
     while(true) {
-        opt = 0;
-        if(zmq_getsockopt(socket, ZMQ_RCVMORE, &opt, &len) != 0) {
-			      std::cerr << zmq_strerror(errno) << std::endl;
-			      return ret;
-		    }
-        if(opt) {
-        	rc = zmq_recv(socket, &buffer[0], buffer.size(), 0);
-        	if(rc < 0) break;
-          ret.push_back(std::move
-                         (std::vector< char >
-                            (buffer.begin(),
-                             buffer.begin() + rc)));
-        } else break;
+        if(frame.recv(socket) < 0) break;
+        ret.push_back(std::vector< char >(frame.begin(), frame.end()));
+        if(!zmq_msg_more(frame.msg())) break;
     }
-   return ret;
+    return ret;
 }
 //------------------------------------------------------------------------------
 inline void send_messages(void* socket,
@@ -70,4 +231,12 @@ std::ostream& operator<<(std::ostream& os, const CharArrays& ca) {
             });
     return os;
 }
-
+//------------------------------------------------------------------------------
+std::ostream& operator<<(std::ostream& os, const Frames& frames) {
+    std::for_each(frames.begin(), frames.end(),
+            [&os](const Frame& f) {
+                if(f.empty()) os << "> <EMPTY>\n";
+                else os << "> " << f.str() << "\n";
+            });
+    return os;
+}
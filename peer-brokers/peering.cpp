@@ -39,6 +39,7 @@
 #include <algorithm>
 #include <sstream>
 #include <cstring>
+#include <thread>
 
 #ifdef __APPLE__
 #include <ZeroMQ/zmq.h>
@@ -113,20 +114,18 @@ void worker_task(const std::string& id, //identity of peer attached through
     assert(zmq_connect(worker, id.c_str()) == 0);
     //  Tell broker we're ready for work
     assert(zmq_send(worker, WORKER_READY, strlen(WORKER_READY), 0) > 0);
-    CharArrays msgs;
+    Frames msgs;
     //  Process messages as they arrive
     std::ostringstream oss;
     oss << "Hi from server " << num << " @ " << identity;
     const std::string msg = oss.str();
     while (true) {
-        msgs = std::move(recv_messages(worker));
-        if(msgs.size() == 0) break;
+        if(!recv_frames(worker, msgs)) break;
         // printf("\n\n=========================\nWorker:\n");
         // std::cout << msgs;
         // printf("-------------------------\n\n");
-        msgs.resize(msgs.size() - 1);
-        msgs.push_back(std::vector< char >(msg.begin(), msg.end()));
-        send_messages(worker, msgs);
+        msgs.back() = Frame(msg.data(), msg.size());
+        send_frames(worker, msgs);
     }
     assert(zmq_close(worker) == 0);
     assert(zmq_ctx_destroy(ctx) == 0);
@@ -256,6 +255,8 @@ int main (int argc, char *argv []) {
     enum {REQ_SOCKET_ID_OFFSET = 0,
           REQ_SOCKET_EMPTY_OFFSET = 0,
           REQ_SOCKET_DATA_OFFSET};  
+    //frames are forwarded as received: payloads are never copied
+    Frames msgs;
     while (true) {
         // First, route any waiting replies from workers
         zmq_pollitem_t backends [] = {
@@ -267,29 +268,24 @@ int main (int argc, char *argv []) {
             worker_queue.size() ? 1000: -1);
         if (rc == -1)
             break;              //  Interrupted
-        std::vector< char > msg(0x200);
-        CharArrays msgs;
+        msgs.clear();
         void* dest_socket = 0;
         //  Handle reply from local worker
         if(backends[0].revents & ZMQ_POLLIN) {
             //recv ID
-            msgs = std::move(recv_messages(localbe));
             //  Interrupted
-            if(msgs.size() == 0)
+            if(!recv_frames(localbe, msgs))
                 break;
-            const std::string wid(msgs.front().begin(),  
-                                      msgs.front().end());
-            worker_queue.push_back(wid);
-            //need to use std::equal instead of == operator because
-            //WORKER_READY is null terminated
-            if(std::equal(msgs.back().begin(),
-                          msgs.back().end(),
-                          WORKER_READY)) {
+            worker_queue.push_back(msgs.front().str());
+            //compare without terminating null: WORKER_READY is
+            //null terminated
+            if(msgs.back().starts_with(WORKER_READY,
+                                       strlen(WORKER_READY))) {
                 msgs.clear();
             } else {
                 //strip REQ envelpe: id + empty delimiter
-                msgs = CharArrays(++++msgs.begin(), msgs.end()); 
-                if(is_peer_name(chars_to_string(msgs.front()).c_str(),
+                pop_front(msgs, 2);
+                if(is_peer_name(msgs.front().str().c_str(),
                                 argv + 2, argc - 2)) {
                     dest_socket = cloudfe;
                 } else {   
@@ -298,22 +294,26 @@ int main (int argc, char *argv []) {
             } //  Or handle reply from peer broker
             //strip worker id and empty delimiter from message
         } else if(backends[1].revents & ZMQ_POLLIN) {
-            msgs = std::move(recv_messages(cloudbe));
-            //strip ROUTER envelope: id
-            msgs = CharArrays(++msgs.begin(), msgs.end());                          
-            if(is_peer_name(
-                 chars_to_string
-                    (msgs.front()).c_str(),
-                     argv + 2,
-                     argc - 2)) {
-                dest_socket = cloudfe;
-            } else {   
-                dest_socket = localfe;
+            //  Interrupted
+            if(!recv_frames(cloudbe, msgs))
+                break;
+            if(msgs.size() < 2) {
+                msgs.clear(); //no payload after the envelope: discard
+            } else {
+                //strip ROUTER envelope: id
+                pop_front(msgs);
+                if(is_peer_name(msgs.front().str().c_str(),
+                                argv + 2,
+                                argc - 2)) {
+                    dest_socket = cloudfe;
+                } else {
+                    dest_socket = localfe;
+                }
             }
         }
         //  Route reply to client if we still need to
         if(msgs.size()) {       
-            send_messages(dest_socket, msgs);
+            send_frames(dest_socket, msgs);
         }
         while(worker_queue.size()) {
             zmq_pollitem_t frontends [] = {
@@ -325,10 +325,10 @@ int main (int argc, char *argv []) {
             int reroutable = 0;
             //  We'll do peer brokers first, to prevent starvation
             if (frontends[1].revents & ZMQ_POLLIN) {
-                msgs = std::move(recv_messages(cloudfe));
+                recv_frames(cloudfe, msgs);
                 reroutable = 0;
             } else if (frontends [0].revents & ZMQ_POLLIN) {
-                msgs = std::move(recv_messages(localfe));
+                recv_frames(localfe, msgs);
                 reroutable = 1;
             }
             else
@@ -340,20 +340,16 @@ int main (int argc, char *argv []) {
             if (reroutable && argc > 2 && rand(1, 4) == 1) {
                 //  Route to random broker peer
                 const int peer = rand(2, argc - 1); 
-                push_front(msgs,
-                           std::vector< char >(argv[peer], 
-                                               argv[peer] 
-                                               + strlen(argv[peer])));
-                send_messages(cloudbe, msgs);
+                push_front(msgs, Frame(argv[peer], strlen(argv[peer])));
+                send_frames(cloudbe, msgs);
             }
             else {
                 std::string worker = std::move(worker_queue.front());
                 worker_queue.pop_front();
-                push_front(msgs, std::vector< char >()); //SENDING TO REQ, 
-                                                   //wrap with empty data
-                push_front(msgs, std::vector< char >(worker.begin(), 
-                                                     worker.end()));
-                send_messages(localbe, msgs);
+                push_front(msgs, Frame()); //SENDING TO REQ, 
+                                           //wrap with empty data
+                push_front(msgs, Frame(worker.data(), worker.size()));
+                send_frames(localbe, msgs);
             }
         }
     }
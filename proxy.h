@@ -0,0 +1,346 @@
+#pragma once
+//Instrumented replacement for zmq_proxy
+//Author: Ugo Varetto
+//zmq_proxy gives no insight into the traffic it forwards; ProxyStats keeps,
+//for each direction (frontend to backend and backend to frontend):
+// - message, frame and byte counters
+// - number of poll wake-ups and of messages drained per wake-up: a growing
+//   number of messages per wake-up means that messages are queueing up in
+//   front of the proxy (the length of the ZeroMQ queues is not accessible)
+// - log-linear histograms (HDR style: 16 linear buckets per power of two,
+//   about 6% precision) of the forwarding latency, measured from the end of
+//   the receive to the end of the send, of the message size and of the
+//   number of messages drained per wake-up, so that the largest burst can
+//   be reported for each interval
+//Counters are updated with relaxed atomic operations in one of SLOTS
+//padded slots selected per thread, so that threads updating the
+//same ProxyStats do not share cache lines and readers never block writers;
+//a Snapshot sums all the slots.
+//PeerStats accounts messages and bytes by first frame, i.e. by sender
+//identity for ROUTER sockets and by topic for pub-sub; it is not thread
+//safe and is owned by the thread running the proxy loop.
+//The forwarding loop is left to the user (see multi-part/broker.cpp and
+//router-dealer/asyncsrv.cpp), which records each message and wake-up;
+//StatsPublisher, driven by the same loop, sends a text report on a stats
+//socket at a fixed interval covering the time elapsed since the previous
+//one.
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <string>
+#include <sstream>
+#include <ostream>
+#include <iomanip>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include <zmq.h>
+
+#include "multipart.h"
+
+//------------------------------------------------------------------------------
+class Histogram {
+public:
+    enum {SUB_BITS = 4, SUB = 1 << SUB_BITS, MAX_BITS = 40};
+    enum {BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB};
+    //copy of the counts, can be merged and queried
+    class Snapshot {
+    public:
+        Snapshot() : counts_(BUCKETS, 0) {}
+        Snapshot& operator+=(const Snapshot& s) {
+            for(size_t i = 0; i != counts_.size(); ++i)
+                counts_[i] += s.counts_[i];
+            return *this;
+        }
+        //values recorded after 's'
+        Snapshot operator-(const Snapshot& s) const {
+            Snapshot d;
+            for(size_t i = 0; i != counts_.size(); ++i)
+                d.counts_[i] = counts_[i] - s.counts_[i];
+            return d;
+        }
+        uint64_t Count() const {
+            uint64_t c = 0;
+            for(uint64_t n: counts_) c += n;
+            return c;
+        }
+        //upper bound of the bucket holding the value at quantile 'q'
+        uint64_t Quantile(double q) const {
+            const uint64_t total = Count();
+            if(!total) return 0;
+            const uint64_t rank =
+                std::max(uint64_t(1), uint64_t(q * double(total) + 0.5));
+            uint64_t c = 0;
+            for(size_t i = 0; i != counts_.size(); ++i) {
+                c += counts_[i];
+                if(c >= rank) return Upper(i);
+            }
+            return Upper(counts_.size() - 1);
+        }
+        uint64_t Max() const { return Quantile(1.0); }
+    private:
+        friend class Histogram;
+        std::vector< uint64_t > counts_;
+    };
+    Histogram() {
+        for(auto& c: counts_) c.store(0, std::memory_order_relaxed);
+    }
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+    void Record(uint64_t v) {
+        counts_[Index(v)].fetch_add(1, std::memory_order_relaxed);
+    }
+    void AddTo(Snapshot& s) const {
+        for(size_t i = 0; i != BUCKETS; ++i)
+            s.counts_[i] += counts_[i].load(std::memory_order_relaxed);
+    }
+    //values below SUB have their own bucket; above, the bucket is selected
+    //by the position of the highest bit and the SUB_BITS bits that follow
+    static size_t Index(uint64_t v) {
+        if(v < SUB) return size_t(v);
+        if(v >> MAX_BITS) return BUCKETS - 1;
+        const int e = 63 - __builtin_clzll(v);
+        return size_t(e - SUB_BITS + 1) * SUB
+               + size_t((v >> (e - SUB_BITS)) & (SUB - 1));
+    }
+    //largest value mapped to bucket 'i'
+    static uint64_t Upper(size_t i) {
+        if(i < SUB) return i;
+        const int e = int(i / SUB) + SUB_BITS - 1;
+        const uint64_t base = (uint64_t(1) << e)
+                              + (uint64_t(i % SUB) << (e - SUB_BITS));
+        return base + (uint64_t(1) << (e - SUB_BITS)) - 1;
+    }
+private:
+    std::atomic< uint64_t > counts_[BUCKETS];
+};
+
+//------------------------------------------------------------------------------
+class ProxyStats {
+public:
+    typedef std::chrono::steady_clock Clock;
+    enum Direction {FRONTEND_TO_BACKEND = 0, BACKEND_TO_FRONTEND = 1};
+    enum {DIRECTIONS = 2, SLOTS = 16};
+    struct DirectionSnapshot {
+        uint64_t messages = 0;
+        uint64_t frames = 0;
+        uint64_t bytes = 0;
+        uint64_t wakeups = 0;
+        uint64_t errors = 0;   //failed sends
+        Histogram::Snapshot latency; //ns
+        Histogram::Snapshot size;    //bytes
+        Histogram::Snapshot burst;   //messages per wake-up
+    };
+    struct Snapshot {
+        Clock::time_point time;
+        DirectionSnapshot directions[DIRECTIONS];
+    };
+    ProxyStats() : slots_(new Slot[SLOTS]) {}
+    ProxyStats(const ProxyStats&) = delete;
+    ProxyStats& operator=(const ProxyStats&) = delete;
+    //one forwarded message
+    void Record(Direction d, size_t frames, size_t bytes,
+                Clock::duration latency) {
+        Counters& c = Local().directions[d];
+        c.messages.fetch_add(1, std::memory_order_relaxed);
+        c.frames.fetch_add(frames, std::memory_order_relaxed);
+        c.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        c.latency.Record(uint64_t(std::chrono::duration_cast<
+            std::chrono::nanoseconds >(latency).count()));
+        c.size.Record(bytes);
+    }
+    //'messages' drained from the socket after a poll wake-up
+    void Wakeup(Direction d, size_t messages) {
+        Counters& c = Local().directions[d];
+        c.wakeups.fetch_add(1, std::memory_order_relaxed);
+        c.burst.Record(messages);
+    }
+    void Error(Direction d) {
+        Local().directions[d].errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    Snapshot Snap() const {
+        Snapshot s;
+        s.time = Clock::now();
+        for(size_t i = 0; i != SLOTS; ++i) {
+            for(int d = 0; d != DIRECTIONS; ++d) {
+                const Counters& c = slots_[i].directions[d];
+                DirectionSnapshot& o = s.directions[d];
+                o.messages += c.messages.load(std::memory_order_relaxed);
+                o.frames += c.frames.load(std::memory_order_relaxed);
+                o.bytes += c.bytes.load(std::memory_order_relaxed);
+                o.wakeups += c.wakeups.load(std::memory_order_relaxed);
+                o.errors += c.errors.load(std::memory_order_relaxed);
+                c.latency.AddTo(o.latency);
+                c.size.AddTo(o.size);
+                c.burst.AddTo(o.burst);
+            }
+        }
+        return s;
+    }
+    static const char* Name(int d) {
+        return d == FRONTEND_TO_BACKEND ? "frontend->backend"
+                                        : "backend->frontend";
+    }
+private:
+    enum {CACHE_LINE = 64};
+    struct Counters {
+        std::atomic< uint64_t > messages{0};
+        std::atomic< uint64_t > frames{0};
+        std::atomic< uint64_t > bytes{0};
+        std::atomic< uint64_t > wakeups{0};
+        std::atomic< uint64_t > errors{0};
+        Histogram latency;
+        Histogram size;
+        Histogram burst;
+    };
+    //padding keeps the counters of adjacent slots on separate cache lines
+    struct Slot {
+        Counters directions[DIRECTIONS];
+        char pad[CACHE_LINE];
+    };
+    //threads are assigned slots round-robin in order of first use
+    Slot& Local() {
+        static std::atomic< unsigned > next{0};
+        thread_local const unsigned index =
+            next.fetch_add(1, std::memory_order_relaxed);
+        return slots_[index % SLOTS];
+    }
+private:
+    std::unique_ptr< Slot[] > slots_;
+};
+
+//------------------------------------------------------------------------------
+class PeerStats {
+public:
+    enum {MAX_PEERS = 0x400, MAX_KEY = 32};
+    struct Counters {
+        uint64_t messages = 0;
+        uint64_t bytes = 0;
+    };
+    void Record(const Frames& msg, size_t bytes) {
+        if(msg.empty()) return;
+        const Frame& f = msg.front();
+        std::string key(f.begin(), f.begin() + std::min(f.size(),
+                                                        size_t(MAX_KEY)));
+        auto i = peers_.find(key);
+        if(i == peers_.end()) {
+            //beyond MAX_PEERS new peers are accounted together
+            if(peers_.size() >= MAX_PEERS) key = "<other>";
+            i = peers_.insert(std::make_pair(key, Counters())).first;
+        }
+        ++i->second.messages;
+        i->second.bytes += bytes;
+    }
+    //'n' peers with the highest byte count, in decreasing order
+    std::vector< std::pair< std::string, Counters > > Top(size_t n) const {
+        std::vector< std::pair< std::string, Counters > > v(peers_.begin(),
+                                                             peers_.end());
+        n = std::min(n, v.size());
+        std::partial_sort(v.begin(), v.begin() + n, v.end(),
+                          [](const std::pair< std::string, Counters >& a,
+                             const std::pair< std::string, Counters >& b) {
+                              return a.second.bytes > b.second.bytes;
+                          });
+        v.resize(n);
+        return v;
+    }
+    void Clear() { peers_.clear(); }
+    //printable key: non printable bytes are written in hex
+    static std::string Printable(const std::string& key) {
+        std::ostringstream os;
+        for(unsigned char c: key) {
+            if(c >= 0x20 && c < 0x7f) os << c;
+            else os << "\\x" << std::hex << std::setw(2) << std::setfill('0')
+                    << int(c) << std::dec;
+        }
+        return os.str();
+    }
+private:
+    std::unordered_map< std::string, Counters > peers_;
+};
+
+//------------------------------------------------------------------------------
+//report of the traffic between 'prev' and 'cur' and of the top peers
+inline std::string StatsReport(const ProxyStats::Snapshot& cur,
+                               const ProxyStats::Snapshot& prev,
+                               const PeerStats* peers = nullptr,
+                               size_t topPeers = 10) {
+    std::ostringstream os;
+    const double elapsed = std::max(1e-9, std::chrono::duration< double >(
+                                              cur.time - prev.time).count());
+    for(int d = 0; d != ProxyStats::DIRECTIONS; ++d) {
+        const ProxyStats::DirectionSnapshot& c = cur.directions[d];
+        const ProxyStats::DirectionSnapshot& p = prev.directions[d];
+        const uint64_t messages = c.messages - p.messages;
+        const uint64_t wakeups = c.wakeups - p.wakeups;
+        const Histogram::Snapshot latency = c.latency - p.latency;
+        const Histogram::Snapshot size = c.size - p.size;
+        const Histogram::Snapshot burst = c.burst - p.burst;
+        os << ProxyStats::Name(d)
+           << " msg/s: " << messages / elapsed
+           << " MB/s: " << (c.bytes - p.bytes) / elapsed / 0x100000
+           << " frames: " << c.frames - p.frames
+           << " msg/wake-up: "
+           << (wakeups ? double(messages) / wakeups : 0.0)
+           << " max burst: " << burst.Max()
+           << " errors: " << c.errors - p.errors
+           << " latency ns p50: " << latency.Quantile(0.5)
+           << " p99: " << latency.Quantile(0.99)
+           << " p99.9: " << latency.Quantile(0.999)
+           << " max: " << latency.Max()
+           << " size p50: " << size.Quantile(0.5)
+           << " p99: " << size.Quantile(0.99)
+           << " max: " << size.Max()
+           << " total msg: " << c.messages
+           << "\n";
+    }
+    if(peers) {
+        for(const auto& p: peers->Top(topPeers)) {
+            os << "peer " << PeerStats::Printable(p.first)
+               << " msg: " << p.second.messages
+               << " bytes: " << p.second.bytes << "\n";
+        }
+    }
+    return os.str();
+}
+
+//------------------------------------------------------------------------------
+//periodic reports: call Poll from the proxy loop, with the poll timeout
+//computed through Timeout
+class StatsPublisher {
+public:
+    typedef ProxyStats::Clock Clock;
+    StatsPublisher(void* socket, const ProxyStats& stats,
+                   PeerStats* peers = nullptr,
+                   std::chrono::milliseconds interval
+                       = std::chrono::milliseconds(1000))
+        : socket_(socket), stats_(stats), peers_(peers), interval_(interval),
+          prev_(stats.Snap()) {}
+    //send report if the interval elapsed; peer counters are reset after
+    //each report
+    void Poll(Clock::time_point now = Clock::now()) {
+        if(!socket_ || now < prev_.time + interval_) return;
+        const ProxyStats::Snapshot cur = stats_.Snap();
+        const std::string report = StatsReport(cur, prev_, peers_);
+        zmq_send(socket_, report.data(), report.size(), ZMQ_DONTWAIT);
+        if(peers_) peers_->Clear();
+        prev_ = cur;
+    }
+    //ms until next report, -1 if no stats socket
+    long Timeout(Clock::time_point now = Clock::now()) const {
+        if(!socket_) return -1;
+        const auto t = std::chrono::duration_cast< std::chrono::milliseconds >(
+            prev_.time + interval_ - now).count();
+        return std::max(0L, long(t) + 1);
+    }
+private:
+    void* socket_;
+    const ProxyStats& stats_;
+    PeerStats* peers_;
+    std::chrono::milliseconds interval_;
+    ProxyStats::Snapshot prev_;
+};
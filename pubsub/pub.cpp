@@ -2,6 +2,8 @@
 //the message content; remote clients subscribe to log output through a
 //broker
 //Author: Ugo Varetto
+//Records are published in bursts; with batching enabled the records are
+//packed into batches (see batch.h) which subscribers unpack transparently
 
 //Note: UNIX only; for windows use DWORD type instead of pid_t and
 //GetProcessId instead of getpid
@@ -11,6 +13,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <iostream>
+#include <cstdlib>
 //for framework builds on Mac OS:
 //#ifdef __APPLE__
 //#include <ZeroMQ/zmq.h>
@@ -18,6 +21,8 @@
 #include <zmq.h>
 //#endif
 
+#include "../batch.h"
+
 typedef pid_t PID;
 
 //------------------------------------------------------------------------------
@@ -30,9 +35,11 @@ int main(int argc, char** argv) {
     if(argc < 2) {
         std::cout << "usage: " 
                   << argv[0] 
-                  << " <URI>"
+                  << " <URI> [records per second, default 1]"
+                     " [batch size bytes, default 0: no batching]"
+                     " [max batch delay us, default 1000]"
                   << std::endl;
-        std::cout << "Example: pub \"tcp://*:5555\"\n";
+        std::cout << "Example: pub \"tcp://*:5555\" 100000 65536\n";
         return 0;          
     }
     void* ctx = zmq_ctx_new(); 
@@ -40,15 +47,24 @@ int main(int argc, char** argv) {
     const char* URI = argv[1];
     int rc = zmq_bind(pub, URI);
     assert(rc == 0);
-    unsigned char buffer[0x100];
-    size_t size = 0;
+    const int RECORDS = argc > 2 ? atoi(argv[2]) : 1;
+    const size_t BATCH_SIZE = argc > 3 ? strtoul(argv[3], nullptr, 10) : 0;
+    const std::chrono::microseconds MAX_DELAY(argc > 4 ? atoi(argv[4])
+                                                       : 1000);
     std::cout << "PID: " << get_proc_id() << std::endl;
-    int pid = int(get_proc_id());
+    const int pid = int(get_proc_id());
+    //messages: |pid|record| or |pid|batch|, the pid is the topic
+    Batcher batcher(pub, &pid, sizeof(pid), BATCH_SIZE, MAX_DELAY);
     while(1) {
-#if 0
-        zmq_send(pub, &pid, sizeof(pid), ZMQ_SNDMORE);
-#endif
-    	zmq_send(pub, "hello", strlen("hello"), 0);
+        for(int i = 0; i != RECORDS; ++i) {
+            if(BATCH_SIZE) batcher.Add("hello", strlen("hello"));
+            else {
+                zmq_send(pub, &pid, sizeof(pid), ZMQ_SNDMORE);
+                zmq_send(pub, "hello", strlen("hello"), 0);
+            }
+        }
+        //do not hold records while sleeping
+        batcher.Flush();
     	sleep(1);
     }
     rc = zmq_close(pub);
@@ -0,0 +1,323 @@
+//Pub/sub throughput and latency benchmark: replaces pub-benchmark and
+//sub-benchmark.
+//Author: Ugo Varetto
+//For each transport and message size a publisher and a subscriber thread
+//are started in the same process and two phases are run:
+// 1) throughput: the publisher sends messages back to back, the subscriber
+//    measures the time between the first send and the last receive
+// 2) latency: the subscriber sends the throughput it measured back to the
+//    publisher, which paces messages at half that rate (busy waiting, no
+//    sleeps), so that every message size is measured under the same
+//    relative load and not in a saturated queue; the subscriber computes
+//    the one-way latency from the send timestamp embedded in each message
+//Publisher and subscriber share the same steady clock so embedded
+//timestamps can be compared directly.
+//Results are printed on standard output and written in CSV format to the
+//output file.
+//usage: pubsub-benchmark <output csv file> [transports] [sizes] [messages]
+//e.g. pubsub-benchmark results.csv inproc,tcp 64,1024,0x100000 50000
+
+#include <cassert>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <future>
+
+#include <zmq.h>
+
+#include "../multipart.h"
+#include "../utility.h"
+
+using namespace std;
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+enum Kind : uint32_t {WARMUP = 1, DATA, END};
+
+//prepended to every message
+struct Header {
+    uint32_t kind;
+    uint32_t phase;
+    uint64_t seq;
+    int64_t timestamp; //ns, steady clock
+};
+
+enum {THROUGHPUT_PHASE = 0, LATENCY_PHASE = 1};
+
+const char* SYNC_URI_BASE = "inproc://pubsub-benchmark-sync-";
+const int ONE_MB = 0x100000;
+const int RECV_TIMEOUT = 5000; //ms, to avoid hanging if messages are lost
+const int LATENCY_MESSAGES = 10000;
+//latency phase rate as a fraction of the measured throughput
+const double LATENCY_LOAD = 0.5;
+//the latency phase is shortened for slow runs, to about this duration
+const double LATENCY_SECONDS = 2.0;
+const int MIN_LATENCY_MESSAGES = 100;
+//used when no throughput could be measured
+const double DEFAULT_LATENCY_RATE = 1000; //msg/s
+
+struct Result {
+    string transport;
+    size_t size = 0;
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    double seconds = 0;
+    double msgsPerSecond = 0;
+    double mbPerSecond = 0;
+    double latencyRate = 0; //msg/s sent in the latency phase
+    double p50 = 0; //one-way latency in microseconds
+    double p99 = 0;
+    double p999 = 0;
+    double max = 0;
+};
+
+//------------------------------------------------------------------------------
+int64_t Now() {
+    return chrono::duration_cast< chrono::nanoseconds >(
+               Clock::now().time_since_epoch()).count();
+}
+
+//------------------------------------------------------------------------------
+//each run uses its own endpoints: zmq_close is asynchronous and binding
+//the endpoint of the previous run right after closing it can fail
+string EndpointURI(const string& transport, int run) {
+    const string r = to_string(run);
+    if(transport == "inproc") return "inproc://pubsub-benchmark-" + r;
+    if(transport == "ipc") return "ipc:///tmp/pubsub-benchmark-" + r + ".ipc";
+    if(transport == "tcp") return "tcp://127.0.0.1:" + to_string(5599 + run);
+    throw invalid_argument("Unknown transport '" + transport + "'");
+}
+
+//------------------------------------------------------------------------------
+string SyncURI(int run) {
+    return string(SYNC_URI_BASE) + to_string(run);
+}
+
+//------------------------------------------------------------------------------
+vector< string > Split(const string& s) {
+    vector< string > tokens;
+    istringstream is(s);
+    string t;
+    while(getline(is, t, ',')) if(!t.empty()) tokens.push_back(t);
+    return tokens;
+}
+
+//------------------------------------------------------------------------------
+double Percentile(const vector< int64_t >& sorted, double p) {
+    if(sorted.empty()) return 0;
+    const size_t i = min(sorted.size() - 1, size_t(p * sorted.size()));
+    return sorted[i] / 1000.0;
+}
+
+//------------------------------------------------------------------------------
+struct PhaseStats {
+    uint64_t received = 0;
+    int64_t firstSend = 0;
+    int64_t lastRecv = 0;
+    vector< int64_t > latencies;
+};
+
+//receive messages until END for the current phase is received or receive
+//times out
+PhaseStats ReceivePhase(void* sub, uint32_t phase, size_t expected) {
+    PhaseStats ps;
+    if(phase == LATENCY_PHASE) ps.latencies.reserve(expected);
+    Frame frame;
+    while(frame.recv(sub) >= 0) {
+        const int64_t now = Now();
+        Header h;
+        assert(frame.size() >= sizeof(h));
+        memcpy(&h, frame.data(), sizeof(h));
+        if(h.kind == WARMUP || h.phase != phase) continue;
+        if(h.kind == END) break;
+        if(!ps.received) ps.firstSend = h.timestamp;
+        ps.lastRecv = now;
+        ++ps.received;
+        if(phase == LATENCY_PHASE) ps.latencies.push_back(now - h.timestamp);
+    }
+    return ps;
+}
+
+//------------------------------------------------------------------------------
+Result Subscriber(void* ctx, string uri, string syncURI, size_t size,
+                  uint64_t messages) {
+    void* sub = ZCheck(zmq_socket(ctx, ZMQ_SUB));
+    const int HWM = 0; //unlimited: PUB drops messages when HWM is reached
+    ZCheck(zmq_setsockopt(sub, ZMQ_RCVHWM, &HWM, sizeof(HWM)));
+    ZCheck(zmq_setsockopt(sub, ZMQ_RCVTIMEO, &RECV_TIMEOUT,
+                          sizeof(RECV_TIMEOUT)));
+    ZCheck(zmq_setsockopt(sub, ZMQ_SUBSCRIBE, "", 0));
+    ZCheck(zmq_connect(sub, uri.c_str()));
+    void* sync = ZCheck(zmq_socket(ctx, ZMQ_PAIR));
+    ZCheck(zmq_connect(sync, syncURI.c_str()));
+    //wait for the first warm-up message, which means the subscription
+    //reached the publisher, then notify the publisher
+    Header h;
+    do {
+        ZCheck(zmq_recv(sub, &h, sizeof(h), 0));
+    } while(h.kind != WARMUP);
+    ZCheck(zmq_send(sync, 0, 0, 0));
+
+    Result r;
+    r.size = size;
+    const PhaseStats tp = ReceivePhase(sub, THROUGHPUT_PHASE, messages);
+    r.received = tp.received;
+    r.seconds = (tp.lastRecv - tp.firstSend) / 1E9;
+    if(r.seconds > 0) {
+        r.msgsPerSecond = tp.received / r.seconds;
+        r.mbPerSecond = (double(tp.received) * size / ONE_MB) / r.seconds;
+    }
+    //the publisher waits for the throughput to pace the latency phase
+    ZCheck(zmq_send(sync, &r.msgsPerSecond, sizeof(r.msgsPerSecond), 0));
+    PhaseStats lat = ReceivePhase(sub, LATENCY_PHASE, LATENCY_MESSAGES);
+    sort(lat.latencies.begin(), lat.latencies.end());
+    r.p50 = Percentile(lat.latencies, 0.5);
+    r.p99 = Percentile(lat.latencies, 0.99);
+    r.p999 = Percentile(lat.latencies, 0.999);
+    r.max = lat.latencies.empty() ? 0 : lat.latencies.back() / 1000.0;
+    ZCheck(zmq_close(sync));
+    ZCheck(zmq_close(sub));
+    return r;
+}
+
+//------------------------------------------------------------------------------
+void Send(void* pub, vector< char >& buffer, const Header& h) {
+    memcpy(buffer.data(), &h, sizeof(h));
+    ZCheck(zmq_send(pub, buffer.data(), buffer.size(), 0));
+}
+
+//------------------------------------------------------------------------------
+Result Run(void* ctx, int run, const string& transport, size_t size,
+           uint64_t messages) {
+    const string uri = EndpointURI(transport, run);
+    const string syncURI = SyncURI(run);
+    size = max(size, sizeof(Header));
+    void* pub = ZCheck(zmq_socket(ctx, ZMQ_PUB));
+    const int HWM = 0;
+    ZCheck(zmq_setsockopt(pub, ZMQ_SNDHWM, &HWM, sizeof(HWM)));
+    ZCheck(zmq_bind(pub, uri.c_str()));
+    void* sync = ZCheck(zmq_socket(ctx, ZMQ_PAIR));
+    ZCheck(zmq_bind(sync, syncURI.c_str()));
+    future< Result > subscriber =
+        async(launch::async, Subscriber, ctx, uri, syncURI, size, messages);
+
+    vector< char > buffer(size);
+    //send warm-up messages until subscriber is connected
+    zmq_pollitem_t items[] = {{sync, 0, ZMQ_POLLIN, 0}};
+    while(true) {
+        Send(pub, buffer, {WARMUP, THROUGHPUT_PHASE, 0, Now()});
+        ZCheck(zmq_poll(items, 1, 1));
+        if(items[0].revents & ZMQ_POLLIN) break;
+    }
+    ZCheck(zmq_recv(sync, 0, 0, 0));
+    //throughput
+    for(uint64_t i = 0; i != messages; ++i) {
+        Send(pub, buffer, {DATA, THROUGHPUT_PHASE, i, Now()});
+    }
+    Send(pub, buffer, {END, THROUGHPUT_PHASE, messages, Now()});
+    //latency: paced at a fraction of the measured throughput, busy wait to
+    //avoid sleep granularity
+    double msgsPerSecond = 0;
+    ZCheck(zmq_recv(sync, &msgsPerSecond, sizeof(msgsPerSecond), 0));
+    const double rate = msgsPerSecond > 0 ? LATENCY_LOAD * msgsPerSecond
+                                          : DEFAULT_LATENCY_RATE;
+    const uint64_t latencyMessages = uint64_t(max(double(MIN_LATENCY_MESSAGES),
+        min(double(LATENCY_MESSAGES), rate * LATENCY_SECONDS)));
+    const auto interval = chrono::duration_cast< Clock::duration >(
+        chrono::duration< double >(1 / rate));
+    Clock::time_point next = Clock::now();
+    for(uint64_t i = 0; i != latencyMessages; ++i) {
+        while(Clock::now() < next);
+        Send(pub, buffer, {DATA, LATENCY_PHASE, i, Now()});
+        next += interval;
+    }
+    Send(pub, buffer, {END, LATENCY_PHASE, latencyMessages, Now()});
+
+    Result r = subscriber.get();
+    r.latencyRate = rate;
+    r.transport = transport;
+    r.sent = messages;
+    ZCheck(zmq_close(sync));
+    ZCheck(zmq_close(pub));
+    return r;
+}
+
+//------------------------------------------------------------------------------
+void Print(ostream& os, const Result& r) {
+    os << setw(8) << r.transport
+       << setw(10) << r.size
+       << setw(12) << r.received << '/' << left << setw(10) << r.sent << right
+       << setw(14) << fixed << setprecision(0) << r.msgsPerSecond
+       << setw(12) << setprecision(1) << r.mbPerSecond
+       << setw(10) << setprecision(1) << r.p50
+       << setw(10) << r.p99
+       << setw(10) << r.p999
+       << setw(10) << r.max
+       << endl;
+}
+
+//------------------------------------------------------------------------------
+void WriteCSV(ostream& os, const Result& r) {
+    os << r.transport << ',' << r.size << ',' << r.sent << ','
+       << r.received << ',' << r.seconds << ',' << r.msgsPerSecond << ','
+       << r.mbPerSecond << ',' << r.latencyRate << ',' << r.p50 << ','
+       << r.p99 << ',' << r.p999 << ',' << r.max << '\n';
+}
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        cout << "usage: " << argv[0]
+             << " <output csv file> [transports default=inproc,ipc,tcp]"
+                " [message sizes] [messages per size default=100000]"
+             << endl;
+        cout << "Example: " << argv[0]
+             << " results.csv inproc,tcp 64,1024,0x100000 50000" << endl;
+        return EXIT_SUCCESS;
+    }
+    const vector< string > transports =
+        Split(argc > 2 ? argv[2] : "inproc,ipc,tcp");
+    vector< size_t > sizes;
+    for(auto& s: Split(argc > 3 ? argv[3]
+                                : "64,256,1024,4096,16384,65536,0x100000")) {
+        sizes.push_back(stoul(s, 0, 0));
+    }
+    const uint64_t messages = argc > 4 ? stoull(argv[4]) : 100000;
+    ofstream csv(argv[1]);
+    if(!csv) {
+        cerr << "Cannot open file " << argv[1] << endl;
+        return EXIT_FAILURE;
+    }
+    csv << "transport,size,sent,received,seconds,msgs_per_s,MB_per_s,"
+           "latency_msgs_per_s,p50_us,p99_us,p999_us,max_us\n";
+    cout << setw(8) << "trans" << setw(10) << "size"
+         << setw(23) << "recv/sent" << setw(14) << "msg/s"
+         << setw(12) << "MB/s" << setw(10) << "p50 us" << setw(10) << "p99 us"
+         << setw(10) << "p99.9 us" << setw(10) << "max us" << endl;
+    void* ctx = ZCheck(zmq_ctx_new());
+    int run = 0;
+    for(auto& t: transports) {
+        for(auto s: sizes) {
+            //cap data volume per run at 1GB
+            const uint64_t n =
+                max(uint64_t(1000), min(messages, uint64_t(0x40000000) / s));
+            const Result r = Run(ctx, run++, t, s, n);
+            Print(cout, r);
+            WriteCSV(csv, r);
+        }
+    }
+    ZCheck(zmq_ctx_destroy(ctx));
+    return EXIT_SUCCESS;
+}
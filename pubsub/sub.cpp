@@ -1,6 +1,7 @@
 //Remote logger client: subscribe to specific process ids to receive
 //log messages.
 //Author: Ugo Varetto
+//Batches of records (see batch.h) are unpacked transparently
 
 //Note: UNIX only; for windows use DWORD type instead of pid_t
 
@@ -10,6 +11,7 @@
 #include <sys/types.h>
 #include <vector>
 #include <cstdlib>
+#include <string>
 //for framework builds on Mac OS:
 //#ifdef __APPLE__
 //#include <ZeroMQ/zmq.h>
@@ -17,6 +19,9 @@
 #include <zmq.h>
 //#endif
 
+#include "../multipart.h"
+#include "../batch.h"
+
 typedef int PID;
 
 //------------------------------------------------------------------------------
@@ -40,15 +45,18 @@ int main(int argc, char** argv) {
     rc = pid > 0 ? zmq_setsockopt(publisher, ZMQ_SUBSCRIBE, &pid, sizeof(pid))
                  : zmq_setsockopt(publisher, ZMQ_SUBSCRIBE, "", 0); 
     assert(rc == 0);
-    unsigned char buffer[0x100];
     int p = -1;
+    Frame payload; //batch size not known in advance: receive into zmq_msg_t
     while(1) {
         rc = zmq_recv(publisher, &p, sizeof(p), 0);
         assert(rc > 0);
         std::cout << p << std::endl;
-        rc = zmq_recv(publisher, &buffer[0], 0x100, 0);
-        buffer[rc] = '\0';
-        std::cout << buffer << std::endl;
+        rc = payload.recv(publisher);
+        assert(rc >= 0);
+        ForEachRecord(payload.data(), payload.size(),
+                      [](const char* r, size_t size) {
+            std::cout << std::string(r, r + size) << std::endl;
+        });
         //break;
     }
     rc = zmq_close(publisher);
@@ -0,0 +1,100 @@
+#pragma once
+//Single threaded event loop: zmq_poll on a set of sockets plus a timer wheel
+//Author: Ugo Varetto
+//Handlers are invoked when a socket is readable (or writable, if requested),
+//timers are fired by the same loop, with the poll timeout computed from the
+//next timer expiration: no busy waiting and no sleeps.
+//Handlers and timer callbacks can add and remove sockets, add and cancel
+//timers and stop the loop.
+//Sockets are not owned by the reactor.
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+
+#include <zmq.h>
+
+#include "timer-wheel.h"
+#include "utility.h"
+
+//------------------------------------------------------------------------------
+class Reactor {
+public:
+    typedef std::function< void (void* socket) > Handler;
+    typedef TimerWheel::TimerId TimerId;
+    typedef TimerWheel::Duration Duration;
+    Reactor() = default;
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+    void Add(void* socket, Handler h, short events = ZMQ_POLLIN) {
+        Remove(socket);
+        items_.push_back({socket, 0, events, 0});
+        handlers_.push_back(std::make_shared< Handler >(std::move(h)));
+    }
+    //safe to call from handlers
+    void Remove(void* socket) {
+        for(size_t i = 0; i != items_.size(); ++i) {
+            if(items_[i].socket != socket) continue;
+            items_.erase(items_.begin() + i);
+            handlers_.erase(handlers_.begin() + i);
+            return;
+        }
+    }
+    //one-shot timer
+    TimerId After(Duration delay, TimerWheel::Callback cb) {
+        return timers_.Add(delay, std::move(cb));
+    }
+    bool Cancel(TimerId id) { return timers_.Cancel(id); }
+    TimerWheel& Timers() { return timers_; }
+    void Stop() { stopped_ = true; }
+    //run until Stop() is called or there is nothing left to wait for;
+    //returns false if zmq_poll fails because the context was terminated
+    bool Run() {
+        stopped_ = false;
+        while(!stopped_ && (!items_.empty() || timers_.Size())) {
+            if(!Once()) return false;
+        }
+        return true;
+    }
+    //poll once, waiting at most until the next timer expiration, then
+    //dispatch socket events and expired timers
+    bool Once() {
+        timers_.Advance();
+        if(stopped_) return true;
+        const long timeout = timers_.NextTimeout();
+        const int rc = zmq_poll(items_.data(), int(items_.size()), timeout);
+        if(rc < 0) {
+            if(zmq_errno() == EINTR) return true;
+            if(zmq_errno() == ETERM) return false;
+            ZCheck(rc);
+        }
+        timers_.Advance();
+        if(rc <= 0) return true;
+        //handlers may add or remove sockets: take a snapshot of the ready
+        //sockets and re-check registration before each invocation
+        ready_.clear();
+        for(auto& i: items_) if(i.revents) ready_.push_back(i.socket);
+        for(void* s: ready_) {
+            if(stopped_) break;
+            auto i = std::find_if(items_.begin(), items_.end(),
+                                  [s](const zmq_pollitem_t& pi) {
+                                      return pi.socket == s;
+                                  });
+            if(i == items_.end()) continue;
+            //keep handler alive: it might remove itself
+            std::shared_ptr< Handler > h = handlers_[i - items_.begin()];
+            (*h)(s);
+        }
+        return true;
+    }
+private:
+    std::vector< zmq_pollitem_t > items_;
+    std::vector< std::shared_ptr< Handler > > handlers_;
+    std::vector< void* > ready_;
+    TimerWheel timers_;
+    bool stopped_ = false;
+};
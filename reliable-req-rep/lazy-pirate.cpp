@@ -5,6 +5,11 @@
 // - sending both a sequence number and a payload
 // - used clock guided simulation instead of simple counter
 // - probability distribution: 60% regular, 30% overload, 10% crash  
+// - pipelined DEALER client with a window of outstanding requests and
+//   per-request timeouts and retries
+// - requests carry a time to live option equal to the request timeout
+//   (see request-options.h): requests the client has given up on are
+//   dropped by brokers and servers instead of being serviced
 
 #include <iostream>
 #include <string>
@@ -14,6 +19,9 @@
 #include <cassert>
 #include <cstring>
 #include <thread>
+#include <functional>
+#include <unordered_map>
+#include <cstdlib>
 
 #ifdef __APPLE__
 #include <ZeroMQ/zmq.h>
@@ -21,6 +29,10 @@
 #include <zmq.h>
 #endif
 
+#include "../reactor.h"
+#include "../multipart.h"
+#include "../request-options.h"
+
 //------------------------------------------------------------------------------
 void sleep(int s) {
     std::this_thread::sleep_for(std::chrono::seconds(s));
@@ -37,8 +49,8 @@ void Server(const char* uri) {
     assert(zmq_setsockopt(socket, ZMQ_LINGER, &LINGER_PERIOD,
                           sizeof(LINGER_PERIOD)) == 0);
     assert(zmq_bind(socket, uri) == 0);
-    std::vector< char > buffer(0x100);
-    int sequence = -1;
+    const char EXPIRED[] = "EXPIRED";
+    Frames request;
     std::default_random_engine rng(std::random_device{}()); 
     std::uniform_int_distribution<int> dist(1, 100);
     const int NINETY_PERCENT = 90;
@@ -48,11 +60,18 @@ void Server(const char* uri) {
                                                     std::chrono::seconds(15);
     const auto start = std::chrono::steady_clock::now();                                                
     while(true) {
-        int rc = zmq_recv(socket, &sequence, sizeof(sequence), 0);
-        assert(rc > 0);
-        assert(sequence >= 0);
-        const int buffer_size = zmq_recv(socket, &buffer[0], buffer.size(), 0);
-        assert(buffer_size > 0 && buffer_size <= buffer.size());
+        //|sequence id|[options]|payload|
+        const bool ok = recv_frames(socket, request);
+        assert(ok && request.size() >= 2);
+        const auto deadline = Deadline(request, 1);
+        StripOptions(request, 1);
+        //REP must reply: the client discards the reply to a request
+        //it has already given up on
+        if(deadline <= std::chrono::steady_clock::now()) {
+            request.back() = Frame(EXPIRED, strlen(EXPIRED));
+            send_frames(socket, request);
+            continue;
+        }
         const auto elapsed_time = std::chrono::steady_clock::now() - start;
         //20% probability of crashing after guaranteed uptime
         if(elapsed_time > GUARANTEED_UP_TIME) {
@@ -66,76 +85,106 @@ void Server(const char* uri) {
                 sleep(3); 
             }
         }
-        rc = zmq_send(socket, &sequence, sizeof(sequence), ZMQ_SNDMORE);
-        assert(rc > 0);
-        rc = zmq_send(socket, &buffer[0], buffer_size, 0);
-        assert(rc > 0);
-        sequence = -1;
+        const bool sent = send_frames(socket, request);
+        assert(sent);
     }
     assert(zmq_close(socket) == 0);
     assert(zmq_ctx_destroy(ctx) == 0); 
 }
 
 //------------------------------------------------------------------------------
-void Client(const char* uri) {
+//Pipelined client: a DEALER socket keeps up to 'window' requests in flight;
+//replies are matched to requests through the sequence id and each request
+//has its own deadline in the reactor's timer wheel: on expiration only that
+//request is re-sent, the socket is never re-created since DEALER reconnects
+//automatically. Replies to requests already completed (i.e. the reply
+//to the original request arriving after the retry was sent) are discarded.
+//DEALER does not add the empty delimiter frame: it is sent explicitly to
+//keep the REQ/REP message format expected by REP and ROUTER endpoints
+void Client(const char* uri, int window, int total) {
     const int MAX_RETRIES = 5;
-    const int REQUEST_TIMEOUT = 2500; //ms
+    const Reactor::Duration REQUEST_TIMEOUT(2500);
     void* ctx = zmq_ctx_new();
     assert(ctx);
-    void* socket = zmq_socket(ctx, ZMQ_REQ);
+    void* socket = zmq_socket(ctx, ZMQ_DEALER);
     assert(socket);
     const int LINGER_PERIOD = 0; //discard all pending messages on close
     assert(zmq_setsockopt(socket, ZMQ_LINGER, &LINGER_PERIOD,
                           sizeof(LINGER_PERIOD)) == 0);
     assert(zmq_connect(socket, uri) == 0);
-    int sequence = 0;
-    int retries = MAX_RETRIES;
+    struct Request {
+        Reactor::TimerId timer;
+        int retries;
+    };
+    std::unordered_map< int, Request > outstanding;
+    int sequence = 0; //next sequence id
+    int completed = 0;
+    int duplicates = 0;
+    int busy = 0; //requests rejected by broker
+    Reactor reactor;
     std::vector< char > buffer(0x100);
-    while(retries > 0) {
-        int rc = zmq_send(socket, &sequence, sizeof(sequence), ZMQ_SNDMORE);
-        assert(rc >0);
+    std::function< void (int) > send = [&](int seq) {
+        int rc = zmq_send(socket, 0, 0, ZMQ_SNDMORE);
+        assert(rc == 0);
+        rc = zmq_send(socket, &seq, sizeof(seq), ZMQ_SNDMORE);
+        assert(rc > 0);
+        //|<empty>|sequence id|ttl|payload|: stale retries are dropped
+        //along the way
+        Frame ttl = TimeToLiveOption(REQUEST_TIMEOUT);
+        rc = ttl.send(socket, ZMQ_SNDMORE);
+        assert(rc > 0);
         rc = zmq_send(socket, "REQUEST", strlen("REQUEST"), 0);
         assert(rc > 0);
-        while(true) {
-            zmq_pollitem_t items[] = {{socket, 0, ZMQ_POLLIN, 0}};
-            int rc = zmq_poll(items, 1, REQUEST_TIMEOUT);
-            assert(rc >=0);
-            int recv_sequence = -1;
-            if(items[0].revents & ZMQ_POLLIN) {
-                rc = zmq_recv(socket, &recv_sequence, sizeof(recv_sequence), 0);
-                assert(rc > 0);
-                rc = zmq_recv(socket, &buffer[0], buffer.size(), 0);
-                assert(rc > 0);
-                if(recv_sequence == sequence)
-                    std::cout << ">REPLY RECEIVED" << std::endl;
-                else 
-                    std::cout << ">ERROR: MALFORMED REPLY RECEIVED"
-                              << std::endl;
-                ++sequence;
-                retries = MAX_RETRIES;
-                sleep(1);
-                break;              
-            } else {
-                if(--retries == 0) {
-                    std::cout << ">SERVER NOT RESPONDING" << std::endl;
-                    break;
-                } else {
-                    assert(zmq_close(socket) == 0);
-                    socket = zmq_socket(ctx, ZMQ_REQ);
-                    assert(socket);
-                    assert(zmq_setsockopt(socket, ZMQ_LINGER, &LINGER_PERIOD,
-                          sizeof(LINGER_PERIOD)) == 0);
-                    assert(zmq_connect(socket, uri) == 0);
-                    items[0].socket = socket;
-                    int rc = zmq_send(socket, &sequence, sizeof(sequence),
-                                      ZMQ_SNDMORE);
-                    assert(rc>0);
-                    rc = zmq_send(socket, "REQUEST", strlen("REQUEST"), 0);
-                    assert(rc > 0);
-                }
+        outstanding[seq].timer = reactor.After(REQUEST_TIMEOUT, [&, seq]() {
+            if(--outstanding[seq].retries == 0) {
+                std::cout << ">SERVER NOT RESPONDING" << std::endl;
+                reactor.Stop();
+                return;
             }
+            std::cout << ">RETRYING " << seq << std::endl;
+            send(seq);
+        });
+    };
+    //send new requests until window is full
+    auto fill = [&]() {
+        while(int(outstanding.size()) < window && sequence < total) {
+            outstanding[sequence] = {TimerWheel::INVALID_TIMER, MAX_RETRIES};
+            send(sequence++);
         }
-    }
+        if(outstanding.empty()) reactor.Stop();
+    };
+    reactor.Add(socket, [&](void* s) {
+        //|<empty>|sequence id|payload|
+        int rc = zmq_recv(s, 0, 0, 0);
+        assert(rc == 0);
+        int recv_sequence = -1;
+        rc = zmq_recv(s, &recv_sequence, sizeof(recv_sequence), 0);
+        assert(rc > 0);
+        rc = zmq_recv(s, &buffer[0], buffer.size(), 0);
+        assert(rc > 0);
+        auto i = outstanding.find(recv_sequence);
+        if(i == outstanding.end()) {
+            ++duplicates;
+            return;
+        }
+        reactor.Cancel(i->second.timer);
+        outstanding.erase(i);
+        //overloaded broker replies immediately with BUSY: do not retry
+        if(rc == int(strlen("BUSY")) && !strncmp(&buffer[0], "BUSY", rc))
+            ++busy;
+        else
+            ++completed;
+        fill();
+    });
+    const auto start = std::chrono::steady_clock::now();
+    fill();
+    reactor.Run();
+    const std::chrono::duration< double > elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << ">" << completed << " REPLIES RECEIVED, " << duplicates
+              << " DUPLICATES, " << busy << " BUSY, "
+              << completed / elapsed.count() << " req/s"
+              << std::endl;
     assert(zmq_close(socket) == 0);
     assert(zmq_ctx_destroy(ctx) == 0);
 }
@@ -143,10 +192,14 @@ void Client(const char* uri) {
 //------------------------------------------------------------------------------
 int main(int argc, char** argv) {
     if(argc < 3) {
-        std::cout << argv[0] << " <client|server> <address>" << std::endl;
+        std::cout << argv[0] << " <client|server> <address>"
+                     " [client window, default 16]"
+                     " [client requests, default 10000]" << std::endl;
         return 0;
     }
-    if(std::string(argv[1]) == "client") Client(argv[2]);
+    const int window = argc > 3 ? atoi(argv[3]) : 16;
+    const int requests = argc > 4 ? atoi(argv[4]) : 10000;
+    if(std::string(argv[1]) == "client") Client(argv[2], window, requests);
     else if(std::string(argv[1]) == "server") Server(argv[2]);
     else {
         std::cerr << "Unknown parameter '" << argv[1] << "'" << std::endl;
@@ -3,21 +3,29 @@
 //to avoid dealing with the message format detail.
 //Author: Ugo Varetto
 //use with *lazy* pirate client and *simple* pirate worker
+//Messages are forwarded as a whole, option frames (see request-options.h)
+//included; requests whose time to live expired in transit are dropped
+//instead of being dispatched and the time to live forwarded to workers is
+//updated with the time left; EXPIRED replies from workers are not
+//forwarded to clients
 
 #include <iostream>
 #include <vector>
 #include <algorithm>
-#include <set> //we have a timestamp in the record data' now
-               //data is automatically sorted by timestamp
-               //from highest to lowest
+#include <list>
+#include <unordered_map>
 #include <chrono>
 #include <cassert>
+#include <cstring>
 #ifdef __APPLE__
 #include <ZeroMQ/zmq.h>
 #else
 #include <zmq.h>
 #endif
 
+#include "../multipart.h"
+#include "../request-options.h"
+
 namespace {
 const int WORKER_READY = 123;
 const int HEARTBEAT = 111;
@@ -31,70 +39,70 @@ const duration EXPIRATION_INTERVAL =
 const duration HEARTBEAT_INTERVAL =
     std::chrono::duration_cast< duration >(
         std::chrono::milliseconds(1 * 1000));
-const int TIMEOUT = 1 * 1000;             
 }
 
 //------------------------------------------------------------------------------
 class worker_info {
 public:    
-    bool operator >(const worker_info& wi) const {
-        return timestamp_ > wi.timestamp_;
-    }
-    operator int() const { return id_; }
     worker_info(int id = -1) : 
         id_(id),
         timestamp_(std::chrono::steady_clock::now()) {}
     const timepoint& timestamp() const { return timestamp_; }
-    int id() const { return id_; }     
+    int id() const { return id_; }
+    void touch(const timepoint& t) { timestamp_ = t; }
 private:
     int id_;
     timepoint timestamp_;    
 };
 
-typedef std::set< worker_info > Workers;  
-
-//------------------------------------------------------------------------------
-//elements are ordered from highest to lowest
-//1) find the first element which has a time > expiration time
-//2) remove all elements from that element to last element is set
-void purge(Workers& workers, const duration& cutoff) {
-    typedef Workers::iterator WI;
-    WI start =  std::find_if(
-                    workers.begin(),
-                    workers.end(),
-                    [&cutoff](const worker_info& wi) { 
-                    return 
-                        std::chrono::duration_cast<std::chrono::milliseconds>(
-                            std::chrono::steady_clock::now()
-                            - wi.timestamp()
-                            ) > cutoff;
-                        });
-    if(start == workers.end()) return;
-    workers.erase(start, workers.end());
-               
-}
 //------------------------------------------------------------------------------
-//if worker already present remove it and re-insert it in the right
-//position
-void push(Workers& workers, int id) {
+//Available workers: list ordered by time of last message received, oldest
+//first, plus hash table mapping worker id to list element.
+//Since the expiration interval is the same for all the workers the list
+//order is also the expiration order, which makes all operations O(1):
+// - push: lookup by id, move to back with updated timestamp
+// - pop: take the least recently used worker from the front
+// - purge: remove expired workers from the front until the first
+//   non-expired one
+class Workers {
+public:
+    typedef std::list< worker_info > List;
+    typedef List::const_iterator const_iterator;
+    //if worker already present update timestamp and move to back
+    void push(int id) {
+        const timepoint now = std::chrono::steady_clock::now();
+        auto i = index_.find(id);
+        if(i != index_.end()) {
+            i->second->touch(now);
+            workers_.splice(workers_.end(), workers_, i->second);
+            return;
+        }
+        workers_.push_back(worker_info(id));
+        index_[id] = --workers_.end();
+    }
+    int pop() {
+        assert(workers_.size() > 0);
+        const int ret = workers_.front().id();
+        index_.erase(ret);
+        workers_.pop_front();
+        return ret;
+    }
+    //remove all workers that have not been active for a time > cutoff
+    void purge(const duration& cutoff) {
+        const timepoint expired = std::chrono::steady_clock::now() - cutoff;
+        while(!workers_.empty() && workers_.front().timestamp() < expired) {
+            index_.erase(workers_.front().id());
+            workers_.pop_front();
+        }
+    }
+    size_t size() const { return workers_.size(); }
+    const_iterator begin() const { return workers_.begin(); }
+    const_iterator end() const { return workers_.end(); }
+private:
+    List workers_;
+    std::unordered_map< int, List::iterator > index_;
+};
 
-    Workers::iterator it = std::find_if(workers.begin(),
-                               workers.end(),
-                               [id](const worker_info& wi){
-                                   return wi.id() == id;
-                               });
-    if(it != workers.end()) workers.erase(it);
-    
-    workers.insert(worker_info(id));
-}
-//------------------------------------------------------------------------------
-int pop(Workers& workers) { 
-    assert(workers.size() > 0);
-    std::set< worker_info >::iterator back = --workers.end();
-    const int ret = back->id();
-    workers.erase(back);
-    return ret;
-}
 //------------------------------------------------------------------------------
 int main(int argc, char** argv) {
     if(argc < 3) {
@@ -123,9 +131,14 @@ int main(int argc, char** argv) {
     int worker_id = -1;
     int client_id = -1;
     int rc = -1;
-    std::vector< char > request(0x100, 0);
-    std::vector< char > reply(0x100, 0);
+    const char EXPIRED[] = "EXPIRED";
+    Frames msg;
     int serviced_requests = 0;
+    int expired_requests = 0;
+    //heartbeats are sent to all available workers at fixed intervals,
+    //independent of how often the poll loop wakes up
+    timepoint next_heartbeat = std::chrono::steady_clock::now()
+                               + HEARTBEAT_INTERVAL;
     //loop until max requests servided
     while(serviced_requests < MAX_REQUESTS) {
         zmq_pollitem_t items[] = {
@@ -133,79 +146,76 @@ int main(int argc, char** argv) {
             {frontend, 0, ZMQ_POLLIN, 0}};
         //remove all workers that have not been active for a
         //time > expiration interval
-        //XXX TODO: TEST    
-        purge(workers, EXPIRATION_INTERVAL);        
-        //XXX    
+        workers.purge(EXPIRATION_INTERVAL);
         //poll for incoming requests: if no workers are available
         //only poll for workers(backend) since there is no point
         //in trying to service a client request without active
-        //workers
-        rc = zmq_poll(items, workers.size() > 0 ? 2 : 1,
-                      TIMEOUT);
+        //workers; wake up in time for the next heartbeat
+        const long timeout = std::max(0L, long(
+            std::chrono::duration_cast< std::chrono::milliseconds >(
+                next_heartbeat - std::chrono::steady_clock::now()).count()));
+        rc = zmq_poll(items, workers.size() > 0 ? 2 : 1, timeout);
         if(rc == -1) break;
         //data from workers
-        if(items[0].revents & ZMQ_POLLIN) {    
-            assert(zmq_recv(backend, &worker_id, sizeof(worker_id), 0) > 0);
-            assert(zmq_recv(backend, 0, 0, 0) == 0);       
-            assert(zmq_recv(backend, &client_id, sizeof(client_id), 0) > 0);
+        if(items[0].revents & ZMQ_POLLIN) {
+            //|worker id|<empty>|READY| or
+            //|worker id|<empty>|client id|<empty>|seq id|reply|
+            recv_frames(backend, msg);
+            assert(msg.size() >= 3);
+            memcpy(&worker_id, msg[0].data(), sizeof(worker_id));
+            memcpy(&client_id, msg[2].data(), sizeof(client_id));
             //add worker to list of available workers
-            push(workers, worker_id);
+            workers.push(worker_id);
             assert(workers.size() > 0);
             //of not a 'ready' message forward message to frontend
             //workers send 'ready' messages when either 
             if(client_id != WORKER_READY) {
-                int seq_id = -1;
-                assert(zmq_recv(backend, 0, 0, 0) == 0);
-                rc = zmq_recv(backend, &seq_id, sizeof(seq_id), 0);
-                assert(rc > 0);
-                rc = zmq_recv(backend, &reply[0], reply.size(), 0);
-                assert(rc > 0);
-                zmq_send(frontend, &client_id, sizeof(client_id), ZMQ_SNDMORE);
-                zmq_send(frontend, 0, 0, ZMQ_SNDMORE);
-                zmq_send(frontend, &seq_id, sizeof(seq_id), ZMQ_SNDMORE);
-                zmq_send(frontend, &reply[0], rc, 0);
-                ++serviced_requests;
+                assert(msg.size() >= 6);
+                if(msg.back().size() == strlen(EXPIRED)
+                   && msg.back().starts_with(EXPIRED, strlen(EXPIRED))) {
+                    ++expired_requests;
+                } else {
+                    pop_front(msg, 2);
+                    send_frames(frontend, msg);
+                    ++serviced_requests;
+                }
             } 
         } 
         //request from clients
         if(items[1].revents & ZMQ_POLLIN) { 
-            int seq_id = -1;
-            //receive request |client id|<null>|request id|data|
-            zmq_recv(frontend, &client_id, sizeof(client_id), 0);
-            zmq_recv(frontend, 0, 0, 0);
-            rc = zmq_recv(frontend, &seq_id, sizeof(seq_id), 0);
-            assert(rc > 0);
-            const int req_size = zmq_recv(frontend, &request[0],
-                                          request.size(), 0);
-            assert(req_size > 0);
-            //take worker from list and forward request to it
-            worker_id = pop(workers);
-            assert(worker_id > 0);
-            zmq_send(backend, &worker_id, sizeof(worker_id), ZMQ_SNDMORE);
-            zmq_send(backend, 0, 0, ZMQ_SNDMORE);
-            zmq_send(backend, &client_id, sizeof(client_id), ZMQ_SNDMORE);
-            zmq_send(backend, 0, 0, ZMQ_SNDMORE);
-            zmq_send(backend, &seq_id, sizeof(seq_id), ZMQ_SNDMORE);
-            zmq_send(backend, &request[0], req_size, 0);         
+            //receive request |client id|<null>|request id|[options]|data|
+            recv_frames(frontend, msg);
+            assert(msg.size() >= 4);
+            const timepoint now = std::chrono::steady_clock::now();
+            const timepoint deadline = Deadline(msg, 3, now);
+            if(deadline <= now) {
+                ++expired_requests;
+            } else {
+                UpdateTimeToLive(msg, 3, deadline, now);
+                //take worker from list and forward request to it
+                worker_id = workers.pop();
+                assert(worker_id > 0);
+                push_front(msg, Frame());
+                push_front(msg, Frame(&worker_id, sizeof(worker_id)));
+                send_frames(backend, msg);
+            }
         } 
-        const int hb = HEARTBEAT; //capturing HEARTBEAT directly generates
-                                  //a warning because the lambda function should
-                                  //not capture a variable with non-automatic
-                                  //storage
-        //send heartbeat request to all workers: workers reply to such request
-        //with a 'ready' message
-        std::for_each(workers.begin(),
-                      workers.end(),
-                      [backend, hb](const worker_info& wi) {
-                          const int id = wi.id();
-                          zmq_send(backend, &id,
-                                   sizeof(id), ZMQ_SNDMORE);
-                          zmq_send(backend, 0, 0, ZMQ_SNDMORE);
-                          zmq_send(backend, &hb, sizeof(hb), 0);            
-                      });
-        
-
+        //send heartbeat request to all workers when heartbeat interval
+        //elapsed
+        const timepoint now = std::chrono::steady_clock::now();
+        if(now < next_heartbeat) continue;
+        next_heartbeat += HEARTBEAT_INTERVAL;
+        //do not send bursts to catch up after a long stall
+        if(next_heartbeat < now) next_heartbeat = now + HEARTBEAT_INTERVAL;
+        for(const worker_info& wi: workers) {
+            const int id = wi.id();
+            zmq_send(backend, &id, sizeof(id), ZMQ_SNDMORE);
+            zmq_send(backend, 0, 0, ZMQ_SNDMORE);
+            zmq_send(backend, &HEARTBEAT, sizeof(HEARTBEAT), 0);
+        }
     }
+    std::cout << serviced_requests << " requests serviced, "
+              << expired_requests << " expired" << std::endl;
     zmq_close(frontend);
     zmq_close(backend);
     zmq_ctx_destroy(context);
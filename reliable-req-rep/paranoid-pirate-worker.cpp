@@ -5,6 +5,10 @@
 // - sending both a sequence number and a payload
 // - used clock guided simulation instead of simple counter
 // - probability distribution: 60% regular, 30% overload, 10% crash  
+// - event loop based on Reactor (reactor.h): heartbeats, liveness checks
+//   and reconnection with exponential backoff are timers, no sleeps
+// - requests whose time to live (see request-options.h) expired before the
+//   work starts are answered with EXPIRED without doing the work
 //The main change in the communication pattern is the additional parsing
 //of the |server id|<empty>| message headers handled automatically by the
 //REQ socket
@@ -26,6 +30,7 @@
 #include <future>
 #include <algorithm>
 #include <cerrno>
+#include <functional>
 
 #ifdef __APPLE__
 #include <ZeroMQ/zmq.h>
@@ -33,29 +38,23 @@
 #include <zmq.h>
 #endif
 
+#include "../reactor.h"
+#include "../multipart.h"
+#include "../request-options.h"
+
 namespace {
 const int WORKER_READY = 123;
 const int HEARTBEAT = 111;
 }
 
-typedef std::chrono::duration< long int > duration;
-
 //------------------------------------------------------------------------------
 void sleep(int s) {
     std::this_thread::sleep_for(std::chrono::seconds(s));
 }
 
 //------------------------------------------------------------------------------
-void Worker(const char* uri, int id) {
-    const duration POLL_INTERVAL =
-        std::chrono::duration_cast< duration >(
-            std::chrono::milliseconds(2500));
-    const int MAX_LIVENESS = 3;
-    const int MAX_RETRIES = 3;    
-    const int BROKER_ID = 1000;
-    assert(id != 0);
-    void* ctx = zmq_ctx_new();
-    assert(ctx);
+//create socket, connect and send ready message
+void* Connect(void* ctx, const char* uri, int id) {
     //changed to DEALER: need to deal with empty markers automatically
     //stripped away by REQ sockets 
     void* socket = zmq_socket(ctx, ZMQ_DEALER);
@@ -70,8 +69,31 @@ void Worker(const char* uri, int id) {
     //selected by run-time, different from ROUTER
     assert(zmq_send(socket, 0, 0, ZMQ_SNDMORE) == 0);
     assert(zmq_send(socket, &WORKER_READY, sizeof(WORKER_READY), 0) > 0);
-    std::vector< char > buffer(0x100);
-    int sequence = -1;
+    return socket;
+}
+
+//------------------------------------------------------------------------------
+//Event driven: socket events and timers are handled by a Reactor
+// - heartbeats are sent to the broker every HEARTBEAT_INTERVAL
+// - liveness is decremented at each heartbeat and reset by any message
+//   received from the broker; when it reaches zero the socket is closed
+//   and a new connection attempted after a reconnect interval which doubles
+//   at each attempt, up to MAX_RECONNECT_INTERVAL
+// - after MAX_RETRIES reconnection attempts without receiving any data the
+//   worker exits
+void Worker(const char* uri, int id) {
+    const Reactor::Duration HEARTBEAT_INTERVAL(1000);
+    const Reactor::Duration INITIAL_RECONNECT_INTERVAL(1000);
+    const Reactor::Duration MAX_RECONNECT_INTERVAL(32000);
+    const int MAX_LIVENESS = 3;
+    const int MAX_RETRIES = 3;    
+    assert(id != 0);
+    void* ctx = zmq_ctx_new();
+    assert(ctx);
+    Reactor reactor;
+    void* socket = Connect(ctx, uri, id);
+    const char EXPIRED[] = "EXPIRED";
+    Frames request;
     std::default_random_engine rng(std::random_device{}()); 
     std::uniform_int_distribution<int> dist(1, 100);
     const int NINETY_PERCENT = 90;
@@ -80,87 +102,87 @@ void Worker(const char* uri, int id) {
     const std::chrono::duration<long int> GUARANTEED_UP_TIME =
                                                     std::chrono::seconds(15);
     const auto start = std::chrono::steady_clock::now();
-    //receive: |server id|<empty>|client id|<empty>|sequence id| payload|                                                
+    //receive: |<empty>|client id|<empty>|sequence id|[options]|payload|
     int clientid = -1;
-    int serverid = -1;
     int retries = MAX_RETRIES;       //number of reconnection attempts:
-                                     //after MAX_LIVENESS poll intervals
+                                     //after MAX_LIVENESS heartbeat intervals
                                      //without incoming data have passed
 
-    int server_alive = MAX_LIVENESS; //number poll intervals without incoming
-                                     //data passed before trying to reconnect 
+    int server_alive = MAX_LIVENESS; //number of heartbeat intervals without
+                                     //incoming data passed before trying to
+                                     //reconnect 
+    Reactor::Duration reconnect_interval = INITIAL_RECONNECT_INTERVAL;
 
-    while(true) {
-        zmq_pollitem_t items[] = {{socket, 0, ZMQ_POLLIN, 0}};
-        int rc = zmq_poll(items, 1, POLL_INTERVAL.count());
-        if(rc == -1) break;
-        if(items[0].revents & ZMQ_POLLIN) {
-            server_alive = MAX_LIVENESS;
-            retries = MAX_RETRIES;
-            rc = zmq_recv(socket, 0, 0, 0);
-            assert(rc == 0);
-            rc = zmq_recv(socket, &clientid, sizeof(clientid), 0);
-            assert(rc > 0);
-            //got data from broker
-            if(clientid != HEARTBEAT) {
-                rc = zmq_recv(socket, 0, 0, 0);
-                assert(rc == 0);
-                rc = zmq_recv(socket, &sequence, sizeof(sequence), 0);
-                assert(rc > 0);
-                assert(sequence >= 0);
-                const int buffer_size = zmq_recv(socket, &buffer[0],
-                                                 buffer.size(), 0);
-                assert(buffer_size > 0 && buffer_size <= buffer.size());
-                const auto elapsed_time = std::chrono::steady_clock::now()
-                                          - start;
+    Reactor::Handler on_message = [&](void* s) {
+        server_alive = MAX_LIVENESS;
+        retries = MAX_RETRIES;
+        reconnect_interval = INITIAL_RECONNECT_INTERVAL;
+        const bool ok = recv_frames(s, request);
+        assert(ok && request.size() >= 2);
+        memcpy(&clientid, request[1].data(), sizeof(clientid));
+        //heartbeat from broker: nothing else to do
+        if(clientid == HEARTBEAT) return;
+        //got data from broker
+        assert(request.size() >= 5);
+        const auto deadline = Deadline(request, 4);
+        StripOptions(request, 4);
+        if(deadline <= std::chrono::steady_clock::now()) {
+            request.back() = Frame(EXPIRED, strlen(EXPIRED));
+            send_frames(s, request);
+            return;
+        }
+        const auto elapsed_time = std::chrono::steady_clock::now() - start;
 #ifdef SIMULATION                
-                if(elapsed_time > GUARANTEED_UP_TIME) {
-                    //10% probability of crashing
-                    if(dist(rng) > NINETY_PERCENT) {
-                        std::cout << id << ">CRASHING" << std::endl;
-                        break;
-                    //30% probabilty of server overload    
-                    } else if(dist(rng) <= THIRTY_PERCENT) {
-                        std::cout << id << ">OVERLOAD" << std::endl;
-                        sleep(3); 
-                    }
-                }
+        if(elapsed_time > GUARANTEED_UP_TIME) {
+            //10% probability of crashing
+            if(dist(rng) > NINETY_PERCENT) {
+                std::cout << id << ">CRASHING" << std::endl;
+                reactor.Stop();
+                return;
+            //30% probabilty of server overload    
+            } else if(dist(rng) <= THIRTY_PERCENT) {
+                std::cout << id << ">OVERLOAD" << std::endl;
+                sleep(3); 
+            }
+        }
 #endif                                          
-                //send empty marker (not needed for REQ sockets)
-                rc = zmq_send(socket, 0, 0, ZMQ_SNDMORE);
-                assert(rc == 0);
-                rc = zmq_send(socket, &clientid, sizeof(clientid), ZMQ_SNDMORE);
-                assert(rc > 0);
-                rc = zmq_send(socket, 0, 0, ZMQ_SNDMORE);
-                assert(rc == 0);
-                rc = zmq_send(socket, &sequence, sizeof(sequence), ZMQ_SNDMORE);
-                assert(rc > 0);
-                rc = zmq_send(socket, &buffer[0], buffer_size, 0);
-                assert(rc > 0);
-                sequence = -1;
+        //echo, empty marker included (not needed for REQ sockets)
+        const bool sent = send_frames(s, request);
+        assert(sent);
+    };
+
+    std::function< void () > heartbeat = [&]() {
+        //decrement alive counter; if 0 close socket and reconnect after
+        //reconnect interval
+        if(--server_alive == 0) {
+            if(--retries == 0) {
+                reactor.Stop();
+                return;
             }
-        } else { //no data received after timeout
-            //decreament alive counter; if 0 
-            if(--server_alive == 0 ) {
-                if(--retries == 0) break;
-                sleep(2 * POLL_INTERVAL.count());
-                assert(zmq_close(socket) == 0);
-                socket = zmq_socket(ctx, ZMQ_DEALER);
-                assert(socket);
-                assert(zmq_setsockopt(socket, ZMQ_IDENTITY,
-                       &id, sizeof(int)) == 0);
-                assert(zmq_setsockopt(socket, ZMQ_LINGER,
-                          &LINGER_TIME, sizeof(LINGER_TIME)) == 0);
-                assert(zmq_connect(socket, uri) == 0);
+            reactor.Remove(socket);
+            assert(zmq_close(socket) == 0);
+            socket = nullptr;
+            reactor.After(reconnect_interval, [&]() {
+                socket = Connect(ctx, uri, id);
+                reactor.Add(socket, on_message);
                 server_alive = MAX_LIVENESS;
-            }
-            //send heartbeat as WORKER_READY
-            rc = zmq_send(socket, 0, 0, ZMQ_SNDMORE);
-            assert(rc == 0);
-            zmq_send(socket, &WORKER_READY, sizeof(WORKER_READY), 0);
+                reactor.After(HEARTBEAT_INTERVAL, heartbeat);
+            });
+            reconnect_interval = std::min(2 * reconnect_interval,
+                                          MAX_RECONNECT_INTERVAL);
+            return;
         }
-    }
-    assert(zmq_close(socket) == 0);
+        //send heartbeat as WORKER_READY
+        int rc = zmq_send(socket, 0, 0, ZMQ_SNDMORE);
+        assert(rc == 0);
+        zmq_send(socket, &WORKER_READY, sizeof(WORKER_READY), 0);
+        reactor.After(HEARTBEAT_INTERVAL, heartbeat);
+    };
+
+    reactor.Add(socket, on_message);
+    reactor.After(HEARTBEAT_INTERVAL, heartbeat);
+    reactor.Run();
+    if(socket) assert(zmq_close(socket) == 0);
     assert(zmq_ctx_destroy(ctx) == 0); 
 }
 
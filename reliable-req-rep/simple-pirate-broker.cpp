@@ -3,10 +3,30 @@
 //to avoid dealing with the message format detail.
 //Author: Ugo Varetto
 //use with *lazy* pirate client and *simple* pirate worker
+//Workers advertise their capacity in the READY message: |READY|capacity|
+//and receive up to 'capacity' requests in parallel; the worker receiving
+//each request is selected according to the dispatch policy passed on the
+//command line (see dispatch.h)
+//Requests are always received and stored in a bounded priority queue
+//(see requestqueue.h): requests which cannot be queued or would wait
+//longer than the maximum queueing time are rejected right away with a
+//|seq id|BUSY| reply; the priority is read from the optional 'P' frame
+//(see request-options.h). Queue metrics are printed periodically.
+//Requests carrying a time to live 'D' frame are discarded without reply
+//when the time to live expires while queued; the time left is forwarded
+//to the worker, which replies |seq id|EXPIRED| instead of doing the work
+//if the request expired in transit: such replies are not forwarded to the
+//client, which has already given up on the request.
+//Event loop based on Reactor (reactor.h): metrics are printed by a timer,
+//no poll timeouts.
 
 #include <iostream>
 #include <vector>
-#include <deque>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <cstdlib>
+#include <cstring>
 #include <cassert>
 #ifdef __APPLE__
 #include <ZeroMQ/zmq.h>
@@ -14,6 +34,11 @@
 #include <zmq.h>
 #endif
 
+#include "../reactor.h"
+#include "../dispatch.h"
+#include "../requestqueue.h"
+#include "../request-options.h"
+
 static const int WORKER_READY = 123;
 
 //------------------------------------------------------------------------------
@@ -21,6 +46,9 @@ int main(int argc, char** argv) {
     if(argc < 3) {
         std::cout << "usage: "
                   << argv[0] << " <frontend address> <backend address>"
+                     " [dispatch policy: lru(default) | least | ewma]"
+                     " [queue capacity, default 1000]"
+                     " [max queueing time ms, default 1000]"
                   << std::endl;
         return 0;
     }
@@ -48,57 +76,102 @@ int main(int argc, char** argv) {
     assert(zmq_bind(frontend, FRONTEND_URI) == 0);
     assert(zmq_bind(backend, BACKEND_URI) == 0);
 
-    std::deque< int > worker_queue;
+    Dispatcher dispatcher(
+        Dispatcher::ParsePolicy(argc > 3 ? argv[3] : "lru"));
+    const int PRIORITIES = 3;
+    const int DEFAULT_PRIORITY = 1;
+    const char BUSY[] = "BUSY";
+    const char EXPIRED[] = "EXPIRED";
+    const Reactor::Duration METRICS_INTERVAL(5000);
+    RequestQueue< Frames > queue(
+        argc > 4 ? strtoul(argv[4], nullptr, 10) : 1000,
+        PRIORITIES,
+        std::chrono::milliseconds(argc > 5 ? atoi(argv[5]) : 1000));
     
     int worker_id = -1;
-    int client_id = -1;
-    int rc = -1;
-    std::vector< char > request(0x100, 0);
-    std::vector< char > reply(0x100, 0);
+    Frames msg;
+    Frames request;
+    std::chrono::steady_clock::time_point deadline;
     int serviced_requests = 0;
-    while(serviced_requests < MAX_REQUESTS) {
-        zmq_pollitem_t items[] = {
-            {backend, 0, ZMQ_POLLIN, 0},
-            {frontend, 0, ZMQ_POLLIN, 0}};    
-        rc = zmq_poll(items, worker_queue.size() > 0 ? 2 : 1, -1);
-        if(rc == -1) break;
-        if(items[0].revents & ZMQ_POLLIN) {
-            zmq_recv(backend, &worker_id, sizeof(worker_id), 0);
-            worker_queue.push_back(worker_id);
-            zmq_recv(backend, 0, 0, 0);
-            zmq_recv(backend, &client_id, sizeof(client_id), 0);
-            if(client_id != WORKER_READY) {
-                int seq_id = -1;
-                zmq_recv(backend, 0, 0, 0);
-                rc = zmq_recv(backend, &seq_id, sizeof(seq_id), 0);
-                assert(rc > 0);
-                rc = zmq_recv(backend, &reply[0], reply.size(), 0);
-                assert(rc > 0);
-                zmq_send(frontend, &client_id, sizeof(client_id), ZMQ_SNDMORE);
-                zmq_send(frontend, 0, 0, ZMQ_SNDMORE);
-                zmq_send(frontend, &seq_id, sizeof(seq_id), ZMQ_SNDMORE);
-                zmq_send(frontend, &reply[0], rc, 0);
-                ++serviced_requests;
-            } 
+    int expired_requests = 0; //expired at worker
+    Reactor reactor;
+    //dispatch queued requests to available workers
+    auto dispatch = [&]() {
+        while(dispatcher.Available()
+              && queue.Pop(request, std::chrono::steady_clock::now(),
+                           &deadline)) {
+            worker_id = dispatcher.Select();
+            //|worker id|<empty>|client id|<empty>|seq id|[ttl]|payload|
+            StripOptions(request, 3);
+            if(deadline != std::chrono::steady_clock::time_point::max()) {
+                const auto ttl =
+                    std::chrono::duration_cast< std::chrono::milliseconds >(
+                        deadline - std::chrono::steady_clock::now());
+                request.insert(request.end() - 1, TimeToLiveOption(ttl));
+            }
+            push_front(request, Frame());
+            push_front(request, Frame(&worker_id, sizeof(worker_id)));
+            send_frames(backend, request);
         }
-        if(items[1].revents & ZMQ_POLLIN) {      
-            int seq_id = -1;
-            zmq_recv(frontend, &client_id, sizeof(client_id), 0);
-            zmq_recv(frontend, 0, 0, 0);
-            rc = zmq_recv(frontend, &seq_id, sizeof(seq_id), 0);
-            assert(rc > 0);
-            rc = zmq_recv(frontend, &request[0], request.size(), 0);
-            assert(rc > 0);
-            worker_id = worker_queue.front();
-            zmq_send(backend, &worker_id, sizeof(worker_id), ZMQ_SNDMORE);
-            zmq_send(backend, 0, 0, ZMQ_SNDMORE);
-            zmq_send(backend, &client_id, sizeof(client_id), ZMQ_SNDMORE);
-            zmq_send(backend, 0, 0, ZMQ_SNDMORE);
-            zmq_send(backend, &seq_id, sizeof(seq_id), ZMQ_SNDMORE);
-            zmq_send(backend, &request[0], rc, 0);
-            worker_queue.pop_front();
-        }     
-    }
+    };
+    reactor.Add(backend, [&](void*) {
+        //|worker id|<empty>|READY|[capacity]| or
+        //|worker id|<empty>|client id|<empty>|seq id|reply|
+        recv_frames(backend, msg);
+        assert(msg.size() >= 3 && msg[0].size() == sizeof(worker_id));
+        memcpy(&worker_id, msg[0].data(), sizeof(worker_id));
+        if(msg.size() <= 4 && msg[2].size() == sizeof(WORKER_READY)
+           && !memcmp(msg[2].data(), &WORKER_READY,
+                      sizeof(WORKER_READY))) {
+            int capacity = 1;
+            if(msg.size() == 4 && msg[3].size() == sizeof(capacity))
+                memcpy(&capacity, msg[3].data(), sizeof(capacity));
+            dispatcher.Ready(worker_id, capacity);
+        } else {
+            dispatcher.Completed(worker_id);
+            assert(msg.size() == 6);
+            //forward client envelope unchanged:
+            //|client id|<empty>|seq id|reply|
+            pop_front(msg, 2);
+            if(msg.back().size() == strlen(EXPIRED)
+               && msg.back().starts_with(EXPIRED, strlen(EXPIRED))) {
+                ++expired_requests;
+            } else {
+                send_frames(frontend, msg);
+                if(++serviced_requests == MAX_REQUESTS) {
+                    reactor.Stop();
+                    return;
+                }
+            }
+        }
+        dispatch();
+    });
+    //request from clients: queue or reject
+    reactor.Add(frontend, [&](void*) {
+        //|client id|<empty>|seq id|[options]|payload|
+        recv_frames(frontend, request);
+        assert(request.size() >= 4);
+        const int priority = Priority(request, 3, DEFAULT_PRIORITY);
+        //time to live converted to local deadline on receipt
+        deadline = Deadline(request, 3);
+        if(queue.Push(std::move(request), priority, deadline)
+           != RequestQueue< Frames >::ACCEPTED) {
+            //|client id|<empty>|seq id|BUSY|
+            request.erase(request.begin() + 3, request.end());
+            request.push_back(Frame(BUSY, strlen(BUSY)));
+            send_frames(frontend, request);
+        }
+        dispatch();
+    });
+    std::function< void () > metrics = [&]() {
+        std::cout << queue << " expired at worker: "
+                  << expired_requests << std::endl;
+        reactor.After(METRICS_INTERVAL, metrics);
+    };
+    reactor.After(METRICS_INTERVAL, metrics);
+    reactor.Run();
+    std::cout << queue << " expired at worker: "
+              << expired_requests << std::endl;
     zmq_close(frontend);
     zmq_close(backend);
     zmq_ctx_destroy(context);
@@ -5,6 +5,16 @@
 // - sending both a sequence number and a payload
 // - used clock guided simulation instead of simple counter
 // - probability distribution: 60% regular, 30% overload, 10% crash  
+// - DEALER socket: the worker advertises its capacity in the READY message
+//   and the broker sends up to 'capacity' requests without waiting for
+//   replies; the requests are served concurrently by 'capacity' handler
+//   threads, each worker simulating one multi-threaded process
+// - event loop based on Reactor (reactor.h): the broker socket is
+//   registered only while a handler is idle, no poll timeouts; the
+//   handler threads block only while doing the (simulated) work
+// - requests carrying a time to live option (see request-options.h) which
+//   expired before the work starts are answered with EXPIRED without
+//   doing the work
 
 #include <iostream>
 #include <string>
@@ -16,6 +26,7 @@
 #include <thread>
 #include <future>
 #include <algorithm>
+#include <deque>
 #include <cerrno>
 
 #ifdef __APPLE__
@@ -24,82 +35,148 @@
 #include <zmq.h>
 #endif
 
+#include "../reactor.h"
+#include "../multipart.h"
+#include "../request-options.h"
+
 static const int WORKER_READY = 123;
 
 //------------------------------------------------------------------------------
-void sleep(int s) {
-    std::this_thread::sleep_for(std::chrono::seconds(s));
+//handler thread: receives requests from the worker through a DEALER socket
+//connected to the worker ROUTER socket at 'uri' and sends back the reply
+//|<empty>|client id|<empty>|sequence id|payload|; an empty message is sent
+//first to signal that the handler is ready; returns when the context is
+//terminated
+void Handler(void* ctx, std::string uri, int id) {
+    void* socket = zmq_socket(ctx, ZMQ_DEALER);
+    assert(socket);
+    int rc = zmq_connect(socket, uri.c_str());
+    assert(rc == 0);
+    rc = zmq_send(socket, 0, 0, 0);
+    assert(rc == 0);
+    const char EXPIRED[] = "EXPIRED";
+    Frames request;
+    std::default_random_engine rng(std::random_device{}());
+    std::uniform_int_distribution<int> dist(1, 100);
+    const int THIRTY_PERCENT = 30;
+    const std::chrono::seconds OVERLOAD_WORK_TIME(3);
+    const std::chrono::seconds GUARANTEED_UP_TIME(15);
+    const auto start = std::chrono::steady_clock::now();
+    //receive: |<empty>|client id|<empty>|sequence id|[options]|payload|
+    while(recv_frames(socket, request)) {
+        assert(request.size() >= 5);
+        const auto deadline = Deadline(request, 4);
+        StripOptions(request, 4);
+        //expired in transit or while waiting for a handler: the client has
+        //already given up
+        if(deadline <= std::chrono::steady_clock::now()) {
+            request.back() = Frame(EXPIRED, strlen(EXPIRED));
+        } else if(std::chrono::steady_clock::now() - start
+                      > GUARANTEED_UP_TIME
+                  && dist(rng) <= THIRTY_PERCENT) {
+            //30% probabilty of server overload
+            std::cout << id << ">OVERLOAD" << std::endl;
+            std::this_thread::sleep_for(OVERLOAD_WORK_TIME);
+        }
+        if(!send_frames(socket, request)) break;
+    }
+    rc = zmq_close(socket);
+    assert(rc == 0);
 }
 
 //------------------------------------------------------------------------------
-void Worker(const char* uri, int id) {
+//worker: advertises 'capacity' to the broker and runs 'capacity' handler
+//threads; each request received from the broker is passed to an idle
+//handler through an inproc ROUTER socket and the reply forwarded back, so
+//that up to 'capacity' requests are served concurrently; the broker never
+//sends more than 'capacity' requests, the worker receives from the broker
+//only when a handler is idle anyway
+void Worker(const char* uri, int id, int capacity) {
     assert(id != 0);
     void* ctx = zmq_ctx_new();
     assert(ctx);
-    void* socket = zmq_socket(ctx, ZMQ_REQ);
+    void* socket = zmq_socket(ctx, ZMQ_DEALER);
     assert(socket);
     assert(zmq_setsockopt(socket, ZMQ_IDENTITY, &id, sizeof(int)) == 0);
     assert(zmq_connect(socket, uri) == 0);
-    assert(zmq_send(socket, &WORKER_READY, sizeof(WORKER_READY), 0) > 0);
-    std::vector< char > buffer(0x100);
-    int sequence = -1;
+    void* handlers = zmq_socket(ctx, ZMQ_ROUTER);
+    assert(handlers);
+    const std::string HANDLERS_URI = "inproc://worker-" + std::to_string(id);
+    int rc = zmq_bind(handlers, HANDLERS_URI.c_str());
+    assert(rc == 0);
+    std::vector< std::thread > threads;
+    for(int i = 0; i != capacity; ++i)
+        threads.push_back(std::thread(Handler, ctx, HANDLERS_URI, id));
+    //DEALER: send empty delimiter added by REQ sockets
+    //|<empty>|READY|capacity|
+    assert(zmq_send(socket, 0, 0, ZMQ_SNDMORE) == 0);
+    assert(zmq_send(socket, &WORKER_READY, sizeof(WORKER_READY),
+                    ZMQ_SNDMORE) > 0);
+    assert(zmq_send(socket, &capacity, sizeof(capacity), 0) > 0);
+    Frames msg;
+    std::deque< Frame > idle; //handler ids
     std::default_random_engine rng(std::random_device{}()); 
     std::uniform_int_distribution<int> dist(1, 100);
     const int NINETY_PERCENT = 90;
-    const int THIRTY_PERCENT = 30;
-    assert(sizeof(long int) >= 8);
-    const std::chrono::duration<long int> GUARANTEED_UP_TIME =
-                                                    std::chrono::seconds(15);
+    const std::chrono::seconds GUARANTEED_UP_TIME(15);
     const auto start = std::chrono::steady_clock::now();
-    //receive: |client id|<empty>|sequence id| payload|                                                
-    int clientid = -1;
-    while(true) {
-        int rc = zmq_recv(socket, &clientid, sizeof(clientid), 0);
-        assert(rc > 0);
-        rc = zmq_recv(socket, 0, 0, 0);
-        assert(rc == 0);
-        rc = zmq_recv(socket, &sequence, sizeof(sequence), 0);
-        assert(rc > 0);
-        assert(sequence >= 0);
-        const int buffer_size = zmq_recv(socket, &buffer[0], buffer.size(), 0);
-        assert(buffer_size > 0 && buffer_size <= buffer.size());
-        const auto elapsed_time = std::chrono::steady_clock::now() - start;
-        //20% probability of crashing after guaranteed uptime
-        if(elapsed_time > GUARANTEED_UP_TIME) {
-            //10% probability of crashing
-            if(dist(rng) > NINETY_PERCENT) {
-                std::cout << id << ">CRASHING" << std::endl;
-                break;
-            //30% probabilty of server overload    
-            } else if(dist(rng) <= THIRTY_PERCENT) {
-                std::cout << id << ">OVERLOAD" << std::endl;
-                sleep(3); 
-            }
+    Reactor reactor;
+    //|<empty>|client id|<empty>|sequence id|[options]|payload|
+    Reactor::Handler on_request = [&](void* s) {
+        const bool ok = recv_frames(s, msg);
+        assert(ok && msg.size() >= 5);
+        //10% probability of crashing after guaranteed uptime
+        if(std::chrono::steady_clock::now() - start > GUARANTEED_UP_TIME
+           && dist(rng) > NINETY_PERCENT) {
+            std::cout << id << ">CRASHING" << std::endl;
+            reactor.Stop();
+            return;
         }
-        rc = zmq_send(socket, &clientid, sizeof(clientid), ZMQ_SNDMORE);
-        assert(rc > 0);
-        rc = zmq_send(socket, 0, 0, ZMQ_SNDMORE);
-        assert(rc == 0);
-        rc = zmq_send(socket, &sequence, sizeof(sequence), ZMQ_SNDMORE);
-        assert(rc > 0);
-        rc = zmq_send(socket, &buffer[0], buffer_size, 0);
-        assert(rc > 0);
-        sequence = -1;
-    }
-    assert(zmq_close(socket) == 0);
-    assert(zmq_ctx_destroy(ctx) == 0); 
+        push_front(msg, std::move(idle.front()));
+        idle.pop_front();
+        const bool sent = send_frames(handlers, msg);
+        assert(sent);
+        if(idle.empty()) reactor.Remove(s);
+    };
+    //|handler id|<empty>| (ready) or
+    //|handler id|<empty>|client id|<empty>|sequence id|payload|
+    reactor.Add(handlers, [&](void* s) {
+        const bool ok = recv_frames(s, msg);
+        assert(ok && (msg.size() == 2 || msg.size() >= 6));
+        idle.push_back(std::move(msg.front()));
+        pop_front(msg);
+        if(msg.size() > 1) {
+            const bool sent = send_frames(socket, msg);
+            assert(sent);
+        }
+        if(idle.size() == 1) reactor.Add(socket, on_request);
+    });
+    reactor.Run();
+    //handlers return when the context is terminated
+    const int LINGER_TIME = 0;
+    zmq_setsockopt(socket, ZMQ_LINGER, &LINGER_TIME, sizeof(LINGER_TIME));
+    zmq_setsockopt(handlers, ZMQ_LINGER, &LINGER_TIME, sizeof(LINGER_TIME));
+    rc = zmq_close(handlers);
+    assert(rc == 0);
+    rc = zmq_close(socket);
+    assert(rc == 0);
+    rc = zmq_ctx_destroy(ctx);
+    assert(rc == 0);
+    for(auto& t: threads) t.join();
 }
-
  
 //------------------------------------------------------------------------------
 int main(int argc, char** argv) {
     if(argc < 3) {
         std::cout << argv[0] 
-                  << " <number of workers> <broker address>" << std::endl;
+                  << " <number of workers> <broker address>"
+                     " [worker capacity, default 1]" << std::endl;
         return 0;
     }
     const int NUM_WORKERS = atoi(argv[1]);
     assert(NUM_WORKERS > 0);
+    const int CAPACITY = argc > 3 ? atoi(argv[3]) : 1;
+    assert(CAPACITY > 0);
     // Start workers and clients
     typedef std::vector< std::future< void > > FutureArray;
     FutureArray workers;
@@ -107,7 +184,7 @@ int main(int argc, char** argv) {
         workers.push_back(
                     std::move(
                         std::async(std::launch::async, Worker,
-                                   argv[2], t + 1)));
+                                   argv[2], t + 1, CAPACITY)));
     }
     std::for_each(workers.begin(), workers.end(),
                  [](FutureArray::value_type& f) {
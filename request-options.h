@@ -0,0 +1,95 @@
+#pragma once
+//Optional frames in the <seq id, payload> request envelope
+//Author: Ugo Varetto
+//Request format: |client id|<empty>|seq id|[option]...|payload|
+//Option frames sit between the sequence id and the payload, which is
+//always the last frame; each option starts with a one byte tag followed by
+//the value:
+// - 'P' priority: 1 byte, 0 = highest
+// - 'D' time to live: 4 byte unsigned integer, milliseconds; relative so
+//   that it does not depend on synchronized clocks: each hop converts it
+//   to a local deadline when the request is received and rewrites it with
+//   the time left when forwarding the request
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+
+#include "multipart.h"
+
+const char PRIORITY_OPTION = 'P';
+const char TTL_OPTION = 'D';
+
+//------------------------------------------------------------------------------
+//option with tag 'tag' in frames [first, last payload frame), nullptr if not
+//found or value size differs from 'size'
+inline const char* FindOption(const Frames& msg, size_t first, char tag,
+                              size_t size) {
+    for(size_t i = first; i + 1 < msg.size(); ++i) {
+        const Frame& f = msg[i];
+        if(f.size() == size + 1 && f.data()[0] == tag) return f.data() + 1;
+    }
+    return nullptr;
+}
+
+//------------------------------------------------------------------------------
+inline int Priority(const Frames& msg, size_t first, int defaultPriority) {
+    const char* p = FindOption(msg, first, PRIORITY_OPTION, 1);
+    return p ? int(uint8_t(*p)) : defaultPriority;
+}
+
+//------------------------------------------------------------------------------
+inline Frame PriorityOption(int priority) {
+    const char o[] = {PRIORITY_OPTION, char(priority)};
+    return Frame(o, sizeof(o));
+}
+
+//------------------------------------------------------------------------------
+//remove option frames: |...|seq id|options|payload| -> |...|seq id|payload|
+inline void StripOptions(Frames& msg, size_t first) {
+    if(msg.size() > first + 1)
+        msg.erase(msg.begin() + first, msg.end() - 1);
+}
+
+//------------------------------------------------------------------------------
+//local deadline computed from time to live option, time_point::max() if
+//not present
+inline std::chrono::steady_clock::time_point
+Deadline(const Frames& msg, size_t first,
+         std::chrono::steady_clock::time_point now
+             = std::chrono::steady_clock::now()) {
+    const char* p = FindOption(msg, first, TTL_OPTION, sizeof(uint32_t));
+    if(!p) return std::chrono::steady_clock::time_point::max();
+    uint32_t ttl;
+    memcpy(&ttl, p, sizeof(ttl));
+    return now + std::chrono::milliseconds(ttl);
+}
+
+//------------------------------------------------------------------------------
+inline Frame TimeToLiveOption(std::chrono::milliseconds ttl) {
+    char o[1 + sizeof(uint32_t)] = {TTL_OPTION};
+    const uint32_t t = uint32_t(std::max(ttl.count(),
+                                         std::chrono::milliseconds::rep(0)));
+    memcpy(o + 1, &t, sizeof(t));
+    return Frame(o, sizeof(o));
+}
+
+//------------------------------------------------------------------------------
+//rewrite time to live option, if present, with the time left to 'deadline'
+//before forwarding request to next hop
+inline void UpdateTimeToLive(Frames& msg, size_t first,
+                             std::chrono::steady_clock::time_point deadline,
+                             std::chrono::steady_clock::time_point now
+                                 = std::chrono::steady_clock::now()) {
+    for(size_t i = first; i + 1 < msg.size(); ++i) {
+        Frame& f = msg[i];
+        if(f.size() != 1 + sizeof(uint32_t) || f.data()[0] != TTL_OPTION)
+            continue;
+        const uint32_t t = deadline > now ? uint32_t(
+            std::chrono::duration_cast< std::chrono::milliseconds >(
+                deadline - now).count()) : 0;
+        memcpy(f.data() + 1, &t, sizeof(t));
+        return;
+    }
+}
@@ -0,0 +1,156 @@
+#pragma once
+//Bounded request queue with priority classes and admission control
+//Author: Ugo Varetto
+//Used by brokers to hold requests while no worker is available, instead of
+//leaving them in the ZeroMQ pipes where they are invisible and only
+//dropped or blocked by the HWM.
+// - requests are served by priority class (0 = highest), FIFO within class
+// - a request is rejected when the queue is full, or when the estimated
+//   queueing time exceeds the time left to its deadline; the caller replies
+//   to the client right away (e.g. BUSY), so that clients fail fast instead
+//   of waiting for a timeout
+// - the estimated queueing time is the number of requests ahead times the
+//   average interval between dequeues measured while the queue is not empty
+// - requests whose deadline expires while queued are discarded by Pop
+//   without being dispatched
+// - depth, wait time and admission counters are available as metrics
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+#include <ostream>
+#include <cstddef>
+#include <cstdint>
+
+//------------------------------------------------------------------------------
+template < typename T >
+class RequestQueue {
+public:
+    typedef std::chrono::steady_clock Clock;
+    enum Admission {ACCEPTED, REJECTED_FULL, REJECTED_DEADLINE};
+    struct Metrics {
+        uint64_t accepted = 0;
+        uint64_t rejectedFull = 0;
+        uint64_t rejectedDeadline = 0;
+        uint64_t dispatched = 0;
+        uint64_t expired = 0;
+        size_t maxDepth = 0;
+        double averageWait = 0; //seconds, EWMA
+        double maxWait = 0;     //seconds
+    };
+    //maxWait: upper bound on queueing time for requests without a deadline
+    RequestQueue(size_t capacity, int priorities = 1,
+                 Clock::duration maxWait = std::chrono::seconds(1),
+                 double alpha = 0.1)
+        : capacity_(capacity), maxWait_(maxWait), alpha_(alpha),
+          classes_(std::max(1, priorities)) {}
+    //on rejection 'v' is left untouched
+    Admission Push(T&& v, int priority = 0,
+                   Clock::time_point deadline = Clock::time_point::max(),
+                   Clock::time_point now = Clock::now()) {
+        if(size_ >= capacity_) {
+            ++metrics_.rejectedFull;
+            return REJECTED_FULL;
+        }
+        priority = Clamp(priority);
+        if(now + EstimatedWait(priority) > std::min(deadline, now + maxWait_)) {
+            ++metrics_.rejectedDeadline;
+            return REJECTED_DEADLINE;
+        }
+        classes_[priority].push_back(Item{std::move(v), now, deadline});
+        ++size_;
+        ++metrics_.accepted;
+        metrics_.maxDepth = std::max(metrics_.maxDepth, size_);
+        return ACCEPTED;
+    }
+    //highest priority request first, false if queue empty; expired
+    //requests are discarded; if not null 'deadline' is set to the request
+    //deadline
+    bool Pop(T& v, Clock::time_point now = Clock::now(),
+             Clock::time_point* deadline = nullptr) {
+        for(auto& c: classes_) {
+            while(!c.empty() && c.front().deadline < now) {
+                c.pop_front();
+                --size_;
+                ++metrics_.expired;
+            }
+            if(c.empty()) continue;
+            Item& i = c.front();
+            v = std::move(i.value);
+            if(deadline) *deadline = i.deadline;
+            Dequeued(now, i.enqueued);
+            c.pop_front();
+            return true;
+        }
+        return false;
+    }
+    Clock::duration EstimatedWait(int priority) const {
+        size_t ahead = 0;
+        for(int p = 0; p <= Clamp(priority); ++p) ahead += classes_[p].size();
+        return std::chrono::duration_cast< Clock::duration >(
+                   std::chrono::duration< double >(ahead * interval_));
+    }
+    size_t Size() const { return size_; }
+    bool Empty() const { return size_ == 0; }
+    size_t Depth(int priority) const { return classes_[Clamp(priority)].size(); }
+    int Priorities() const { return int(classes_.size()); }
+    const Metrics& GetMetrics() const { return metrics_; }
+private:
+    struct Item {
+        T value;
+        Clock::time_point enqueued;
+        Clock::time_point deadline;
+    };
+    int Clamp(int priority) const {
+        return std::min(std::max(priority, 0), int(classes_.size()) - 1);
+    }
+    //update wait time and dequeue interval statistics
+    void Dequeued(Clock::time_point now, Clock::time_point enqueued) {
+        --size_;
+        ++metrics_.dispatched;
+        const double wait =
+            std::chrono::duration< double >(now - enqueued).count();
+        metrics_.averageWait = metrics_.dispatched == 1 ? wait
+            : alpha_ * wait + (1 - alpha_) * metrics_.averageWait;
+        metrics_.maxWait = std::max(metrics_.maxWait, wait);
+        //interval between dequeues is a measure of the service rate only
+        //if requests were waiting in between
+        if(backlogged_) {
+            const double d =
+                std::chrono::duration< double >(now - lastDequeue_).count();
+            interval_ = interval_ > 0 ? alpha_ * d + (1 - alpha_) * interval_
+                                      : d;
+        }
+        lastDequeue_ = now;
+        backlogged_ = size_ > 0;
+    }
+private:
+    size_t capacity_;
+    Clock::duration maxWait_;
+    double alpha_;
+    std::vector< std::deque< Item > > classes_;
+    size_t size_ = 0;
+    Metrics metrics_;
+    double interval_ = 0; //seconds, EWMA
+    Clock::time_point lastDequeue_;
+    bool backlogged_ = false;
+};
+
+//------------------------------------------------------------------------------
+template < typename T >
+std::ostream& operator<<(std::ostream& os, const RequestQueue< T >& q) {
+    const auto& m = q.GetMetrics();
+    os << "depth: " << q.Size();
+    for(int p = 0; p != q.Priorities(); ++p) {
+        os << (p ? "," : " (") << q.Depth(p);
+    }
+    os << ") max depth: " << m.maxDepth
+       << " accepted: " << m.accepted
+       << " rejected full: " << m.rejectedFull
+       << " rejected deadline: " << m.rejectedDeadline
+       << " dispatched: " << m.dispatched
+       << " expired: " << m.expired
+       << " avg wait ms: " << 1000 * m.averageWait
+       << " max wait ms: " << 1000 * m.maxWait;
+    return os;
+}
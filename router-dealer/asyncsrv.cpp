@@ -1,7 +1,8 @@
 //Async client server: client sends async requests through a DEALER socket
 //and polls replies
 //ROUTER socket receives the complete envelope [socket identity][message]
-//and dispatches it to the DEALER as a multipart message
+//and hands it over to a pool of threads fed by a lock-free queue
+//Usage: asyncsrv [server run time in seconds, default 10]
 //Note that no empty delimiter is added to the envelope by the DEALER; in
 //order to make it compliant with REQ/REP socket an empty field must
 //be manually added
@@ -13,12 +14,20 @@
 #include <string>
 #include <sstream>
 #include <random>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
 #ifdef __APPLE__
 #include <ZeroMQ/zmq.h>
 #else
 #include <zmq.h>
 #endif
 
+#include "../multipart.h"
+#include "executor.h"
+#include "../proxy.h"
+
 //------------------------------------------------------------------------------
 //  This is our client task
 //  It connects to the server, and then sends a request once per second
@@ -62,66 +71,134 @@ void client_task() {
 //------------------------------------------------------------------------------
 //  .split server task
 //  This is our server task.
-//  It uses the multithreaded server model to deal requests out to a pool
-//  of workers and route replies back to clients. One worker can handle
-//  one request at a time but one client can talk to multiple workers at
-//  once.
-
-static void server_worker (void *ctx);
-
-void server_task() {
+//  Requests received from the frontend are handled by a pool of threads
+//  fed by a lock-free queue (see executor.h) instead of being dealt
+//  round-robin to worker sockets: the next request is taken by whichever
+//  thread is idle, so a slow request does not delay the requests behind
+//  it. Each pool thread sends its replies through its own PUSH socket to
+//  a PULL socket polled together with the frontend, since only the server
+//  thread can use the ROUTER socket.
+//  The server runs for 'duration' and then shuts down the pool, executing
+//  the requests already accepted, and releases all resources.
+//  Traffic statistics (see proxy.h) are published once per second on a
+//  PUB socket bound to tcp://*:5571: requests are accounted when a pool
+//  thread starts executing them, with the time spent in the queue as
+//  latency, replies when forwarded to the client; the clients with the
+//  highest traffic are listed in each report.
+
+static void server_worker(void* push, Frames& request);
+
+void server_task(std::chrono::seconds duration) {
+    const char* REPLY_URI = "inproc://replies";
+    const int THREADS = 0; //one per core
+    const size_t QUEUE_CAPACITY = 0x1000;
+    const char BUSY[] = "BUSY";
     //  Frontend socket talks to clients over TCP
     void* ctx = zmq_ctx_new();
     void *frontend = zmq_socket(ctx, ZMQ_ROUTER);
     zmq_bind(frontend, "tcp://*:5570");
 
-    //  Backend socket talks to workers over inproc
-    void *backend = zmq_socket(ctx, ZMQ_DEALER);
-    zmq_bind(backend, "inproc://backend");
-
-    //  Launch pool of worker threads, precise number is not critical
-    int thread_nbr;
-    for (thread_nbr = 0; thread_nbr < 5; thread_nbr++)
-        new std::thread(server_worker, ctx);
-
-    //  Connect backend to frontend via a proxy
-    zmq_proxy(frontend, backend, 0);
-
+    //  Replies from pool threads, bound before the threads connect
+    void *replies = zmq_socket(ctx, ZMQ_PULL);
+    zmq_bind(replies, REPLY_URI);
+
+    //  Traffic statistics
+    void *statsSocket = zmq_socket(ctx, ZMQ_PUB);
+    zmq_bind(statsSocket, "tcp://*:5571");
+    ProxyStats stats;
+    PeerStats clients;
+    StatsPublisher publisher(statsSocket, stats, &clients);
+
+    std::vector< void* > push(std::max(1, THREADS ? THREADS
+                              : int(std::thread::hardware_concurrency())));
+    {
+        Executor executor(int(push.size()), QUEUE_CAPACITY, true,
+            [&](int thread) {
+                push[thread] = zmq_socket(ctx, ZMQ_PUSH);
+                zmq_connect(push[thread], REPLY_URI);
+            },
+            [&](int thread) { zmq_close(push[thread]); });
+
+        zmq_pollitem_t items[] = {{frontend, 0, ZMQ_POLLIN, 0},
+                                  {replies, 0, ZMQ_POLLIN, 0}};
+        const auto end = std::chrono::steady_clock::now() + duration;
+        Frames msg;
+        while(std::chrono::steady_clock::now() < end) {
+            if(zmq_poll(items, 2, 100) < 0) break;
+            //  request |client id|payload|: hand over to the pool, reply
+            //  BUSY if the queue is full
+            if(items[0].revents & ZMQ_POLLIN) {
+                recv_frames(frontend, msg);
+                stats.Wakeup(ProxyStats::FRONTEND_TO_BACKEND, 1);
+                const auto received = ProxyStats::Clock::now();
+                size_t bytes = 0;
+                for(const Frame& f: msg) bytes += f.size();
+                clients.Record(msg, bytes);
+                std::shared_ptr< Frames > request =
+                    std::make_shared< Frames >(std::move(msg));
+                if(!executor.Submit([request, &push, &stats, received, bytes]
+                                    (int thread) {
+                       stats.Record(ProxyStats::FRONTEND_TO_BACKEND,
+                                    request->size(), bytes,
+                                    ProxyStats::Clock::now() - received);
+                       server_worker(push[thread], *request);
+                   })) {
+                    stats.Error(ProxyStats::FRONTEND_TO_BACKEND);
+                    msg = std::move(*request);
+                    msg.back() = Frame(BUSY, strlen(BUSY));
+                    send_frames(frontend, msg);
+                }
+            }
+            //  reply |client id|payload| from pool thread
+            if(items[1].revents & ZMQ_POLLIN) {
+                recv_frames(replies, msg);
+                stats.Wakeup(ProxyStats::BACKEND_TO_FRONTEND, 1);
+                const auto start = ProxyStats::Clock::now();
+                const size_t frames = msg.size();
+                size_t bytes = 0;
+                for(const Frame& f: msg) bytes += f.size();
+                clients.Record(msg, bytes);
+                if(send_frames(frontend, msg)) {
+                    stats.Record(ProxyStats::BACKEND_TO_FRONTEND, frames,
+                                 bytes, ProxyStats::Clock::now() - start);
+                } else stats.Error(ProxyStats::BACKEND_TO_FRONTEND);
+            }
+            publisher.Poll();
+        }
+        //  executor destructor: pending requests are executed and the
+        //  threads joined; replies still in flight are discarded
+    }
+    const int LINGER = 0;
+    zmq_setsockopt(frontend, ZMQ_LINGER, &LINGER, sizeof(LINGER));
+    zmq_setsockopt(replies, ZMQ_LINGER, &LINGER, sizeof(LINGER));
+    zmq_setsockopt(statsSocket, ZMQ_LINGER, &LINGER, sizeof(LINGER));
     zmq_close(frontend);
-    zmq_close(backend);
+    zmq_close(replies);
+    zmq_close(statsSocket);
     zmq_ctx_destroy(ctx);
 }
 
 //------------------------------------------------------------------------------
 //  .split worker task
-//  Each worker task works on one request at a time and sends a random number
-//  of replies back, with random delays between replies:
-void server_worker(void* ctx) {
-    void *worker = zmq_socket(ctx, ZMQ_DEALER);
-    zmq_connect(worker, "inproc://backend");
-    std::vector< char > id(0x100, char(0));
-    std::vector< char > buffer(0x100, char(0));
+//  Each request is serviced by sending a random number of replies back,
+//  with delays between replies; 'push' is the socket owned by the calling
+//  pool thread
+void server_worker(void* push, Frames& request) {
+    thread_local std::default_random_engine rng(std::random_device{}());
+    std::uniform_int_distribution<int> dist(1, 5);
+    // The ROUTER socket gives us the reply envelope and message
+    const std::string id = request.front().str();
+    const std::string payload = request.back().str();
     std::ostringstream oss;
-    std::default_random_engine rng(std::random_device{}()); 
-    std::uniform_int_distribution<int> dist(1, 5);  
-    while(true) {
-        // The ROUTER socket connected to the DEALER socket gives us the
-        // reply envelope and message
-        const int idrc = zmq_recv(worker, &id[0], id.size(), 0);
-        id[idrc] = '\0';
-        const int rc = zmq_recv(worker, &buffer[0], buffer.size(), 0);
-        buffer[rc] = '\0';
-        const int replies = dist(rng);
-        for (int reply = 0; reply < replies; reply++) {
-            //  Sleep for some fraction of a second
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            zmq_send(worker, &id[0], idrc, ZMQ_SNDMORE);
-            oss.str("");
-            oss << " - " << &id[0] << ": " << &buffer[0] << " - SERVICED";
-            zmq_send(worker, oss.str().c_str(), oss.str().size(), 0);
-        }   
+    const int replies = dist(rng);
+    for (int reply = 0; reply < replies; reply++) {
+        //  Sleep for some fraction of a second
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        zmq_send(push, id.data(), id.size(), ZMQ_SNDMORE);
+        oss.str("");
+        oss << " - " << id << ": " << payload << " - SERVICED";
+        zmq_send(push, oss.str().c_str(), oss.str().size(), 0);
     }
-    zmq_close(worker);
 }
 
 //------------------------------------------------------------------------------
@@ -131,12 +208,16 @@ void quiet_termination() { exit(0); }
 //  waits for the server to finish.
 
 //------------------------------------------------------------------------------
-int main (void)
+int main (int argc, char** argv)
 {
     std::set_terminate(quiet_termination);
+    const std::chrono::seconds duration(argc > 1 ? atoi(argv[1]) : 10);
     new std::thread(client_task);
     new std::thread(client_task);
     new std::thread(client_task);
-    new std::thread(server_task);
+    std::thread server(server_task, duration);
+    server.join();
+    //  clients never terminate
+    quiet_termination();
     return 0;
 }
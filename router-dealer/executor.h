@@ -0,0 +1,233 @@
+#pragma once
+//Thread pool executor fed by a lock-free queue
+//Author: Ugo Varetto
+//Tasks are stored in a bounded multiple producer multiple consumer queue
+//(D. Vyukov's array based queue: one sequence number per cell, producers
+//and consumers only contend on a compare-and-swap of their position);
+//every idle thread takes the next task, so a slow task only delays the
+//thread executing it, not the tasks queued behind it as with the
+//round-robin distribution of a DEALER socket.
+//Idle threads spin for a short time and then sleep on a condition
+//variable, which producers signal only when threads are sleeping.
+//Threads are optionally pinned (Linux only), round-robin, to the CPUs in
+//the affinity mask of the process, so that restrictions set by taskset or
+//cgroups are honoured; pinning failures are reported and the thread is
+//left unpinned. Threads receive their
+//index, which tasks can use to access per-thread resources, e.g. sockets,
+//initialized by the 'init' function in the thread itself.
+//Shutdown stops accepting tasks, executes the tasks already queued and
+//joins the threads; it must not be called concurrently with Submit.
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <utility>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+//------------------------------------------------------------------------------
+template < typename T >
+class MPMCQueue {
+public:
+    //capacity rounded up to a power of two
+    explicit MPMCQueue(size_t capacity) {
+        size_t c = 2;
+        while(c < capacity) c <<= 1;
+        cells_ = std::vector< Cell >(c);
+        mask_ = c - 1;
+        for(size_t i = 0; i != c; ++i)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+    MPMCQueue(const MPMCQueue&) = delete;
+    MPMCQueue& operator=(const MPMCQueue&) = delete;
+    //false if queue full, 'v' is left untouched
+    bool TryPush(T&& v) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        Cell* c;
+        while(true) {
+            c = &cells_[pos & mask_];
+            const size_t seq = c->seq.load(std::memory_order_acquire);
+            const intptr_t d = intptr_t(seq) - intptr_t(pos);
+            if(d == 0) {
+                if(tail_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed))
+                    break;
+            } else if(d < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        c->value = std::move(v);
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+    //false if queue empty
+    bool TryPop(T& v) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        Cell* c;
+        while(true) {
+            c = &cells_[pos & mask_];
+            const size_t seq = c->seq.load(std::memory_order_acquire);
+            const intptr_t d = intptr_t(seq) - intptr_t(pos + 1);
+            if(d == 0) {
+                if(head_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed))
+                    break;
+            } else if(d < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        v = std::move(c->value);
+        c->value = T();
+        c->seq.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+    //approximate
+    bool Empty() const {
+        return head_.load(std::memory_order_acquire)
+               == tail_.load(std::memory_order_acquire);
+    }
+private:
+    struct Cell {
+        std::atomic< size_t > seq;
+        T value;
+        Cell() : seq(0) {}
+        //required by std::vector, only used before the queue is shared
+        Cell(Cell&& c) : seq(c.seq.load()), value(std::move(c.value)) {}
+    };
+    enum {CACHE_LINE = 64};
+    std::vector< Cell > cells_;
+    size_t mask_ = 0;
+    alignas(CACHE_LINE) std::atomic< size_t > tail_{0};
+    alignas(CACHE_LINE) std::atomic< size_t > head_{0};
+};
+
+//------------------------------------------------------------------------------
+class Executor {
+public:
+    typedef std::function< void (int thread) > Task;
+    typedef std::function< void (int thread) > ThreadFun;
+    //threads = 0: one thread per core
+    explicit Executor(int threads = 0, size_t capacity = 0x1000,
+                      bool pin = true, ThreadFun init = ThreadFun(),
+                      ThreadFun fini = ThreadFun())
+        : queue_(capacity), init_(init), fini_(fini) {
+        const std::vector< int > cpus = AllowedCPUs();
+        if(threads <= 0) threads = std::max(1, int(cpus.size()));
+        for(int i = 0; i != threads; ++i) {
+            threads_.push_back(std::thread([this, i]() { Run(i); }));
+            if(pin && !cpus.empty())
+                Pin(threads_.back(), cpus[i % cpus.size()]);
+        }
+    }
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+    ~Executor() { Shutdown(); }
+    //false if the queue is full or the executor is shutting down
+    bool Submit(Task t) {
+        if(stop_.load(std::memory_order_acquire)) return false;
+        if(!queue_.TryPush(std::move(t))) return false;
+        //pairs with the fence in Run: either the sleeping thread sees the
+        //task or the producer sees the sleeping thread
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(sleeping_.load(std::memory_order_relaxed)) {
+            std::lock_guard< std::mutex > lock(mutex_);
+            cv_.notify_one();
+        }
+        return true;
+    }
+    //execute queued tasks and join threads; idempotent
+    void Shutdown() {
+        {
+            std::lock_guard< std::mutex > lock(mutex_);
+            stop_.store(true, std::memory_order_release);
+            cv_.notify_all();
+        }
+        for(auto& t: threads_) if(t.joinable()) t.join();
+    }
+    int Threads() const { return int(threads_.size()); }
+private:
+    //CPUs the process may run on; empty if not available
+    static std::vector< int > AllowedCPUs() {
+        std::vector< int > cpus;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for(int c = 0; c != CPU_SETSIZE; ++c)
+                if(CPU_ISSET(c, &set)) cpus.push_back(c);
+        } else {
+            std::cerr << "sched_getaffinity: " << strerror(errno) << std::endl;
+        }
+#else
+        const int n = int(std::thread::hardware_concurrency());
+        for(int c = 0; c < n; ++c) cpus.push_back(c);
+#endif
+        return cpus;
+    }
+    static void Pin(std::thread& t, int cpu) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        const int rc =
+            pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+        if(rc != 0) {
+            std::cerr << "Cannot pin thread to CPU " << cpu << ": "
+                      << strerror(rc) << std::endl;
+        }
+#else
+        (void) t;
+        (void) cpu;
+#endif
+    }
+    void Run(int id) {
+        if(init_) init_(id);
+        const int SPIN = 1000;
+        Task t;
+        while(true) {
+            bool got = false;
+            for(int i = 0; i != SPIN && !got; ++i) {
+                got = queue_.TryPop(t);
+                if(!got) std::this_thread::yield();
+            }
+            if(got) {
+                t(id);
+                t = Task();
+                continue;
+            }
+            if(stop_.load(std::memory_order_acquire) && queue_.Empty()) break;
+            std::unique_lock< std::mutex > lock(mutex_);
+            sleeping_.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            //re-check after registering as sleeper: a task pushed before
+            //the increment is seen here, after it the producer notifies
+            if(queue_.Empty() && !stop_.load(std::memory_order_acquire))
+                cv_.wait(lock);
+            sleeping_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        if(fini_) fini_(id);
+    }
+private:
+    MPMCQueue< Task > queue_;
+    ThreadFun init_;
+    ThreadFun fini_;
+    std::vector< std::thread > threads_;
+    std::atomic< bool > stop_{false};
+    std::atomic< int > sleeping_{0};
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
@@ -7,13 +7,33 @@
 //Todo: implement move constructors setting copied object context and socket
 //to nullptr: this allows to properly destroy zeromq context and close socket
 //in the destructor if not NULL
+//Sharded mode: when the number of shards is > 1 the broker runs one thread
+//per shard, each with its own frontend and backend ROUTER sockets; clients
+//and workers connect to the shard selected by their id (id % shards).
+//A shard whose workers are idle while its request queue is empty steals
+//requests from the other shards: shards exchange messages over inproc
+//PUSH/PULL sockets:
+// |STEAL|from shard|number of idle workers|
+// |WORK|from shard|client id|request|   - one message per stolen request
+// |NOWORK|from shard|                    - nothing to steal
+// |REPLY|from shard|client id|reply|     - reply to a stolen request, routed
+//                                          back to the shard owning the
+//                                          client
+//Workers are selected according to a dispatch policy (see dispatch.h);
+//a READY message can carry the worker capacity: |READY|capacity|
+//usage: load-balancer [number of clients, default 4] [number of shards,
+//       default 1] [dispatch policy: lru(default) | least | ewma]
 #include <thread> //C++11
 #include <iostream>
 #include <string>
 #include <vector>
 #include <algorithm>
 #include <deque>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <cassert>
 #ifdef __APPLE__
 #include <ZeroMQ/zmq.h>
@@ -21,22 +41,35 @@
 #include <zmq.h>
 #endif
 
+#include "../multipart.h"
+#include "../utility.h"
+#include "../dispatch.h"
+#include "../requestqueue.h"
+
 //------------------------------------------------------------------------------
 static const char* FRONTEND_URI = "tcp://0.0.0.0:5555";//"ipc://frontend.ipc";
 static const char* BACKEND_URI  = "tcp://0.0.0.0:5556";//"ipc://backend.ipc";
 static const int WORKER_READY = 123;
+//sharded mode: shard k binds frontend to port FRONTEND_PORT + k and backend
+//to BACKEND_PORT + k
+static const int FRONTEND_PORT = 5600;
+static const int BACKEND_PORT  = 5700;
+//single threaded mode: request queue capacity and max queueing time
+static const size_t MAX_QUEUED = 1000;
+static const std::chrono::milliseconds MAX_QUEUEING_TIME(1000);
 
 //------------------------------------------------------------------------------
 class Client {
 public:    
-    Client(int id, const std::string& text) : 
-        id_(id), text_(text) {}
+    Client(int id, const std::string& text,
+           const std::string& uri = FRONTEND_URI) : 
+        id_(id), text_(text), uri_(uri) {}
     void operator()() const {
         //initilize context and set REQ identifier to id
         void* context = zmq_ctx_new();
         void* socket = zmq_socket(context, ZMQ_REQ);
         zmq_setsockopt(socket, ZMQ_IDENTITY, &id_, sizeof(id_));
-        zmq_connect(socket, FRONTEND_URI);
+        zmq_connect(socket, uri_.c_str());
         std::vector< char > buffer = std::vector< char >(text_.begin(), 
                                                         text_.end());
         buffer.push_back(char(0)); 
@@ -49,6 +82,7 @@ public:
 private:
     int id_;
     std::string text_;
+    std::string uri_;
     mutable void* context_;
     mutable void* socket_;
     mutable std::vector< char > buffer_;
@@ -56,14 +90,14 @@ private:
 //------------------------------------------------------------------------------
 class Worker {
 public:    
-    Worker(int id) : 
-        id_(id) {}
+    Worker(int id, const std::string& uri = BACKEND_URI) : 
+        id_(id), uri_(uri) {}
     void operator()() const {
         void* context = zmq_ctx_new();
         void* socket = zmq_socket(context, ZMQ_REQ);
         std::vector< char > buffer(0x100, char(0));
         zmq_setsockopt(socket, ZMQ_IDENTITY, &id_, sizeof(id_));
-        zmq_connect(socket, BACKEND_URI);
+        zmq_connect(socket, uri_.c_str());
         zmq_send(socket, &WORKER_READY, sizeof(WORKER_READY), 0);
         int client_id = -1;
         int rc = -1;
@@ -84,7 +118,197 @@ public:
     }
 private:
     int id_;
+    std::string uri_;
 };
+//------------------------------------------------------------------------------
+std::string ShardURI(int port) {
+    return "tcp://0.0.0.0:" + std::to_string(port);
+}
+
+//------------------------------------------------------------------------------
+std::string StealURI(int shard) {
+    return "inproc://load-balancer-shard-" + std::to_string(shard);
+}
+
+//------------------------------------------------------------------------------
+enum ShardMessage {STEAL = 1, WORK, NOWORK, REPLY};
+
+//------------------------------------------------------------------------------
+int ToInt(const Frame& f) {
+    assert(f.size() == sizeof(int));
+    int i;
+    memcpy(&i, f.data(), sizeof(i));
+    return i;
+}
+
+//------------------------------------------------------------------------------
+//send |type|from|[int]|[frame]| to other shard
+void SendToShard(void* push, int type, int from, const int* value = nullptr,
+                 Frame* data = nullptr) {
+    const bool more = value != nullptr;
+    ZCheck(zmq_send(push, &type, sizeof(type), ZMQ_SNDMORE));
+    ZCheck(zmq_send(push, &from, sizeof(from), more ? ZMQ_SNDMORE : 0));
+    if(!more) return;
+    ZCheck(zmq_send(push, value, sizeof(*value), data ? ZMQ_SNDMORE : 0));
+    if(data) ZCheck(data->send(push));
+}
+
+//------------------------------------------------------------------------------
+//One broker shard: same request/reply flow as the single threaded loop in
+//main, plus a request queue which other shards can steal from
+void Shard(void* context, int shard, int shards,
+           std::atomic< int >& ready, std::atomic< int >& serviced,
+           int total, Dispatcher::Policy policy) {
+    //max number of queued requests, stop polling frontend when reached
+    const size_t MAX_SHARD_QUEUED = 0x1000;
+    //wait before trying again after all other shards replied with NOWORK
+    const std::chrono::milliseconds STEAL_BACKOFF(1);
+    //check for termination at least this often
+    const long POLL_TIMEOUT = 100; //ms
+    typedef std::chrono::steady_clock Clock;
+    struct Request {
+        int client_id;
+        Frame data;
+    };
+    void* frontend = ZCheck(zmq_socket(context, ZMQ_ROUTER));
+    void* backend = ZCheck(zmq_socket(context, ZMQ_ROUTER));
+    void* pull = ZCheck(zmq_socket(context, ZMQ_PULL));
+    //do not block context termination on undelivered messages
+    const int linger = 0;
+    ZCheck(zmq_setsockopt(frontend, ZMQ_LINGER, &linger, sizeof(linger)));
+    ZCheck(zmq_setsockopt(backend, ZMQ_LINGER, &linger, sizeof(linger)));
+    ZCheck(zmq_bind(frontend, ShardURI(FRONTEND_PORT + shard).c_str()));
+    ZCheck(zmq_bind(backend, ShardURI(BACKEND_PORT + shard).c_str()));
+    ZCheck(zmq_bind(pull, StealURI(shard).c_str()));
+    //connect to other shards after all inproc endpoints are bound
+    ++ready;
+    while(ready < shards) std::this_thread::yield();
+    std::vector< void* > push(shards, nullptr);
+    for(int s = 0; s != shards; ++s) {
+        if(s == shard) continue;
+        push[s] = ZCheck(zmq_socket(context, ZMQ_PUSH));
+        ZCheck(zmq_setsockopt(push[s], ZMQ_LINGER, &linger, sizeof(linger)));
+        ZCheck(zmq_connect(push[s], StealURI(s).c_str()));
+    }
+    Dispatcher dispatcher(policy);
+    std::deque< Request > requests;
+    bool steal_pending = false;
+    int victim = shard;
+    int failed_steals = 0;
+    Clock::time_point next_steal = Clock::now();
+    Frames msg;
+    int worker_id = -1;
+    int client_id = -1;
+    while(serviced < total) {
+        zmq_pollitem_t items[] = {
+            {backend, 0, ZMQ_POLLIN, 0},
+            {pull, 0, ZMQ_POLLIN, 0},
+            {frontend, 0, ZMQ_POLLIN, 0}};
+        const bool steal = shards > 1 && dispatcher.Available()
+                           && requests.empty() && !steal_pending;
+        long timeout = POLL_TIMEOUT;
+        if(steal) {
+            timeout = std::min(timeout, std::max(0L, long(
+                std::chrono::duration_cast< std::chrono::milliseconds >(
+                    next_steal - Clock::now()).count())));
+        }
+        const int rc = zmq_poll(items,
+                                requests.size() < MAX_SHARD_QUEUED ? 3 : 2,
+                                timeout);
+        if(rc == -1) break;
+        //worker: ready message or reply
+        if(items[0].revents & ZMQ_POLLIN) {
+            recv_frames(backend, msg);
+            //|worker id|empty|READY|[capacity]| or
+            //|worker id|empty|client id|empty|reply|
+            assert(msg.size() >= 3 && msg.size() <= 5);
+            worker_id = ToInt(msg[0]);
+            client_id = ToInt(msg[2]);
+            if(client_id == WORKER_READY) {
+                dispatcher.Ready(worker_id,
+                                 msg.size() == 4 ? ToInt(msg[3]) : 1);
+            } else {
+                dispatcher.Completed(worker_id);
+                const int owner = client_id % shards;
+                if(owner == shard) {
+                    pop_front(msg, 2);
+                    //|client id|empty|reply|
+                    send_frames(frontend, msg);
+                    ++serviced;
+                } else {
+                    SendToShard(push[owner], REPLY, shard, &client_id,
+                                &msg[4]);
+                }
+            }
+        }
+        //other shards
+        if(items[1].revents & ZMQ_POLLIN) {
+            recv_frames(pull, msg);
+            const int type = ToInt(msg[0]);
+            const int from = ToInt(msg[1]);
+            if(type == STEAL) {
+                //give away up to half of the queued requests, at most as
+                //many as the idle workers of the other shard
+                size_t n = std::min(size_t(ToInt(msg[2])),
+                                    (requests.size() + 1) / 2);
+                if(!n) SendToShard(push[from], NOWORK, shard);
+                for(; n; --n) {
+                    Request& r = requests.back();
+                    SendToShard(push[from], WORK, shard, &r.client_id,
+                                &r.data);
+                    requests.pop_back();
+                }
+            } else if(type == WORK) {
+                steal_pending = false;
+                failed_steals = 0;
+                requests.push_back({ToInt(msg[2]), std::move(msg[3])});
+            } else if(type == NOWORK) {
+                steal_pending = false;
+                //back off after a full round of failed attempts
+                if(++failed_steals % (shards - 1) == 0)
+                    next_steal = Clock::now() + STEAL_BACKOFF;
+            } else if(type == REPLY) {
+                client_id = ToInt(msg[2]);
+                zmq_send(frontend, &client_id, sizeof(client_id), ZMQ_SNDMORE);
+                zmq_send(frontend, 0, 0, ZMQ_SNDMORE);
+                msg[3].send(frontend);
+                ++serviced;
+            }
+        }
+        //clients
+        if(items[2].revents & ZMQ_POLLIN) {
+            recv_frames(frontend, msg);
+            //|client id|empty|request|
+            assert(msg.size() == 3);
+            requests.push_back({ToInt(msg[0]), std::move(msg[2])});
+        }
+        //dispatch
+        while(dispatcher.Available() && !requests.empty()) {
+            Request& r = requests.front();
+            worker_id = dispatcher.Select();
+            zmq_send(backend, &worker_id, sizeof(worker_id), ZMQ_SNDMORE);
+            zmq_send(backend, 0, 0, ZMQ_SNDMORE);
+            zmq_send(backend, &r.client_id, sizeof(r.client_id), ZMQ_SNDMORE);
+            zmq_send(backend, 0, 0, ZMQ_SNDMORE);
+            r.data.send(backend);
+            requests.pop_front();
+        }
+        //steal from next shard if idle
+        if(shards > 1 && dispatcher.Available() && requests.empty()
+           && !steal_pending && Clock::now() >= next_steal) {
+            victim = (victim + 1) % shards;
+            if(victim == shard) victim = (victim + 1) % shards;
+            const int idle = dispatcher.Credits();
+            SendToShard(push[victim], STEAL, shard, &idle);
+            steal_pending = true;
+        }
+    }
+    for(auto p: push) if(p) zmq_close(p);
+    zmq_close(pull);
+    zmq_close(frontend);
+    zmq_close(backend);
+}
+
 //------------------------------------------------------------------------------
 void quiet_termination() { exit(0); }
 
@@ -103,19 +327,49 @@ int main(int argc, char** argv) {
     std::set_terminate(quiet_termination);
 	
     void* context = zmq_ctx_new();
-    void* frontend = zmq_socket(context, ZMQ_ROUTER);
-    void* backend = zmq_socket(context, ZMQ_ROUTER);
-    zmq_bind(frontend, FRONTEND_URI);
-    zmq_bind(backend, BACKEND_URI);
     std::string text("abcdefgh");
     
     static const int MAX_WORKERS = std::thread::hardware_concurrency();
     const int MAX_CLIENTS = argc == 1 ? 4 : atoi(argv[1]);
-    std::cout << MAX_WORKERS << " workers, " << MAX_CLIENTS << " clients\n";
-    std::deque< int > worker_queue;
+    const int SHARDS = argc > 2 ? std::max(1, atoi(argv[2])) : 1;
+    const Dispatcher::Policy POLICY =
+        Dispatcher::ParsePolicy(argc > 3 ? argv[3] : "lru");
+    std::cout << MAX_WORKERS << " workers, " << MAX_CLIENTS << " clients, "
+              << SHARDS << " shard(s)\n";
     
     std::vector< std::thread > clients;
     std::vector< std::thread > workers;
+    if(SHARDS > 1) {
+        //clients and workers connect to the shard selected by their id
+        std::atomic< int > ready(0);
+        std::atomic< int > serviced(0);
+        std::vector< std::thread > shards;
+        for(int s = 0; s != SHARDS; ++s) {
+            shards.push_back(std::thread(Shard, context, s, SHARDS,
+                                         std::ref(ready), std::ref(serviced),
+                                         MAX_CLIENTS, POLICY));
+        }
+        for(int i = 0; i != MAX_CLIENTS; ++i) {
+            const int id = i + 1;
+            clients.push_back(std::thread(Client(id, text,
+                ShardURI(FRONTEND_PORT + id % SHARDS))));
+            std::next_permutation(text.begin(), text.end());
+        }
+        for(int i = 0; i != MAX_WORKERS; ++i) {
+            const int id = MAX_CLIENTS + i + 1;
+            workers.push_back(std::thread(Worker(id,
+                ShardURI(BACKEND_PORT + id % SHARDS))));
+        }
+        for(auto& t: shards) t.join();
+        zmq_ctx_destroy(context);
+        std::terminate();
+        return 0;
+    }
+    void* frontend = zmq_socket(context, ZMQ_ROUTER);
+    void* backend = zmq_socket(context, ZMQ_ROUTER);
+    zmq_bind(frontend, FRONTEND_URI);
+    zmq_bind(backend, BACKEND_URI);
+    Dispatcher dispatcher(POLICY);
     for(int i = 0; i != MAX_CLIENTS; ++i) {
         clients.push_back(std::thread(Client(i + 1, text)));
         std::next_permutation(text.begin(), text.end());
@@ -126,21 +380,32 @@ int main(int argc, char** argv) {
     int worker_id = -1;
     int client_id = -1;
     int rc = -1;
-    std::vector< char > request(0x100, 0);
     std::vector< char > reply(0x100, 0);
+    //requests are always received and queued, requests that do not fit
+    //in the queue or would wait too long are rejected with a BUSY reply
+    RequestQueue< Frames > queue(MAX_QUEUED, 1, MAX_QUEUEING_TIME);
+    const char BUSY[] = "BUSY";
+    Frames request;
     int serviced_requests = 0;
     while(serviced_requests < MAX_CLIENTS) {
         zmq_pollitem_t items[] = {
             {backend, 0, ZMQ_POLLIN, 0},
             {frontend, 0, ZMQ_POLLIN, 0}};
-        rc = zmq_poll(items, worker_queue.size() > 0 ? 2 : 1, -1);
+        rc = zmq_poll(items, 2, -1);
         if(rc == -1) break;
         if(items[0].revents & ZMQ_POLLIN) {
             zmq_recv(backend, &worker_id, sizeof(worker_id), 0);
-            worker_queue.push_back(worker_id);
             zmq_recv(backend, 0, 0, 0);
             zmq_recv(backend, &client_id, sizeof(client_id), 0);
-            if(client_id != WORKER_READY) {
+            if(client_id == WORKER_READY) {
+                int capacity = 1;
+                int more = 0;
+                size_t more_size = sizeof(more);
+                zmq_getsockopt(backend, ZMQ_RCVMORE, &more, &more_size);
+                if(more) zmq_recv(backend, &capacity, sizeof(capacity), 0);
+                dispatcher.Ready(worker_id, capacity);
+            } else {
+                dispatcher.Completed(worker_id);
                 zmq_recv(backend, 0, 0, 0);
                 rc = zmq_recv(backend, &reply[0], reply.size(), 0);
                 zmq_send(frontend, &client_id, sizeof(client_id), ZMQ_SNDMORE);
@@ -150,18 +415,24 @@ int main(int argc, char** argv) {
             } 
         }
         if(items[1].revents & ZMQ_POLLIN) {
-            zmq_recv(frontend, &client_id, sizeof(client_id), 0);
-            zmq_recv(frontend, 0, 0, 0);
-            rc = zmq_recv(frontend, &request[0], request.size(), 0);
-            worker_id = worker_queue.front();
-            zmq_send(backend, &worker_id, sizeof(worker_id), ZMQ_SNDMORE);
-            zmq_send(backend, 0, 0, ZMQ_SNDMORE);
-            zmq_send(backend, &client_id, sizeof(client_id), ZMQ_SNDMORE);
-            zmq_send(backend, 0, 0, ZMQ_SNDMORE);
-            zmq_send(backend, &request[0], rc, 0);
-            worker_queue.pop_front();
-        }     
+            //|client id|<empty>|request|
+            recv_frames(frontend, request);
+            if(queue.Push(std::move(request))
+               != RequestQueue< Frames >::ACCEPTED) {
+                request.back() = Frame(BUSY, strlen(BUSY));
+                send_frames(frontend, request);
+                ++serviced_requests;
+            }
+        }
+        while(dispatcher.Available() && queue.Pop(request)) {
+            worker_id = dispatcher.Select();
+            //|worker id|<empty>|client id|<empty>|request|
+            push_front(request, Frame());
+            push_front(request, Frame(&worker_id, sizeof(worker_id)));
+            send_frames(backend, request);
+        }
     }
+    std::cout << queue << std::endl;
     zmq_close(frontend);
     zmq_close(backend);
     zmq_ctx_destroy(context);
@@ -0,0 +1,189 @@
+#pragma once
+//Hierarchical timer wheel
+//Author: Ugo Varetto
+//Four levels of 64 slots each; with the default 1ms resolution level 0
+//covers 64ms, level 1 ~4s, level 2 ~4.5min and level 3 ~4.7h, timers
+//farther in the future are parked in the last level and re-inserted when
+//reached. Timers are moved ('cascaded') to the lower level when the wheel
+//below completes a revolution, so that:
+// - Add and Cancel are O(1)
+// - Advance is O(elapsed ticks + expired timers)
+//Timers are stored in a vector and linked into slot lists by index: no
+//allocation per timer in steady state. A TimerId combines index and a
+//generation counter, cancelling a timer that already fired or was
+//cancelled is a no-op.
+//Callbacks can add and cancel timers, including the one being fired.
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+
+//------------------------------------------------------------------------------
+class TimerWheel {
+public:
+    typedef std::chrono::steady_clock Clock;
+    typedef std::chrono::milliseconds Duration;
+    typedef uint64_t TimerId;
+    typedef std::function< void () > Callback;
+    enum {SLOT_BITS = 6,
+          SLOTS = 1 << SLOT_BITS,
+          LEVELS = 4};
+    static const TimerId INVALID_TIMER = ~TimerId(0);
+    TimerWheel(Duration resolution = Duration(1),
+               Clock::time_point start = Clock::now())
+        : resolution_(resolution), start_(start),
+          nodes_(SLOTS * LEVELS) {
+        //first SLOTS * LEVELS nodes are the list heads of the slots
+        for(uint32_t i = 0; i != nodes_.size(); ++i)
+            nodes_[i].prev = nodes_[i].next = i;
+    }
+    //'cb' called by Advance after 'delay', measured from the time passed to
+    //the last call to Advance; minimum delay is one tick
+    TimerId Add(Duration delay, Callback cb) {
+        const uint64_t ticks = std::max(uint64_t(1),
+            uint64_t(std::max(Duration::rep(0), delay.count()))
+            / resolution_.count());
+        const uint32_t n = Allocate();
+        nodes_[n].expires = now_ + ticks;
+        nodes_[n].cb = std::move(cb);
+        Insert(n);
+        ++size_;
+        return (TimerId(nodes_[n].generation) << 32) | n;
+    }
+    //returns false if timer already fired or cancelled
+    bool Cancel(TimerId id) {
+        const uint32_t n = uint32_t(id);
+        if(id == INVALID_TIMER || n < SLOTS * LEVELS || n >= nodes_.size()
+           || nodes_[n].generation != uint32_t(id >> 32)
+           || !nodes_[n].active) return false;
+        Unlink(n);
+        Free(n);
+        --size_;
+        return true;
+    }
+    //fire all timers expired at 'now', returns number of fired timers
+    size_t Advance(Clock::time_point now = Clock::now()) {
+        const uint64_t target = Ticks(now);
+        size_t fired = 0;
+        if(!size_) now_ = std::max(now_, target);
+        while(now_ < target) {
+            ++now_;
+            Cascade();
+            const uint32_t head = Slot(0, now_);
+            while(nodes_[head].next != head) {
+                const uint32_t n = nodes_[head].next;
+                Unlink(n);
+                Callback cb = std::move(nodes_[n].cb);
+                Free(n);
+                --size_;
+                ++fired;
+                cb();
+            }
+            if(!size_) now_ = std::max(now_, target);
+        }
+        return fired;
+    }
+    //milliseconds to wait before calling Advance again, -1 if no timers;
+    //when no timer is due within the current level 0 revolution the time
+    //to the next cascade is returned, so the value is never later than the
+    //next expiration
+    long NextTimeout(Clock::time_point now = Clock::now()) const {
+        if(!size_) return -1;
+        uint64_t t = now_ + 1;
+        for(; t != now_ + SLOTS; ++t) {
+            const uint32_t head = Slot(0, t);
+            if(nodes_[head].next != head) break;
+            if((t & (SLOTS - 1)) == 0) break; //cascade
+        }
+        const Clock::time_point when = start_ + t * resolution_;
+        if(when <= now) return 0;
+        //round up: returning early would only cause a spurious wakeup
+        const auto ns = std::chrono::duration_cast< std::chrono::nanoseconds >(
+                            when - now).count();
+        return long((ns + 999999) / 1000000);
+    }
+    size_t Size() const { return size_; }
+private:
+    struct Node {
+        uint32_t prev = 0;
+        uint32_t next = 0;
+        uint32_t generation = 0;
+        bool active = false;
+        uint64_t expires = 0;
+        Callback cb;
+    };
+    uint64_t Ticks(Clock::time_point t) const {
+        if(t <= start_) return 0;
+        return uint64_t(std::chrono::duration_cast< Duration >(t - start_)
+                        .count()) / resolution_.count();
+    }
+    static uint32_t Slot(int level, uint64_t tick) {
+        return uint32_t(level * SLOTS
+                        + ((tick >> (level * SLOT_BITS)) & (SLOTS - 1)));
+    }
+    //select level from distance to expiration
+    void Insert(uint32_t n) {
+        const uint64_t delta = nodes_[n].expires - now_;
+        int level = 0;
+        while(level != LEVELS - 1
+              && delta >= (uint64_t(1) << ((level + 1) * SLOT_BITS))) ++level;
+        uint64_t tick = nodes_[n].expires;
+        //beyond the wheel range: park in the last slot reachable from now
+        const uint64_t range = uint64_t(1) << (LEVELS * SLOT_BITS);
+        if(delta >= range) tick = now_ + range - 1;
+        Link(Slot(level, tick), n);
+    }
+    //at the start of each revolution of level L - 1, move the timers in the
+    //current slot of level L to the lower levels
+    void Cascade() {
+        for(int level = 1; level != LEVELS; ++level) {
+            if(now_ & ((uint64_t(1) << (level * SLOT_BITS)) - 1)) break;
+            const uint32_t head = Slot(level, now_);
+            uint32_t n = nodes_[head].next;
+            nodes_[head].prev = nodes_[head].next = head;
+            while(n != head) {
+                const uint32_t next = nodes_[n].next;
+                Insert(n);
+                n = next;
+            }
+        }
+    }
+    void Link(uint32_t head, uint32_t n) {
+        const uint32_t last = nodes_[head].prev;
+        nodes_[n].prev = last;
+        nodes_[n].next = head;
+        nodes_[last].next = n;
+        nodes_[head].prev = n;
+    }
+    void Unlink(uint32_t n) {
+        nodes_[nodes_[n].prev].next = nodes_[n].next;
+        nodes_[nodes_[n].next].prev = nodes_[n].prev;
+    }
+    uint32_t Allocate() {
+        uint32_t n;
+        if(!free_.empty()) {
+            n = free_.back();
+            free_.pop_back();
+        } else {
+            n = uint32_t(nodes_.size());
+            nodes_.push_back(Node());
+        }
+        nodes_[n].active = true;
+        return n;
+    }
+    void Free(uint32_t n) {
+        nodes_[n].active = false;
+        nodes_[n].cb = Callback();
+        ++nodes_[n].generation;
+        free_.push_back(n);
+    }
+private:
+    Duration resolution_;
+    Clock::time_point start_;
+    uint64_t now_ = 0; //current tick
+    size_t size_ = 0;
+    std::vector< Node > nodes_;
+    std::vector< uint32_t > free_;
+};
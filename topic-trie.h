@@ -0,0 +1,136 @@
+#pragma once
+//Subscription index for pub-sub brokers
+//Author: Ugo Varetto
+//Prefix trie over topics as found in XPUB subscription messages: each node
+//records which downstream groups (e.g. XPUB sockets) subscribed to the
+//topic ending at the node, as a bit mask. A message topic matches all the
+//subscriptions which are a prefix of it, i.e. the groups found along the
+//path from the root (empty topic = everything) to the deepest node
+//matching the topic, which is the ZeroMQ SUB filtering semantics.
+//Subscribe and Unsubscribe report the transitions between no group and
+//at least one group subscribed, which are the only changes that need to
+//be forwarded upstream.
+//Nodes are stored in a vector and linked by index, children are kept in
+//small vectors sorted by byte; unused nodes are pruned on unsubscribe and
+//recycled.
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+//------------------------------------------------------------------------------
+class TopicTrie {
+public:
+    typedef uint64_t Groups;
+    enum {MAX_GROUPS = 64};
+    TopicTrie() : nodes_(1) {}
+    //returns true if topic was not subscribed by any group before
+    bool Subscribe(const void* topic, size_t size, int group) {
+        const uint32_t n = Insert(static_cast< const unsigned char* >(topic),
+                                  size);
+        const Groups before = nodes_[n].groups;
+        nodes_[n].groups |= Groups(1) << group;
+        if(!before) ++size_;
+        return !before;
+    }
+    //returns true if topic is not subscribed by any group anymore
+    bool Unsubscribe(const void* topic, size_t size, int group) {
+        path_.clear();
+        uint32_t n = 0;
+        const unsigned char* t = static_cast< const unsigned char* >(topic);
+        for(size_t i = 0; i != size; ++i) {
+            path_.push_back(n);
+            n = Child(n, t[i]);
+            if(n == NONE) return false;
+        }
+        const Groups before = nodes_[n].groups;
+        nodes_[n].groups &= ~(Groups(1) << group);
+        if(!before || nodes_[n].groups) return false;
+        --size_;
+        //prune nodes left without subscriptions and children
+        for(size_t i = size; i != 0 && n != 0; --i) {
+            if(nodes_[n].groups || !nodes_[n].children.empty()) break;
+            const uint32_t parent = path_[i - 1];
+            RemoveChild(parent, t[i - 1]);
+            Free(n);
+            n = parent;
+        }
+        return true;
+    }
+    //groups with at least one subscription matching 'topic'
+    Groups Match(const void* topic, size_t size) const {
+        const unsigned char* t = static_cast< const unsigned char* >(topic);
+        uint32_t n = 0;
+        Groups groups = nodes_[0].groups;
+        for(size_t i = 0; i != size; ++i) {
+            n = Child(n, t[i]);
+            if(n == NONE) break;
+            groups |= nodes_[n].groups;
+        }
+        return groups;
+    }
+    bool Subscribed(const void* topic, size_t size, int group) const {
+        const unsigned char* t = static_cast< const unsigned char* >(topic);
+        uint32_t n = 0;
+        for(size_t i = 0; i != size && n != NONE; ++i) n = Child(n, t[i]);
+        return n != NONE && (nodes_[n].groups & (Groups(1) << group));
+    }
+    //number of subscribed topics
+    size_t Size() const { return size_; }
+private:
+    static const uint32_t NONE = ~uint32_t(0);
+    typedef std::pair< unsigned char, uint32_t > Edge;
+    struct Node {
+        Groups groups = 0;
+        std::vector< Edge > children; //sorted by byte
+    };
+    static bool Less(const Edge& e, unsigned char c) { return e.first < c; }
+    uint32_t Child(uint32_t n, unsigned char c) const {
+        const std::vector< Edge >& ch = nodes_[n].children;
+        auto i = std::lower_bound(ch.begin(), ch.end(), c, Less);
+        return i != ch.end() && i->first == c ? i->second : NONE;
+    }
+    uint32_t Insert(const unsigned char* t, size_t size) {
+        uint32_t n = 0;
+        for(size_t i = 0; i != size; ++i) {
+            std::vector< Edge >& ch = nodes_[n].children;
+            auto e = std::lower_bound(ch.begin(), ch.end(), t[i], Less);
+            if(e != ch.end() && e->first == t[i]) {
+                n = e->second;
+                continue;
+            }
+            const size_t pos = e - ch.begin();
+            //Allocate might reallocate nodes_: no references held across
+            const uint32_t c = Allocate();
+            std::vector< Edge >& children = nodes_[n].children;
+            children.insert(children.begin() + pos, Edge(t[i], c));
+            n = c;
+        }
+        return n;
+    }
+    void RemoveChild(uint32_t n, unsigned char c) {
+        std::vector< Edge >& ch = nodes_[n].children;
+        auto i = std::lower_bound(ch.begin(), ch.end(), c, Less);
+        if(i != ch.end() && i->first == c) ch.erase(i);
+    }
+    uint32_t Allocate() {
+        if(!free_.empty()) {
+            const uint32_t n = free_.back();
+            free_.pop_back();
+            return n;
+        }
+        nodes_.push_back(Node());
+        return uint32_t(nodes_.size() - 1);
+    }
+    void Free(uint32_t n) {
+        nodes_[n].groups = 0;
+        nodes_[n].children.clear();
+        free_.push_back(n);
+    }
+private:
+    std::vector< Node > nodes_; //node 0: root, empty topic
+    std::vector< uint32_t > free_;
+    std::vector< uint32_t > path_;
+    size_t size_ = 0;
+};